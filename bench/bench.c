@@ -0,0 +1,336 @@
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "6502.h"
+#include "debug.h"
+
+// Benchmark harness
+//
+// Runs every workload on every engine, a few warmup runs first and then
+// the measured repetitions, and reports the median. Micro workloads are
+// endless loops over one instruction family, macro workloads are whole
+// programs (restarted from reset whenever they stop) and longer loops.
+
+#define NOP 0xEA
+#define BRK 0x00
+#define OPTS "E:c:w:r:o:"
+
+static const char *enginesstr[] = {"interpreter", "predecode", "threaded",
+                                    "jit"};
+
+typedef struct workload {
+  const char *name;
+  const char *family;
+  const uint8_t *bytes; // Or read from path
+  size_t size;
+  const char *path;
+} BenchWorkload;
+
+typedef struct result {
+  uint64_t instructions;
+  uint64_t cycles;
+  double seconds;
+} BenchResult;
+
+// Workloads ----------------------------------------
+static const uint8_t loadstore[] = {
+    0xA9, 0x42,       // LDA #$42
+    0x8D, 0x00, 0x02, // STA $0200
+    0xA6, 0x10,       // LDX $10
+    0x86, 0x11,       // STX $11
+    0xAC, 0x00, 0x02, // LDY $0200
+    0x8C, 0x01, 0x02, // STY $0201
+    0xB5, 0x20,       // LDA $20, X
+    0x9D, 0x00, 0x03, // STA $0300, X
+    0xBD, 0x00, 0x03, // LDA $0300, X
+    0x4C, 0x00, 0x80, // JMP $8000
+};
+
+static const uint8_t alu[] = {
+    0x69, 0x03,       // ADC #$03
+    0xE9, 0x01,       // SBC #$01
+    0x29, 0x7F,       // AND #$7F
+    0x09, 0x01,       // ORA #$01
+    0x49, 0x55,       // EOR #$55
+    0xC9, 0x10,       // CMP #$10
+    0x24, 0x10,       // BIT $10
+    0x65, 0x10,       // ADC $10
+    0xE8,             // INX
+    0xC8,             // INY
+    0xE6, 0x10,       // INC $10
+    0x4C, 0x00, 0x80, // JMP $8000
+};
+
+// Relative offsets are unsigned here, so every branch goes to the next
+// instruction, taken or not
+static const uint8_t branches[] = {
+    0xE8,             // INX
+    0xD0, 0x00,       // BNE
+    0xF0, 0x00,       // BEQ
+    0x18,             // CLC
+    0x90, 0x00,       // BCC
+    0xB0, 0x00,       // BCS
+    0x10, 0x00,       // BPL
+    0x30, 0x00,       // BMI
+    0x50, 0x00,       // BVC
+    0x70, 0x00,       // BVS
+    0x4C, 0x00, 0x80, // JMP $8000
+};
+
+static const uint8_t stack[] = {
+    0xA9, 0x55,       // LDA #$55
+    0x48,             // PHA
+    0x08,             // PHP
+    0x48,             // PHA
+    0x68,             // PLA
+    0x28,             // PLP
+    0x68,             // PLA
+    0xBA,             // TSX
+    0x9A,             // TXS
+    0x4C, 0x00, 0x80, // JMP $8000
+};
+
+static const uint8_t subroutines[] = {
+    0x20, 0x10, 0x80, // JSR $8010
+    0x20, 0x10, 0x80, // JSR $8010
+    0x20, 0x12, 0x80, // JSR $8012
+    0x4C, 0x00, 0x80, // JMP $8000
+    0xEA, 0xEA, 0xEA, 0xEA,
+    0x60,             // $8010: RTS
+    0xEA,
+    0x20, 0x10, 0x80, // $8012: JSR $8010
+    0x60,             // RTS
+};
+
+// Fills a page with its index, then sums it
+static const uint8_t fillsum[] = {
+    0xA2, 0x00,       // LDX #$00
+    0x8A,             // $8002: TXA
+    0x9D, 0x00, 0x02, // STA $0200, X
+    0xE8,             // INX
+    0xF0, 0x03,       // BEQ $800C
+    0x4C, 0x02, 0x80, // JMP $8002
+    0xA2, 0x00,       // $800C: LDX #$00
+    0xA9, 0x00,       // LDA #$00
+    0x18,             // $8010: CLC
+    0x7D, 0x00, 0x02, // ADC $0200, X
+    0xE8,             // INX
+    0xF0, 0x03,       // BEQ $801A
+    0x4C, 0x10, 0x80, // JMP $8010
+    0x85, 0x10,       // $801A: STA $10
+    0xE6, 0x11,       // INC $11
+    0x4C, 0x00, 0x80, // JMP $8000
+};
+
+#define WORKLOADBYTES(a) a, sizeof(a), NULL
+#define WORKLOADFILE(p) NULL, 0, p
+
+static BenchWorkload workloads[] = {
+    {"loadstore", "micro", WORKLOADBYTES(loadstore)},
+    {"alu", "micro", WORKLOADBYTES(alu)},
+    {"branches", "micro", WORKLOADBYTES(branches)},
+    {"stack", "micro", WORKLOADBYTES(stack)},
+    {"jsrrts", "micro", WORKLOADBYTES(subroutines)},
+    {"fillsum", "macro", WORKLOADBYTES(fillsum)},
+    {"basic3", "macro", WORKLOADFILE("samples/assembly/basic/basic3.bin")},
+    {"fibonacci", "macro",
+     WORKLOADFILE("samples/assembly/fibonacci/fibonacci.bin")},
+    {"fibonacci2", "macro",
+     WORKLOADFILE("samples/assembly/fibonacci/fibonacci2.bin")},
+    {"fibonacci3", "macro",
+     WORKLOADFILE("samples/assembly/fibonacci/fibonacci3.bin")},
+};
+
+static uint8_t loadworkload(BenchWorkload *workload) {
+  if (workload->bytes)
+    return 1;
+
+  FILE *file = fopen(workload->path, "rb");
+  if (!file)
+    return 0;
+
+  uint8_t *bytes = malloc(RAM / 2);
+  if (!bytes) {
+    fclose(file);
+    return 0;
+  }
+
+  workload->size = fread(bytes, 1, RAM / 2 - VECTORSLEN, file);
+  workload->bytes = bytes;
+  fclose(file);
+
+  return workload->size > 0;
+}
+
+// Run ----------------------------------------------
+static double elapsedseconds(struct timespec *start, struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) +
+         (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Runs workload for budget cycles, from reset again whenever it stops
+static BenchResult runworkload(const BenchWorkload *workload,
+                               MOS6502Engine engine, uint64_t budget) {
+  BenchResult result = {0};
+  struct timespec start, end;
+
+  MOS6502 *cpu = mos6502_init(engine);
+  if (!cpu)
+    return result;
+
+  mos6502_loadbytes(cpu, (uint8_t *)workload->bytes, workload->size);
+  cpu->idle.skip = 0; // Measure the loops, don't skip them
+  mos6502_sethaltop(cpu, NOP);
+  mos6502_sethaltop(cpu, BRK);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (cpu->cycles < budget) {
+    if (!mos6502_run(cpu, budget - cpu->cycles))
+      break; // Stops before its first instruction
+
+    // Stopped before the budget ran out, start over
+    if (cpu->halt)
+      mos6502_reset(cpu);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  result.instructions = cpu->instructions;
+  result.cycles = cpu->cycles;
+  result.seconds = elapsedseconds(&start, &end);
+
+  mos6502_uninit(cpu);
+  return result;
+}
+
+static int byseconds(const void *a, const void *b) {
+  double x = ((const BenchResult *)a)->seconds;
+  double y = ((const BenchResult *)b)->seconds;
+
+  return (x > y) - (x < y);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-E interpreter|predecode|threaded|jit] [-c cycles] "
+          "[-w warmup runs] [-r runs] [-o results]\n",
+          name);
+}
+
+int main(int argc, char **argv) {
+
+  // Parse Args
+  int engines[sizeof(enginesstr) / sizeof(enginesstr[0])] = {0};
+  int nengines = sizeof(enginesstr) / sizeof(enginesstr[0]);
+  uint8_t allengines = 1;
+  uint64_t budget = 20000000;
+  int warmup = 1;
+  int runs = 3;
+  char *results = NULL;
+  int option = 0;
+
+  while ((option = getopt(argc, argv, OPTS)) != -1) {
+    switch (option) {
+      case 'E': {
+        int i = 0;
+        while (i < nengines && strcmp(optarg, enginesstr[i]))
+          i++;
+        if (i == nengines) {
+          fprintf(stderr, "Unknown engine: %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        engines[i] = 1;
+        allengines = 0;
+        break;
+      }
+      case 'c':
+        budget = strtoull(optarg, NULL, 0);
+        break;
+      case 'w':
+        warmup = strtol(optarg, NULL, 0);
+        break;
+      case 'r':
+        runs = strtol(optarg, NULL, 0);
+        break;
+      case 'o':
+        results = optarg;
+        break;
+      default:
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  if (runs < 1 || warmup < 0) {
+    usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  FILE *out = NULL;
+  if (results) {
+    out = fopen(results, "w");
+    if (!out) {
+      printfc(RED, "Error: can't open '%s'!\n", results);
+      exit(EXIT_FAILURE);
+    }
+    fprintf(out, "# workload family engine instructions cycles seconds mips "
+                 "mhz ns/instruction\n");
+  }
+
+  printfc(WHITE, "[-] Budget: %" PRIu64 " cycles, %d warmup, %d runs\n\n",
+          budget, warmup, runs);
+  printfc(WHITE, "%-12s %-6s %-12s %10s %10s %10s\n", "workload", "family",
+          "engine", "MIPS", "MHz", "ns/instr");
+
+  BenchResult *samples = malloc(runs * sizeof(BenchResult));
+  if (!samples)
+    exit(EXIT_FAILURE);
+
+  int nworkloads = sizeof(workloads) / sizeof(workloads[0]);
+  for (int w = 0; w < nworkloads; w++) {
+    BenchWorkload *workload = &workloads[w];
+    if (!loadworkload(workload)) {
+      printfc(RED, "Error: can't read '%s'!\n", workload->path);
+      continue;
+    }
+
+    for (int e = 0; e < nengines; e++) {
+      if (!allengines && !engines[e])
+        continue;
+
+      for (int i = 0; i < warmup; i++)
+        runworkload(workload, e, budget);
+      for (int i = 0; i < runs; i++)
+        samples[i] = runworkload(workload, e, budget);
+
+      qsort(samples, runs, sizeof(BenchResult), byseconds);
+      BenchResult *median = &samples[runs / 2];
+
+      double seconds = median->seconds > 0 ? median->seconds : 1e-9;
+      double mips = median->instructions / seconds / 1e6;
+      double mhz = median->cycles / seconds / 1e6;
+      double ns = median->instructions
+                      ? seconds * 1e9 / median->instructions
+                      : 0;
+
+      printfc(WHITE, "%-12s %-6s %-12s ", workload->name, workload->family,
+              enginesstr[e]);
+      printfc(YELLOW, "%10.2f %10.2f %10.3f\n", mips, mhz, ns);
+
+      if (out)
+        fprintf(out, "%s %s %s %" PRIu64 " %" PRIu64 " %.6f %.2f %.2f %.3f\n",
+                workload->name, workload->family, enginesstr[e],
+                median->instructions, median->cycles, median->seconds, mips,
+                mhz, ns);
+    }
+  }
+
+  free(samples);
+  if (out)
+    fclose(out);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,999 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "6502.h"
+#include "alu.h"
+#include "debug.h"
+#include "scheduler.h"
+
+// Conformance harness
+//
+// Runs single instruction test vectors (initial state, final state and
+// cycle count) on every engine and reports the mismatches per opcode and
+// per addressing mode. Vectors are read from JSON files in the
+// SingleStepTests format, one array of tests per file:
+//
+//   {"name": "a9 7a 3c", "initial": {"pc": 32768, "s": 253, "a": 0,
+//    "x": 0, "y": 0, "p": 36, "ram": [[32768, 169], [32769, 122]]},
+//    "final": {...}, "cycles": [[32768, 169, "read"], ...]}
+//
+// or from the binary files -w writes from them, which load without any
+// parsing. Files are shared out to one worker per core, each with its own
+// MOS6502 per engine, and every vector starts from zeroed memory. Vectors
+// that only differ where the core knowingly isn't an NMOS 6502 (see
+// deviations) are reported apart and don't fail the run.
+//
+// -A also sweeps ADC, SBC and the compares over every A, operand, carry
+// and decimal combination (see alu.h), and -R checks that a RESET masks a
+// pending IRQ until the handler clears I, with or without vectors.
+
+#define OPTS "E:j:w:avAR"
+#define CONFORMNAME 24
+#define CONFORMMAXRAM 16
+#define CONFORMMAGIC "6502VEC"
+#define CONFORMVERSION 1
+#define CONFORMPMASK 0xCF // B and bit 5 aren't flags
+#define NENGINES (sizeof(enginesstr) / sizeof(enginesstr[0]))
+
+static const char *enginesstr[] = {"interpreter", "predecode", "threaded",
+                                    "jit"};
+
+typedef enum mismatch {
+  MISMATCHPC = 1 << 0,
+  MISMATCHA = 1 << 1,
+  MISMATCHX = 1 << 2,
+  MISMATCHY = 1 << 3,
+  MISMATCHS = 1 << 4,
+  MISMATCHP = 1 << 5,
+  MISMATCHRAM = 1 << 6,
+  MISMATCHCYCLES = 1 << 7,
+  MISMATCHHALT = 1 << 8, // Stopped as illegal
+  NMISMATCHES = 9
+} ConformMismatch;
+
+static const char *mismatchesstr[] = {"pc", "a", "x", "y", "s",
+                                      "p",  "ram", "cycles", "halt"};
+
+typedef struct conformstate {
+  uint16_t pc;
+  uint8_t s, a, x, y, p;
+  uint8_t nram;
+  uint16_t ramaddr[CONFORMMAXRAM];
+  uint8_t ramvalue[CONFORMMAXRAM];
+} ConformState;
+
+typedef struct conformvector {
+  char name[CONFORMNAME];
+  ConformState initial, final;
+  uint32_t cycles;
+} ConformVector;
+
+// Binary vector file, in host byte order
+typedef struct conformheader {
+  char magic[8];
+  uint32_t version;
+  uint32_t vectorsize;
+  uint64_t count;
+} ConformHeader;
+
+typedef struct conformstats {
+  uint64_t tested, failed;
+  uint64_t known;     // Only differed in the fields of a known deviation
+  uint32_t fields;    // ConformMismatch seen
+  char first[160];    // First failure
+} ConformStats;
+
+typedef struct conformdeviation {
+  const char *mnemonic; // NULL for any
+  int mode;             // MOS6502AddressingModes, -1 for any
+  uint32_t fields;      // ConformMismatch it explains
+  const char *reason;
+} ConformDeviation;
+
+#define NODEVIATION -1
+
+// Where the core knowingly differs from the NMOS 6502, the first match
+// of an opcode applies. Mismatches in other fields still fail.
+static const ConformDeviation deviations[] = {
+    {"JMP", ABS, MISMATCHPC, "JMP goes to START | addr"},
+    {"JSR", ABS, MISMATCHPC | MISMATCHRAM,
+     "JSR goes to START | addr, pushes the next PC"},
+    {"RTS", IMP, MISMATCHPC, "RTS returns to the pulled PC, not PC + 1"},
+    {"ASL", -1, MISMATCHA | MISMATCHP | MISMATCHRAM, "shifts not implemented"},
+    {"LSR", -1, MISMATCHA | MISMATCHP | MISMATCHRAM, "shifts not implemented"},
+    {"ROL", -1, MISMATCHA | MISMATCHP | MISMATCHRAM, "shifts not implemented"},
+    {"ROR", -1, MISMATCHA | MISMATCHP | MISMATCHRAM, "shifts not implemented"},
+    {NULL, IND, ~0u, "indirect modes not implemented"},
+    {NULL, IDEIND, ~0u, "indirect modes not implemented"},
+    {NULL, INDIDE, ~0u, "indirect modes not implemented"},
+};
+
+#define NDEVIATIONS (sizeof(deviations) / sizeof(deviations[0]))
+
+typedef struct conform {
+  char **paths;
+  size_t npaths, next;
+  pthread_mutex_t lock;
+
+  uint8_t engines[NENGINES];
+  uint8_t all; // Also opcodes the table marks illegal
+  int8_t deviation[MAXOPCODESTABLE]; // Index in deviations, or NODEVIATION
+  const char *writedir;
+
+  uint64_t skipped, unreadable;
+  ConformStats stats[NENGINES][MAXOPCODESTABLE];
+} Conform;
+
+typedef struct conformworker {
+  pthread_t thread;
+  uint8_t started;
+  Conform *conform;
+  uint64_t skipped, unreadable;
+  ConformStats stats[NENGINES][MAXOPCODESTABLE];
+} ConformWorker;
+
+// JSON ---------------------------------------------
+typedef struct parser {
+  const char *at, *end;
+  uint8_t failed;
+} ConformParser;
+
+static void skipspace(ConformParser *p) {
+  while (p->at < p->end &&
+         (*p->at == ' ' || *p->at == '\n' || *p->at == '\r' || *p->at == '\t'))
+    p->at++;
+}
+
+static uint8_t accept(ConformParser *p, char c) {
+  skipspace(p);
+  if (p->at < p->end && *p->at == c) {
+    p->at++;
+    return 1;
+  }
+
+  return 0;
+}
+
+static void expect(ConformParser *p, char c) {
+  if (!accept(p, c))
+    p->failed = 1;
+}
+
+// Copies up to size - 1 characters, escapes are kept as they are
+static void parsestring(ConformParser *p, char *out, size_t size) {
+  size_t n = 0;
+
+  expect(p, '"');
+  while (!p->failed && p->at < p->end && *p->at != '"') {
+    if (*p->at == '\\' && p->at + 1 < p->end)
+      p->at++;
+    if (out && n + 1 < size)
+      out[n++] = *p->at;
+    p->at++;
+  }
+
+  if (out && size)
+    out[n] = '\0';
+  expect(p, '"');
+}
+
+static int64_t parsenumber(ConformParser *p) {
+  skipspace(p);
+
+  char *end;
+  int64_t value = strtoll(p->at, &end, 10);
+  if (end == p->at || end > p->end)
+    p->failed = 1;
+
+  p->at = end;
+  return value;
+}
+
+static void skipvalue(ConformParser *p) {
+  skipspace(p);
+  if (p->at >= p->end) {
+    p->failed = 1;
+    return;
+  }
+
+  if (*p->at == '"') {
+    parsestring(p, NULL, 0);
+  } else if (*p->at == '{' || *p->at == '[') {
+    char close = *p->at == '{' ? '}' : ']';
+
+    p->at++;
+    if (accept(p, close))
+      return;
+
+    do {
+      if (close == '}') {
+        parsestring(p, NULL, 0);
+        expect(p, ':');
+      }
+      skipvalue(p);
+    } while (!p->failed && accept(p, ','));
+    expect(p, close);
+  } else {
+    while (p->at < p->end && *p->at != ',' && *p->at != '}' && *p->at != ']')
+      p->at++;
+  }
+}
+
+// Elements of an array, each one skipped
+static uint32_t countvalues(ConformParser *p) {
+  uint32_t count = 0;
+
+  expect(p, '[');
+  if (accept(p, ']'))
+    return 0;
+
+  do {
+    skipvalue(p);
+    count++;
+  } while (!p->failed && accept(p, ','));
+  expect(p, ']');
+
+  return count;
+}
+
+static void parseram(ConformParser *p, ConformState *state) {
+  expect(p, '[');
+  if (accept(p, ']'))
+    return;
+
+  do {
+    expect(p, '[');
+    int64_t addr = parsenumber(p);
+    expect(p, ',');
+    int64_t value = parsenumber(p);
+    expect(p, ']');
+
+    if (state->nram == CONFORMMAXRAM) {
+      p->failed = 1;
+      return;
+    }
+
+    state->ramaddr[state->nram] = addr;
+    state->ramvalue[state->nram++] = value;
+  } while (!p->failed && accept(p, ','));
+  expect(p, ']');
+}
+
+static void parsestate(ConformParser *p, ConformState *state) {
+  char key[8];
+
+  expect(p, '{');
+  do {
+    parsestring(p, key, sizeof(key));
+    expect(p, ':');
+
+    if (!strcmp(key, "pc"))
+      state->pc = parsenumber(p);
+    else if (!strcmp(key, "s"))
+      state->s = parsenumber(p);
+    else if (!strcmp(key, "a"))
+      state->a = parsenumber(p);
+    else if (!strcmp(key, "x"))
+      state->x = parsenumber(p);
+    else if (!strcmp(key, "y"))
+      state->y = parsenumber(p);
+    else if (!strcmp(key, "p"))
+      state->p = parsenumber(p);
+    else if (!strcmp(key, "ram"))
+      parseram(p, state);
+    else
+      skipvalue(p);
+  } while (!p->failed && accept(p, ','));
+  expect(p, '}');
+}
+
+static void parsevector(ConformParser *p, ConformVector *vector) {
+  char key[16];
+
+  memset(vector, 0, sizeof(ConformVector));
+  expect(p, '{');
+  do {
+    parsestring(p, key, sizeof(key));
+    expect(p, ':');
+
+    if (!strcmp(key, "name"))
+      parsestring(p, vector->name, CONFORMNAME);
+    else if (!strcmp(key, "initial"))
+      parsestate(p, &vector->initial);
+    else if (!strcmp(key, "final"))
+      parsestate(p, &vector->final);
+    else if (!strcmp(key, "cycles"))
+      vector->cycles = countvalues(p);
+    else
+      skipvalue(p);
+  } while (!p->failed && accept(p, ','));
+  expect(p, '}');
+}
+
+static ConformVector *parsejson(const char *text, size_t size,
+                                uint64_t *count) {
+  ConformParser p = {text, text + size, 0};
+  size_t max = 1024;
+  ConformVector *vectors = malloc(max * sizeof(ConformVector));
+
+  *count = 0;
+  expect(&p, '[');
+  if (!vectors || accept(&p, ']'))
+    return vectors;
+
+  do {
+    if (*count == max) {
+      ConformVector *more = realloc(vectors, 2 * max * sizeof(ConformVector));
+      if (!more) {
+        p.failed = 1;
+        break;
+      }
+      vectors = more;
+      max *= 2;
+    }
+
+    parsevector(&p, &vectors[*count]);
+    if (!p.failed)
+      (*count)++;
+  } while (!p.failed && accept(&p, ','));
+  expect(&p, ']');
+
+  if (p.failed) {
+    free(vectors);
+    return NULL;
+  }
+
+  return vectors;
+}
+
+// Files --------------------------------------------
+static uint8_t hassuffix(const char *path, const char *suffix) {
+  size_t n = strlen(path), m = strlen(suffix);
+
+  return n >= m && !strcmp(path + n - m, suffix);
+}
+
+// JSON or binary vectors, NULL when path is neither
+static ConformVector *loadvectors(const char *path, uint64_t *count) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+    close(fd);
+    return NULL;
+  }
+
+  const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  ConformVector *vectors = NULL;
+  const ConformHeader *header = (const ConformHeader *)map;
+
+  if (st.st_size >= sizeof(ConformHeader) &&
+      !memcmp(header->magic, CONFORMMAGIC, sizeof(CONFORMMAGIC))) {
+    size_t available =
+        (st.st_size - sizeof(ConformHeader)) / sizeof(ConformVector);
+
+    if (header->version == CONFORMVERSION &&
+        header->vectorsize == sizeof(ConformVector) &&
+        header->count <= available &&
+        (vectors = malloc(header->count * sizeof(ConformVector) + 1))) {
+      memcpy(vectors, map + sizeof(ConformHeader),
+             header->count * sizeof(ConformVector));
+      *count = header->count;
+    }
+  } else {
+    vectors = parsejson(map, st.st_size, count);
+  }
+
+  munmap((void *)map, st.st_size);
+  return vectors;
+}
+
+static void writevectors(const char *dir, const char *path,
+                         const ConformVector *vectors, uint64_t count) {
+  const char *base = strrchr(path, '/');
+  base = base ? base + 1 : path;
+
+  char out[4096];
+  snprintf(out, sizeof(out), "%s/%.*s.vec", dir,
+           (int)(strchr(base, '.') ? strchr(base, '.') - base : strlen(base)),
+           base);
+
+  FILE *file = fopen(out, "wb");
+  if (!file)
+    return;
+
+  ConformHeader header = {0};
+  memcpy(header.magic, CONFORMMAGIC, sizeof(CONFORMMAGIC));
+  header.version = CONFORMVERSION;
+  header.vectorsize = sizeof(ConformVector);
+  header.count = count;
+
+  fwrite(&header, sizeof(header), 1, file);
+  fwrite(vectors, sizeof(ConformVector), count, file);
+  fclose(file);
+}
+
+static int bypath(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Adds path, or the .json and .vec files in it when it's a directory
+static uint8_t addpath(Conform *conform, const char *path) {
+  struct stat st;
+  if (stat(path, &st) < 0)
+    return 0;
+
+  if (!S_ISDIR(st.st_mode)) {
+    char **paths =
+        realloc(conform->paths, (conform->npaths + 1) * sizeof(char *));
+    if (!paths)
+      return 0;
+
+    conform->paths = paths;
+    conform->paths[conform->npaths++] = strdup(path);
+    return 1;
+  }
+
+  DIR *dir = opendir(path);
+  if (!dir)
+    return 0;
+
+  size_t first = conform->npaths;
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    if (!hassuffix(entry->d_name, ".json") && !hassuffix(entry->d_name, ".vec"))
+      continue;
+
+    char full[4096];
+    snprintf(full, sizeof(full), "%s/%s", path, entry->d_name);
+    addpath(conform, full);
+  }
+  closedir(dir);
+
+  qsort(conform->paths + first, conform->npaths - first, sizeof(char *),
+        bypath);
+  return 1;
+}
+
+// Run ----------------------------------------------
+// Zero page by page, unless the instruction wrote where the vector doesn't
+// expect it
+static void clearvector(MOS6502 *cpu, const ConformVector *vector,
+                        uint8_t stray) {
+  if (stray) {
+    mos6502_mapram(cpu, 0x0000, RAM, NULL);
+    return;
+  }
+
+  for (uint8_t i = 0; i < vector->initial.nram; i++)
+    mos6502_write(cpu, vector->initial.ramaddr[i], 0);
+  for (uint8_t i = 0; i < vector->final.nram; i++)
+    mos6502_write(cpu, vector->final.ramaddr[i], 0);
+}
+
+// Memory is all zeros before and after
+static uint32_t runvector(MOS6502 *cpu, const ConformVector *vector) {
+  const ConformState *initial = &vector->initial, *final = &vector->final;
+  uint32_t fields = 0;
+
+  for (uint8_t i = 0; i < initial->nram; i++)
+    mos6502_write(cpu, initial->ramaddr[i], initial->ramvalue[i]);
+
+  cpu->PC = initial->pc;
+  cpu->SP = initial->s;
+  cpu->A = initial->a;
+  cpu->X = initial->x;
+  cpu->Y = initial->y;
+  mos6502_setps(cpu, initial->p);
+
+  // Catches writes to pages the vector doesn't list
+  mos6502_cleardirty(cpu);
+
+  // Every instruction takes at least one cycle, so this runs exactly one
+  uint64_t cycles = mos6502_run(cpu, 1);
+
+  if (cpu->halt == HALTILLEGAL)
+    fields |= MISMATCHHALT;
+  if (cpu->PC != final->pc)
+    fields |= MISMATCHPC;
+  if (cpu->A != final->a)
+    fields |= MISMATCHA;
+  if (cpu->X != final->x)
+    fields |= MISMATCHX;
+  if (cpu->Y != final->y)
+    fields |= MISMATCHY;
+  if (cpu->SP != final->s)
+    fields |= MISMATCHS;
+  if ((mos6502_getps(cpu) ^ final->p) & CONFORMPMASK)
+    fields |= MISMATCHP;
+  if (cycles != vector->cycles)
+    fields |= MISMATCHCYCLES;
+
+  for (uint8_t i = 0; i < final->nram; i++)
+    if (mos6502_read(cpu, final->ramaddr[i]) != final->ramvalue[i])
+      fields |= MISMATCHRAM;
+
+  uint8_t expected[RAM / PAGESIZE / 8] = {0};
+  for (uint8_t i = 0; i < final->nram; i++)
+    expected[final->ramaddr[i] >> 11] |= 1 << ((final->ramaddr[i] >> 8) & 7);
+
+  uint8_t stray = 0;
+  for (int i = 0; i < RAM / PAGESIZE / 8; i++)
+    stray |= cpu->bus.dirty[i] & ~expected[i];
+  if (stray)
+    fields |= MISMATCHRAM;
+
+  clearvector(cpu, vector, stray);
+  return fields;
+}
+
+static void describe(ConformStats *stats, MOS6502 *cpu,
+                     const ConformVector *vector) {
+  const ConformState *final = &vector->final;
+
+  snprintf(stats->first, sizeof(stats->first),
+           "%s: PC %04X/%04X A %02X/%02X X %02X/%02X Y %02X/%02X "
+           "S %02X/%02X P %02X/%02X",
+           vector->name, cpu->PC, final->pc, cpu->A, final->a, cpu->X,
+           final->x, cpu->Y, final->y, cpu->SP, final->s, mos6502_getps(cpu),
+           final->p);
+}
+
+static void *worker(void *arg) {
+  ConformWorker *self = arg;
+  Conform *conform = self->conform;
+  MOS6502 *cpus[NENGINES] = {0};
+
+  for (size_t e = 0; e < NENGINES; e++) {
+    if (!conform->engines[e])
+      continue;
+
+    cpus[e] = mos6502_init(e);
+    if (cpus[e])
+      cpus[e]->idle.skip = 0;
+  }
+
+  while (1) {
+    pthread_mutex_lock(&conform->lock);
+    size_t index = conform->next++;
+    pthread_mutex_unlock(&conform->lock);
+
+    if (index >= conform->npaths)
+      break;
+
+    const char *path = conform->paths[index];
+    uint64_t count = 0;
+    ConformVector *vectors = loadvectors(path, &count);
+    if (!vectors) {
+      self->unreadable++;
+      continue;
+    }
+
+    if (conform->writedir && !hassuffix(path, ".vec"))
+      writevectors(conform->writedir, path, vectors, count);
+
+    for (uint64_t i = 0; i < count; i++) {
+      const ConformVector *vector = &vectors[i];
+      uint8_t opcode = 0;
+
+      for (uint8_t r = 0; r < vector->initial.nram; r++)
+        if (vector->initial.ramaddr[r] == vector->initial.pc)
+          opcode = vector->initial.ramvalue[r];
+
+      if (!conform->all && !strcmp(opcodes[opcode].mnemonic, ILLEGAL)) {
+        self->skipped++;
+        continue;
+      }
+
+      for (size_t e = 0; e < NENGINES; e++) {
+        if (!cpus[e])
+          continue;
+
+        ConformStats *stats = &self->stats[e][opcode];
+        uint32_t fields = runvector(cpus[e], vector);
+        int8_t deviation = conform->deviation[opcode];
+
+        stats->tested++;
+        if (!fields)
+          continue;
+
+        if (deviation != NODEVIATION &&
+            !(fields & ~deviations[deviation].fields)) {
+          stats->known++;
+          continue;
+        }
+
+        if (!stats->failed)
+          describe(stats, cpus[e], vector);
+        stats->failed++;
+        stats->fields |= fields;
+      }
+    }
+
+    free(vectors);
+  }
+
+  for (size_t e = 0; e < NENGINES; e++)
+    mos6502_uninit(cpus[e]);
+
+  return NULL;
+}
+
+static void merge(Conform *conform, ConformWorker *worker) {
+  conform->skipped += worker->skipped;
+  conform->unreadable += worker->unreadable;
+
+  for (size_t e = 0; e < NENGINES; e++) {
+    for (int i = 0; i < MAXOPCODESTABLE; i++) {
+      ConformStats *to = &conform->stats[e][i], *from = &worker->stats[e][i];
+
+      if (!to->failed && from->failed)
+        memcpy(to->first, from->first, sizeof(to->first));
+      to->tested += from->tested;
+      to->failed += from->failed;
+      to->known += from->known;
+      to->fields |= from->fields;
+    }
+  }
+}
+
+// Report -------------------------------------------
+static void printfields(uint32_t fields) {
+  for (int i = 0; i < NMISMATCHES; i++)
+    if (fields & (1 << i))
+      printfc(RED, "%s ", mismatchesstr[i]);
+}
+
+// Vectors that only differed in known ways, by reason
+static void reportknown(Conform *conform,
+                        const ConformStats stats[MAXOPCODESTABLE]) {
+  for (size_t d = 0; d < NDEVIATIONS; d++) {
+    const char *reason = deviations[d].reason;
+    uint64_t known = 0;
+    int nopcodes = 0;
+
+    size_t first = 0;
+    while (strcmp(deviations[first].reason, reason))
+      first++;
+    if (first != d)
+      continue;
+
+    for (int i = 0; i < MAXOPCODESTABLE; i++) {
+      int8_t deviation = conform->deviation[i];
+      if (deviation == NODEVIATION || !stats[i].known ||
+          strcmp(deviations[deviation].reason, reason))
+        continue;
+
+      known += stats[i].known;
+      nopcodes++;
+    }
+
+    if (known)
+      printfc(YELLOW, "    Known: %-44s %8" PRIu64 " (%d opcodes)\n", reason,
+              known, nopcodes);
+  }
+}
+
+static void report(Conform *conform, uint8_t verbose) {
+  for (size_t e = 0; e < NENGINES; e++) {
+    if (!conform->engines[e])
+      continue;
+
+    ConformStats (*stats)[MAXOPCODESTABLE] = &conform->stats[e];
+    ConformStats modes[ILL + 1] = {0};
+    uint64_t tested = 0, failed = 0, known = 0;
+    int opcodesfailed = 0;
+
+    for (int i = 0; i < MAXOPCODESTABLE; i++) {
+      tested += (*stats)[i].tested;
+      failed += (*stats)[i].failed;
+      known += (*stats)[i].known;
+      opcodesfailed += (*stats)[i].failed != 0;
+      modes[opcodes[i].mode].tested += (*stats)[i].tested;
+      modes[opcodes[i].mode].failed += (*stats)[i].failed;
+      modes[opcodes[i].mode].fields |= (*stats)[i].fields;
+    }
+
+    printfc(WHITE, "\n[-] %s: %" PRIu64 " vectors, %" PRIu64
+            " failed, %d opcodes failing, %" PRIu64 " known deviations\n",
+            enginesstr[e], tested, failed, opcodesfailed, known);
+    reportknown(conform, *stats);
+    if (!failed)
+      continue;
+
+    for (int i = 0; i < MAXOPCODESTABLE; i++) {
+      ConformStats *s = &(*stats)[i];
+      if (!s->failed)
+        continue;
+
+      printfc(WHITE, "    %02X %-4s %-13s %8" PRIu64 "/%-8" PRIu64 " ", i,
+              opcodes[i].mnemonic, addrmodesstr[opcodes[i].mode], s->failed,
+              s->tested);
+      printfields(s->fields);
+      printf("\n");
+      if (verbose)
+        printfc(GRAY, "       %s\n", s->first);
+    }
+
+    printfc(WHITE, "    By addressing mode:\n");
+    for (int m = 0; m <= ILL; m++) {
+      if (!modes[m].failed)
+        continue;
+
+      printfc(WHITE, "    %-18s %8" PRIu64 "/%-8" PRIu64 " ", addrmodesstr[m],
+              modes[m].failed, modes[m].tested);
+      printfields(modes[m].fields);
+      printf("\n");
+    }
+  }
+}
+
+static double elapsedseconds(struct timespec *start, struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) +
+         (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-E interpreter|predecode|threaded|jit] [-j threads] "
+          "[-w vec dir] [-a] [-v] [-A] [-R] vectors...\n",
+          name);
+}
+
+// Returns the mismatches of the ALU sweep
+static uint64_t alucheck(void) {
+  MOS6502AluMismatch first;
+  struct timespec start, end;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  uint64_t failed = mos6502_alucheck(&first);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  printfc(WHITE, "[-] ALU: %u combinations (%.6f s)\n", ALUCHECKED * ALUENTRIES,
+          elapsedseconds(&start, &end));
+  if (!failed)
+    return 0;
+
+  printfc(RED, "    %" PRIu64 " failed\n", failed);
+  printfc(GRAY, "    %02X %02X with A:%02X P:%02X: A:%02X P:%02X, expected "
+          "A:%02X P:%02X\n", first.opcode, first.M, first.A, first.P,
+          first.result, first.flags, first.expected, first.expectedflags);
+  return failed;
+}
+
+// RESET -------------------------------------------
+#define RESETHANDLER 0xA000
+#define IRQHANDLER 0xB000
+#define RESETAT 30 // Cycle the event raises the IRQ and RESET at
+
+static void raisereset(MOS6502 *cpu, void *data) {
+  mos6502_irq(cpu, 0, 1);
+  mos6502_interrupt(cpu, INTRESET);
+}
+
+static void writebytes(MOS6502 *cpu, uint16_t addr, const uint8_t *bytes,
+                       size_t size) {
+  for (size_t i = 0; i < size; i++)
+    mos6502_write(cpu, addr + i, bytes[i]);
+}
+
+// Spins with I clear until an event raises an IRQ and RESET together. The
+// RESET comes first and masks the IRQ, so the handler runs its two NOPs,
+// and the IRQ is only taken once its CLI clears I. Returns what went
+// wrong, NULL when nothing did.
+static const char *resetcheckengine(MOS6502Engine engine) {
+  static const uint8_t spin[] = {0x4C, 0x00, 0x80};           // JMP $8000
+  static const uint8_t handler[] = {0xEA, 0xEA, 0x58, 0xEA}; // NOP NOP CLI
+  static const uint8_t vectors[] = {0x00, RESETHANDLER >> 8, 0x00,
+                                    IRQHANDLER >> 8};
+  const char *failure = NULL;
+
+  MOS6502 *cpu = mos6502_init(engine);
+  if (!cpu)
+    return "out of memory";
+
+  writebytes(cpu, START, spin, sizeof(spin));
+  writebytes(cpu, RESETHANDLER, handler, sizeof(handler));
+  writebytes(cpu, RESETVL, vectors, sizeof(vectors));
+  mos6502_write(cpu, IRQHANDLER, 0x00); // BRK, halts
+  mos6502_sethaltop(cpu, 0x00);
+
+  cpu->PC = START;
+  cpu->SP = 0xFF;
+  mos6502_setps(cpu, 0x00);
+  if (!mos6502_schedule(cpu, RESETAT, raisereset, NULL)) {
+    mos6502_uninit(cpu);
+    return "out of memory";
+  }
+
+  // RESET takes 7 cycles, then the two NOPs
+  mos6502_run(cpu, RESETAT + 7 + 4);
+  if (cpu->PC == IRQHANDLER)
+    failure = "IRQ taken before the RESET handler ran";
+  else if (cpu->PC != RESETHANDLER + 2 || !(mos6502_getps(cpu) & 0x04))
+    failure = "RESET didn't enter the handler with I set";
+  else if (cpu->SP != 0xFC)
+    failure = "RESET didn't move SP down by 3";
+
+  // CLI, then the IRQ
+  if (!failure) {
+    mos6502_run(cpu, 2 + 7 + 2);
+    if (cpu->PC != IRQHANDLER || cpu->halt != HALTOPCODE)
+      failure = "IRQ not taken after CLI";
+  }
+
+  mos6502_uninit(cpu);
+  return failure;
+}
+
+// Returns the engines that failed
+static uint64_t resetcheck(void) {
+  uint64_t failed = 0;
+
+  for (size_t e = 0; e < NENGINES; e++) {
+    const char *failure = resetcheckengine(e);
+    if (!failure)
+      continue;
+
+    printfc(RED, "    %s: %s\n", enginesstr[e], failure);
+    failed++;
+  }
+
+  printfc(WHITE, "[-] Reset: %zu engines, %" PRIu64 " failed\n", NENGINES,
+          failed);
+  return failed;
+}
+
+int main(int argc, char **argv) {
+
+  // Parse Args
+  static Conform conform;
+  uint8_t allengines = 1;
+  uint8_t verbose = 0;
+  uint8_t alu = 0;
+  uint8_t reset = 0;
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int option = 0;
+
+  while ((option = getopt(argc, argv, OPTS)) != -1) {
+    switch (option) {
+      case 'E': {
+        size_t i = 0;
+        while (i < NENGINES && strcmp(optarg, enginesstr[i]))
+          i++;
+        if (i == NENGINES) {
+          fprintf(stderr, "Unknown engine: %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        conform.engines[i] = 1;
+        allengines = 0;
+        break;
+      }
+      case 'j':
+        threads = strtol(optarg, NULL, 0);
+        break;
+      case 'w':
+        conform.writedir = optarg;
+        break;
+      case 'a':
+        conform.all = 1;
+        break;
+      case 'v':
+        verbose = 1;
+        break;
+      case 'A':
+        alu = 1;
+        break;
+      case 'R':
+        reset = 1;
+        break;
+      default:
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  if ((optind == argc && !alu && !reset) || threads < 1) {
+    usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  uint64_t alufailed = alu ? alucheck() : 0;
+  alufailed += reset ? resetcheck() : 0;
+  if (optind == argc)
+    return alufailed ? EXIT_FAILURE : EXIT_SUCCESS;
+
+  if (allengines)
+    memset(conform.engines, 1, sizeof(conform.engines));
+
+  for (int i = 0; i < MAXOPCODESTABLE; i++) {
+    conform.deviation[i] = NODEVIATION;
+    for (size_t d = 0; d < NDEVIATIONS; d++) {
+      const ConformDeviation *deviation = &deviations[d];
+      if ((!deviation->mnemonic ||
+           !strcmp(deviation->mnemonic, opcodes[i].mnemonic)) &&
+          (deviation->mode < 0 || deviation->mode == opcodes[i].mode)) {
+        conform.deviation[i] = d;
+        break;
+      }
+    }
+  }
+
+  for (int i = optind; i < argc; i++) {
+    if (!addpath(&conform, argv[i])) {
+      printfc(RED, "Error: can't read '%s'!\n", argv[i]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if ((size_t)threads > conform.npaths)
+    threads = conform.npaths ? conform.npaths : 1;
+
+  ConformWorker *workers = calloc(threads, sizeof(ConformWorker));
+  if (!workers)
+    exit(EXIT_FAILURE);
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  pthread_mutex_init(&conform.lock, NULL);
+  int missing = -1;
+  for (int i = 0; i < threads; i++) {
+    workers[i].conform = &conform;
+    workers[i].started =
+        !pthread_create(&workers[i].thread, NULL, worker, &workers[i]);
+    if (!workers[i].started && missing < 0)
+      missing = i;
+  }
+
+  // The files are shared, so the caller takes the place of the workers
+  // that didn't start, and runs them all when none did
+  if (missing >= 0)
+    worker(&workers[missing]);
+
+  for (int i = 0; i < threads; i++) {
+    if (workers[i].started)
+      pthread_join(workers[i].thread, NULL);
+    merge(&conform, &workers[i]);
+  }
+  pthread_mutex_destroy(&conform.lock);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  printfc(WHITE, "[-] Files: %zu (%" PRIu64 " unreadable)\n", conform.npaths,
+          conform.unreadable);
+  printfc(WHITE, "[-] Threads: %d\n", threads);
+  printfc(WHITE, "[-] Skipped: %" PRIu64 " vectors of illegal opcodes\n",
+          conform.skipped);
+  printfc(WHITE, "[-] Elapsed: %.6f s\n", elapsedseconds(&start, &end));
+  report(&conform, verbose);
+
+  uint64_t failed = 0;
+  for (size_t e = 0; e < NENGINES; e++)
+    for (int i = 0; i < MAXOPCODESTABLE; i++)
+      failed += conform.stats[e][i].failed;
+
+  for (size_t i = 0; i < conform.npaths; i++)
+    free(conform.paths[i]);
+  free(conform.paths);
+  free(workers);
+
+  return failed || alufailed || conform.unreadable ? EXIT_FAILURE
+                                                   : EXIT_SUCCESS;
+}
@@ -0,0 +1,502 @@
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "alu.h"
+
+// Vector generator
+//
+// Writes single instruction test vectors in the SingleStepTests JSON
+// format for every legal opcode in opcodes.def, one file per opcode, so
+// make conform has something to run on a fresh checkout. The final states
+// come from the NMOS 6502 as documented, written out here without any of
+// the core, so the core's own quirks show up as mismatches (conform.c
+// lists the known ones). ADC, SBC and the compares use the reference in
+// alu.h, the one the ALU tables are checked against. The seed is fixed,
+// the same vectors come out every time.
+//
+// A cycle entry is listed for every bus access the instruction makes,
+// padded with dummy reads up to the documented count, page crossings and
+// taken branches included; the harness only checks how many there are.
+
+#define OPTS "n:s:"
+#define VECTORSMAXRAM 16
+#define VECTORSMAXCYCLES 8
+#define VECTORSCOUNT 1000
+#define VECTORSSTACK 0x0100
+#define VECTORSIRQ 0xFFFE
+
+typedef struct vectorstate {
+  uint16_t pc;
+  uint8_t s, a, x, y, p;
+} VectorState;
+
+typedef struct vectorbus {
+  uint16_t addr;
+  uint8_t value;
+  uint8_t write;
+} VectorBus;
+
+typedef struct vector {
+  VectorState initial, final;
+  uint8_t nram;
+  uint16_t ramaddr[VECTORSMAXRAM];
+  uint8_t initialram[VECTORSMAXRAM], finalram[VECTORSMAXRAM];
+  uint8_t ncycles;
+  VectorBus cycles[VECTORSMAXCYCLES];
+} Vector;
+
+typedef struct vectorop {
+  uint8_t opcode;
+  const char *mnemonic;
+  MOS6502AddressingModes mode;
+  uint8_t cycles, pagecross;
+} VectorOp;
+
+static const VectorOp ops[] = {
+#define OPCODE(opcode, mnemonic, exec, mode, cycles, pagecross)                \
+  {opcode, mnemonic, mode, cycles, pagecross},
+#include "opcodes.def"
+#undef OPCODE
+};
+
+// xorshift64, fixed seed
+static uint64_t seed = 0x6502650265026502ULL;
+
+static uint8_t randombyte(void) {
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  return seed >> 32;
+}
+
+// Memory ------------------------------------------
+// Every address touched gets a random initial value, the first time
+static int findram(Vector *v, uint16_t addr) {
+  for (int i = 0; i < v->nram; i++)
+    if (v->ramaddr[i] == addr)
+      return i;
+
+  int i = v->nram++;
+  v->ramaddr[i] = addr;
+  v->initialram[i] = v->finalram[i] = randombyte();
+  return i;
+}
+
+static void bus(Vector *v, uint16_t addr, uint8_t value, uint8_t write) {
+  VectorBus entry = {addr, value, write};
+  v->cycles[v->ncycles++] = entry;
+}
+
+static uint8_t readbyte(Vector *v, uint16_t addr) {
+  uint8_t value = v->finalram[findram(v, addr)];
+  bus(v, addr, value, 0);
+  return value;
+}
+
+static void writebyte(Vector *v, uint16_t addr, uint8_t value) {
+  v->finalram[findram(v, addr)] = value;
+  bus(v, addr, value, 1);
+}
+
+static void push(Vector *v, VectorState *s, uint8_t value) {
+  writebyte(v, VECTORSSTACK | s->s--, value);
+}
+
+static uint8_t pull(Vector *v, VectorState *s) {
+  return readbyte(v, VECTORSSTACK | ++s->s);
+}
+
+// Reference ---------------------------------------
+static uint8_t setnz(uint8_t p, uint8_t value) {
+  return (p & ~0x82) | (value ? 0 : 0x02) | (value & 0x80);
+}
+
+// C, Z, V and N from the ALU reference (see alu.h)
+static void setflags(VectorState *s, MOS6502AluExpected e, uint8_t mask) {
+  s->p = (s->p & ~mask) | (e.flags & mask);
+}
+
+static void compare(VectorState *s, uint8_t reg, uint8_t M) {
+  setflags(s, aluexpectedcmp(reg, M), 0x83);
+}
+
+static void adc(VectorState *s, uint8_t M) {
+  MOS6502AluExpected e = aluexpectedadc(s->a, M, s->p & 0x01, s->p & 0x08);
+
+  setflags(s, e, 0xC3);
+  s->a = e.result;
+}
+
+static void sbc(VectorState *s, uint8_t M) {
+  MOS6502AluExpected e = aluexpectedsbc(s->a, M, s->p & 0x01, s->p & 0x08);
+
+  setflags(s, e, 0xC3);
+  s->a = e.result;
+}
+
+// ASL, LSR, ROL and ROR, on A or on memory
+static uint8_t shift(VectorState *s, const char *mnemonic, uint8_t M) {
+  uint8_t carry = s->p & 0x01;
+  uint8_t result;
+
+  if (!strcmp(mnemonic, "ASL") || !strcmp(mnemonic, "ROL")) {
+    result = M << 1 | (mnemonic[0] == 'R' ? carry : 0);
+    carry = M >> 7;
+  } else {
+    result = M >> 1 | (mnemonic[0] == 'R' ? carry << 7 : 0);
+    carry = M & 0x01;
+  }
+
+  s->p = setnz((s->p & ~0x01) | carry, result);
+  return result;
+}
+
+// Taken when the flag selected by bits 6-7 equals bit 5. Returns the
+// extra cycles, one when taken and one more across a page.
+static uint8_t branch(Vector *v, VectorState *s, uint8_t opcode,
+                      uint8_t offset) {
+  static const uint8_t flags[] = {0x80, 0x40, 0x01, 0x02}; // N, V, C, Z
+  uint8_t set = (s->p & flags[opcode >> 6]) != 0;
+
+  if (set != ((opcode >> 5) & 1))
+    return 0;
+
+  uint16_t target = s->pc + (int8_t)offset;
+  uint8_t cross = ((target ^ s->pc) & 0xFF00) != 0;
+  s->pc = target;
+  return 1 + cross;
+}
+
+// Effective address of op's operand, with the reads it takes. Sets cross
+// when indexing crosses a page, the extra cycle of the reads that can.
+static uint16_t address(Vector *v, const VectorOp *op, uint8_t *cross) {
+  VectorState *s = &v->final;
+  uint16_t pc = s->pc;
+  uint16_t addr = 0, base = 0;
+
+  switch (op->mode) {
+    case IMP:
+    case ACC:
+      readbyte(v, pc + 1);
+      s->pc = pc + 1;
+      break;
+    case IMM:
+    case RELT:
+      addr = pc + 1;
+      s->pc = pc + 2;
+      break;
+    case ZP0:
+      addr = readbyte(v, pc + 1);
+      s->pc = pc + 2;
+      break;
+    case ZP0X:
+    case ZP0Y:
+      base = readbyte(v, pc + 1);
+      addr = (uint8_t)(base + (op->mode == ZP0X ? s->x : s->y));
+      s->pc = pc + 2;
+      break;
+    case ABS:
+    case IND:
+      addr = readbyte(v, pc + 1);
+      addr |= readbyte(v, pc + 2) << 8;
+      s->pc = pc + 3;
+      break;
+    case ABSX:
+    case ABSY:
+      base = readbyte(v, pc + 1);
+      base |= readbyte(v, pc + 2) << 8;
+      addr = base + (op->mode == ABSX ? s->x : s->y);
+      s->pc = pc + 3;
+      break;
+    case IDEIND: {
+      uint8_t pointer = readbyte(v, pc + 1) + s->x;
+      addr = readbyte(v, pointer);
+      addr |= readbyte(v, (uint8_t)(pointer + 1)) << 8;
+      s->pc = pc + 2;
+      break;
+    }
+    case INDIDE: {
+      uint8_t pointer = readbyte(v, pc + 1);
+      base = readbyte(v, pointer);
+      base |= readbyte(v, (uint8_t)(pointer + 1)) << 8;
+      addr = base + s->y;
+      s->pc = pc + 2;
+      break;
+    }
+    case ILL:
+      break;
+  }
+
+  *cross = (op->mode == ABSX || op->mode == ABSY || op->mode == INDIDE) &&
+           ((addr ^ base) & 0xFF00);
+  return addr;
+}
+
+// Runs op from v->final, which starts out as v->initial
+static void execute(Vector *v, const VectorOp *op) {
+  VectorState *s = &v->final;
+  const char *m = op->mnemonic;
+  uint8_t cycles = op->cycles;
+  uint8_t cross = 0;
+
+  readbyte(v, s->pc);
+  uint16_t addr = address(v, op, &cross);
+  uint16_t next = s->pc;
+
+  if (cross && op->pagecross)
+    cycles++;
+
+  // Reads of the operand, the stores and jumps never read their target
+  uint8_t M = 0;
+  if (op->mode != IMP && op->mode != ACC && op->mode != IND &&
+      strcmp(m, "STA") && strcmp(m, "STX") && strcmp(m, "STY") &&
+      strcmp(m, "JMP") && strcmp(m, "JSR"))
+    M = readbyte(v, addr);
+
+  if (!strcmp(m, "LDA"))
+    s->p = setnz(s->p, s->a = M);
+  else if (!strcmp(m, "LDX"))
+    s->p = setnz(s->p, s->x = M);
+  else if (!strcmp(m, "LDY"))
+    s->p = setnz(s->p, s->y = M);
+  else if (!strcmp(m, "STA"))
+    writebyte(v, addr, s->a);
+  else if (!strcmp(m, "STX"))
+    writebyte(v, addr, s->x);
+  else if (!strcmp(m, "STY"))
+    writebyte(v, addr, s->y);
+  else if (!strcmp(m, "AND"))
+    s->p = setnz(s->p, s->a &= M);
+  else if (!strcmp(m, "ORA"))
+    s->p = setnz(s->p, s->a |= M);
+  else if (!strcmp(m, "EOR"))
+    s->p = setnz(s->p, s->a ^= M);
+  else if (!strcmp(m, "BIT"))
+    s->p = (s->p & ~0xC2) | (M & 0xC0) | ((s->a & M) ? 0 : 0x02);
+  else if (!strcmp(m, "ADC"))
+    adc(s, M);
+  else if (!strcmp(m, "SBC"))
+    sbc(s, M);
+  else if (!strcmp(m, "CMP"))
+    compare(s, s->a, M);
+  else if (!strcmp(m, "CPX"))
+    compare(s, s->x, M);
+  else if (!strcmp(m, "CPY"))
+    compare(s, s->y, M);
+  else if (op->mode == ACC)
+    s->a = shift(s, m, s->a);
+  else if (!strcmp(m, "ASL") || !strcmp(m, "LSR") || !strcmp(m, "ROL") ||
+           !strcmp(m, "ROR") || !strcmp(m, "INC") || !strcmp(m, "DEC")) {
+    // Read-modify-write: the old value is written back first
+    uint8_t result = m[0] == 'I'   ? M + 1
+                     : m[0] == 'D' ? M - 1
+                                   : shift(s, m, M);
+    if (m[0] == 'I' || m[0] == 'D')
+      s->p = setnz(s->p, result);
+    writebyte(v, addr, M);
+    writebyte(v, addr, result);
+  } else if (op->mode == RELT) {
+    cycles += branch(v, s, op->opcode, M);
+  } else if (!strcmp(m, "JMP")) {
+    if (op->mode == IND) {
+      // The high byte doesn't carry into the next page
+      uint16_t lo = readbyte(v, addr);
+      uint16_t hi = readbyte(v, (addr & 0xFF00) | ((addr + 1) & 0x00FF));
+      addr = hi << 8 | lo;
+    }
+    s->pc = addr;
+  } else if (!strcmp(m, "JSR")) {
+    push(v, s, (next - 1) >> 8);
+    push(v, s, next - 1);
+    s->pc = addr;
+  } else if (!strcmp(m, "RTS")) {
+    s->pc = pull(v, s);
+    s->pc = (s->pc | pull(v, s) << 8) + 1;
+  } else if (!strcmp(m, "RTI")) {
+    s->p = pull(v, s) | 0x30;
+    s->pc = pull(v, s);
+    s->pc |= pull(v, s) << 8;
+  } else if (!strcmp(m, "BRK")) {
+    // The byte after BRK is skipped
+    next++;
+    push(v, s, next >> 8);
+    push(v, s, next);
+    push(v, s, s->p | 0x30);
+    s->p |= 0x04;
+    s->pc = readbyte(v, VECTORSIRQ);
+    s->pc |= readbyte(v, VECTORSIRQ + 1) << 8;
+  } else if (!strcmp(m, "PHA"))
+    push(v, s, s->a);
+  else if (!strcmp(m, "PHP"))
+    push(v, s, s->p | 0x30);
+  else if (!strcmp(m, "PLA"))
+    s->p = setnz(s->p, s->a = pull(v, s));
+  else if (!strcmp(m, "PLP"))
+    s->p = pull(v, s) | 0x30;
+  else if (!strcmp(m, "TAX"))
+    s->p = setnz(s->p, s->x = s->a);
+  else if (!strcmp(m, "TAY"))
+    s->p = setnz(s->p, s->y = s->a);
+  else if (!strcmp(m, "TXA"))
+    s->p = setnz(s->p, s->a = s->x);
+  else if (!strcmp(m, "TYA"))
+    s->p = setnz(s->p, s->a = s->y);
+  else if (!strcmp(m, "TSX"))
+    s->p = setnz(s->p, s->x = s->s);
+  else if (!strcmp(m, "TXS"))
+    s->s = s->x;
+  else if (!strcmp(m, "INX"))
+    s->p = setnz(s->p, ++s->x);
+  else if (!strcmp(m, "INY"))
+    s->p = setnz(s->p, ++s->y);
+  else if (!strcmp(m, "DEX"))
+    s->p = setnz(s->p, --s->x);
+  else if (!strcmp(m, "DEY"))
+    s->p = setnz(s->p, --s->y);
+  else if (!strcmp(m, "CLC"))
+    s->p &= ~0x01;
+  else if (!strcmp(m, "SEC"))
+    s->p |= 0x01;
+  else if (!strcmp(m, "CLI"))
+    s->p &= ~0x04;
+  else if (!strcmp(m, "SEI"))
+    s->p |= 0x04;
+  else if (!strcmp(m, "CLD"))
+    s->p &= ~0x08;
+  else if (!strcmp(m, "SED"))
+    s->p |= 0x08;
+  else if (!strcmp(m, "CLV"))
+    s->p &= ~0x40;
+
+  while (v->ncycles < cycles)
+    readbyte(v, s->pc);
+}
+
+static void generate(Vector *v, const VectorOp *op) {
+  memset(v, 0, sizeof(*v));
+
+  // Clear of the ends of memory, so the operands don't wrap
+  v->initial.pc = 0x0200 + (randombyte() << 8 | randombyte()) % 0xFD00;
+  v->initial.s = randombyte();
+  v->initial.a = randombyte();
+  v->initial.x = randombyte();
+  v->initial.y = randombyte();
+  v->initial.p = randombyte() | 0x30;
+
+  int i = findram(v, v->initial.pc);
+  v->initialram[i] = v->finalram[i] = op->opcode;
+  v->final = v->initial;
+  execute(v, op);
+}
+
+// JSON --------------------------------------------
+static void writestate(FILE *file, const VectorState *s, const Vector *v,
+                       const uint8_t *ram) {
+  fprintf(file,
+          "{\"pc\": %u, \"s\": %u, \"a\": %u, \"x\": %u, \"y\": %u, "
+          "\"p\": %u, \"ram\": [",
+          s->pc, s->s, s->a, s->x, s->y, s->p);
+  for (int i = 0; i < v->nram; i++)
+    fprintf(file, "%s[%u, %u]", i ? ", " : "", v->ramaddr[i], ram[i]);
+  fprintf(file, "]}");
+}
+
+static void writevector(FILE *file, const Vector *v) {
+  uint16_t pc = v->initial.pc;
+  uint8_t bytes[3];
+
+  for (int i = 0; i < 3; i++) {
+    bytes[i] = 0;
+    for (int j = 0; j < v->nram; j++)
+      if (v->ramaddr[j] == (uint16_t)(pc + i))
+        bytes[i] = v->initialram[j];
+  }
+
+  fprintf(file, "{\"name\": \"%02x %02x %02x\", \"initial\": ", bytes[0],
+          bytes[1], bytes[2]);
+  writestate(file, &v->initial, v, v->initialram);
+  fprintf(file, ", \"final\": ");
+  writestate(file, &v->final, v, v->finalram);
+  fprintf(file, ", \"cycles\": [");
+  for (int i = 0; i < v->ncycles; i++)
+    fprintf(file, "%s[%u, %u, \"%s\"]", i ? ", " : "", v->cycles[i].addr,
+            v->cycles[i].value, v->cycles[i].write ? "write" : "read");
+  fprintf(file, "]}");
+}
+
+// Returns 0 when the file can't be written
+static int writeop(const char *dir, const VectorOp *op, uint32_t count) {
+  char path[4096];
+  Vector v;
+
+  snprintf(path, sizeof(path), "%s/%02x.json", dir, op->opcode);
+  FILE *file = fopen(path, "w");
+  if (!file)
+    return 0;
+
+  fprintf(file, "[");
+  for (uint32_t i = 0; i < count; i++) {
+    generate(&v, op);
+    fprintf(file, "%s", i ? ",\n" : "");
+    writevector(file, &v);
+  }
+  fprintf(file, "]\n");
+
+  return !fclose(file);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-n vectors per opcode] [-s seed] dir\n", name);
+}
+
+int main(int argc, char **argv) {
+
+  // Parse Args
+  uint32_t count = VECTORSCOUNT;
+  int option = 0;
+
+  while ((option = getopt(argc, argv, OPTS)) != -1) {
+    switch (option) {
+      case 'n':
+        count = strtoul(optarg, NULL, 0);
+        break;
+      case 's':
+        seed = strtoull(optarg, NULL, 0);
+        break;
+      default:
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  if (optind != argc - 1 || !seed) {
+    usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  const char *dir = argv[optind];
+  if (mkdir(dir, 0755) && errno != EEXIST) {
+    fprintf(stderr, "Error: can't create '%s'!\n", dir);
+    exit(EXIT_FAILURE);
+  }
+
+  size_t written = 0;
+  for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+    if (!strcmp(ops[i].mnemonic, ILLEGAL))
+      continue;
+
+    if (!writeop(dir, &ops[i], count)) {
+      fprintf(stderr, "Error: can't write the vectors to '%s'!\n", dir);
+      exit(EXIT_FAILURE);
+    }
+    written++;
+  }
+
+  printf("[-] Vectors: %zu opcodes, %u each in %s\n", written, count, dir);
+  return EXIT_SUCCESS;
+}
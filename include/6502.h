@@ -5,9 +5,14 @@
 #include <stdint.h>
 
 #define RAM (1 << 16)
+#define PAGESIZE (1 << 8)
 
+#define NMIVL 0xFFFA
+#define NMIVH 0xFFFB
 #define RESETVL 0xFFFC
 #define RESETVH 0xFFFD
+#define IRQVL 0xFFFE
+#define IRQVH 0xFFFF
 #define STARTL 0x00
 #define STARTH 0x80
 #define START 0x8000
@@ -18,26 +23,91 @@
 #define MAXOPCODESTABLE 256
 #define ILLEGAL "ILLG"
 
+#define NOBREAKPOINT -1
+
 typedef struct cpu MOS6502;
-typedef struct instruction_context MOS6502IContext;
+typedef struct decoded MOS6502Decoded;
+typedef struct jit MOS6502Jit;
+typedef struct trace MOS6502Trace;
+typedef struct profile MOS6502Profile;
+typedef struct mapper MOS6502Mapper;
+typedef struct scheduler MOS6502Scheduler;
+typedef struct replay MOS6502Replay;
+typedef struct cfg MOS6502Cfg;
 
 #define CPU (cpu)
-#define ZZ (CPU->status.flags.Z)
-#define VV (CPU->status.flags.V)
-#define NN (CPU->status.flags.N)
 
 typedef uint8_t (*readbusfunc)(MOS6502 *cpu, uint16_t addr);
 typedef uint8_t (*writebusfunc)(MOS6502 *cpu, uint16_t addr, uint8_t data);
-typedef uint8_t (*executeop)(MOS6502 *cpu, MOS6502IContext *context);
+// Runs one instruction, operand is the byte or address after the opcode.
+// Returns 0 when the instruction isn't implemented.
+typedef uint8_t (*executeop)(MOS6502 *cpu, uint16_t operand);
 
-// cpu bus
-typedef struct cpubus {
-  uint8_t ram[RAM];
+// memory map entry, one per 256 byte page
+typedef struct page {
+  const uint8_t *read; // Host memory for RAM and ROM pages, NULL for I/O
+  uint8_t *write;      // NULL for ROM, I/O and copy-on-write pages
+} MOS6502Page;
 
+typedef struct iohandlers {
   readbusfunc read;
   writebusfunc write;
+} MOS6502IOHandlers;
+
+typedef enum page_flags {
+  PAGECOW = 1 << 0,   // Private copy of read made on the first write
+  PAGEOWNED = 1 << 1, // read was allocated by this instance
+  PAGEWATCH = 1 << 2, // Writable, write is cleared to catch the next write
+  PAGEPURE = 1 << 3   // I/O reads without side effects, see mos6502_markpure
+} MOS6502PageFlags;
+
+// cpu bus
+typedef struct cpubus {
+  MOS6502Page pages[RAM / PAGESIZE];
+  uint8_t flags[RAM / PAGESIZE];     // MOS6502PageFlags
+  uint8_t codepages[RAM / PAGESIZE]; // Pages an engine has cached code from
+  uint8_t dirty[RAM / PAGESIZE / 8]; // Pages written since mos6502_cleardirty
+  MOS6502IOHandlers *io;             // Per page, allocated by mos6502_mapio
 } MOS6502Bus;
 
+// idle loop detection, see engines.h
+typedef struct idle {
+  uint8_t skip;                 // Fast-forward idle loops, on by default
+  uint16_t pc;                  // JMP closing the loop checked last
+  uint16_t wait;                // Jumps back to pc before checking it again
+  uint16_t backoff;             // Next wait
+  uint64_t skipped;             // Cycles fast-forwarded
+  uint64_t skippedinstructions; // Instructions fast-forwarded
+} MOS6502Idle;
+
+// superinstructions, see Superinstructions in 6502.c
+typedef enum fusions {
+  FUSENONE = 0,
+  FUSELOADSTORE,     // LDA / STA
+  FUSECOMPAREBRANCH, // CMP / BNE
+  FUSECOUNTBRANCH,   // DEX / BNE
+  FUSECLEARADD,      // CLC / ADC
+  FUSECOUNTCOMPARE,  // INX / CPX / BNE
+  FUSIONS
+} MOS6502FusionKind;
+
+#define FUSEMAXSPAN 6 // Bytes, INX / CPX abs / BNE
+
+typedef struct fusion {
+  uint8_t enabled;          // Predecode engine only, on by default
+  uint64_t runs[FUSIONS];   // Sequences run through to the end
+  uint64_t splits[FUSIONS]; // Left early, see fused()
+  uint64_t instructions;    // Retired as part of a sequence
+} MOS6502Fusion;
+
+// execution engines
+typedef enum engines {
+  INTERPRETER = 0, // Decode every instruction on every execution
+  PREDECODE,       // Cache decoded instructions per PC
+  THREADED,        // Computed goto dispatch, one label per opcode
+  JIT              // Basic blocks translated to x86-64
+} MOS6502Engine;
+
 // cpu interface
 typedef struct cpu {
   uint8_t X, Y;
@@ -57,11 +127,56 @@ typedef struct cpu {
       uint8_t N : 1;      // 7 - Negative
     } flags;
     uint8_t ps;
-  } status;
+  } status; // Only I, D and B are current, see mos6502_getps
+
+  // Lazy flags, kept as whatever they were last derived from
+  uint16_t nz; // Z when the low byte is 0, N when bit 7 or bit 15 is set
+  uint8_t c;   // C when not 0
+  uint8_t v;   // V when bit 7 is set
+
+  // Timing and run control
+  uint64_t cycles;
+  uint64_t instructions;
+  int32_t breakpoint;                   // NOBREAKPOINT or a PC
+  uint8_t haltops[MAXOPCODESTABLE / 8]; // Stop before these opcodes
+  uint8_t halt;                         // MOS6502HaltReasons
+  MOS6502Idle idle;
+  MOS6502Fusion fusion;
+
+  // Interrupts, taken by mos6502_run between instructions
+  uint8_t irq;     // IRQ line, one bit per source holding it low
+  uint8_t pending; // MOS6502Interrupts edges not taken yet
+  MOS6502Scheduler *scheduler; // Allocated by the first mos6502_schedule
+
+  MOS6502Engine engine; // Used by mos6502_run, can be changed at any time
+  MOS6502Decoded *icache[RAM / PAGESIZE]; // Lazily allocated per page
+  MOS6502Jit *jit;                        // Allocated on the first JIT run
+  MOS6502Trace *trace;                    // Set by mos6502_tracestart
+  MOS6502Profile *profile;                // Set by mos6502_profilestart
+  MOS6502Mapper *mapper;                  // Set by mos6502_mapperstart
+  MOS6502Replay *replay;                  // Set when recording or replaying
+  MOS6502Cfg *cfg;                        // Set by mos6502_cfgattach
 
   MOS6502Bus bus;
 } MOS6502;
 
+typedef enum halt_reasons {
+  HALTNONE = 0, // Running
+  HALTILLEGAL,  // Illegal opcode
+  HALTOPCODE,   // Opcode in the halt set
+  HALTBREAK,    // PC reached the breakpoint
+  HALTEXTERNAL, // Requested by a bus handler
+  HALTIDLE,     // Idle loop with no deadline to skip to
+  HALTPENDING,  // Internal, back to mos6502_run for an event or interrupt
+  HALTREPLAY    // The guest left the replayed log, or the log ended
+} MOS6502HaltReasons;
+
+typedef enum interrupts {
+  INTNMI = 1 << 0,  // Taken even with I set
+  INTRESET = 1 << 1, // mos6502_reset
+  INTIRQ = 1 << 2    // Only in replay logs, IRQ is a line
+} MOS6502Interrupts;
+
 typedef enum addressing_modes {
   IMP = 0, // Implied
   ACC,     // Accumulator
@@ -79,27 +194,162 @@ typedef enum addressing_modes {
   ILL      // Illegal Opcodes
 } MOS6502AddressingModes;
 
-typedef struct instruction_context {
-  uint8_t operand_immediate;
-  uint8_t zeropage_addr;
-  uint8_t relativebranch;
-  uint16_t absolute_addr;
-} MOS6502IContext;
+// What a handler does with its operand, see instructions.h
+typedef enum access_kinds {
+  ACCESSNONE = 0, // Registers and flags only
+  ACCESSSTACK,    // Pushes or pulls
+  ACCESSCONTROL,  // Sets PC from the stack or a vector
+  ACCESSREAD,
+  ACCESSWRITE,
+  ACCESSMODIFY, // Reads and writes back
+  ACCESSBRANCH,
+  ACCESSJUMP,
+  ACCESSIGNORE // Not implemented, the operand is skipped
+} MOS6502AccessKind;
+
+// decoded instruction (predecode cache entry)
+typedef struct decoded {
+  executeop exec; // Specialized handler of the opcode
+  uint16_t operand; // Immediate/relative byte or base address
+  uint8_t opcode;
+  uint8_t mode;     // Effective-address kind (MOS6502AddressingModes)
+  uint8_t length;
+  uint8_t valid;
+
+  // Superinstruction starting here, only in the predecode cache
+  uint8_t fused;        // MOS6502FusionKind
+  uint8_t span;         // Bytes of the whole sequence, length when not fused
+  uint8_t next[2];      // Opcodes of the instructions after this one
+  uint16_t operands[2]; // and their operands
+} MOS6502Decoded;
 
 typedef struct instruction {
   uint8_t opcode;
   char mnemonic[MAXMNEMONIC];
 
-  executeop exec;
+  executeop exec; // Specialized for the opcode, see instructions.h
   MOS6502AddressingModes mode;
+
+  uint8_t cycles;    // Base cycles
+  uint8_t pagecross; // +1 cycle when the indexed address crosses a page
+  uint8_t access;    // MOS6502AccessKind of the handler
 } MOS6502Instruction;
 
 extern struct instruction opcodes[MAXOPCODESTABLE];
 
-MOS6502 *mos6502_init();
+MOS6502 *mos6502_init(MOS6502Engine engine);
 void mos6502_uninit(MOS6502 *cpu);
 uint8_t mos6502_reset(MOS6502 *cpu);
 uint16_t mos6502_loadbytes(MOS6502 *cpu, uint8_t *bytes, uint16_t size);
+// Maps whole pages of bytes copy-on-write and copies the partial pages at
+// either end, so bytes must outlive cpu. Returns the bytes loaded.
+uint32_t mos6502_loadsegment(MOS6502 *cpu, uint16_t addr, const uint8_t *bytes,
+                             uint32_t size);
 uint16_t mos6502_execute(MOS6502 *cpu);
+uint64_t mos6502_run(MOS6502 *cpu, uint64_t cycles);
+void mos6502_sethaltop(MOS6502 *cpu, uint8_t opcode);
+
+// Interrupt lines. IRQ is level triggered: it's taken while any source
+// holds it and I is clear, until the device releases it. NMI and RESET are
+// edges, taken once each. Both push PC and P (with B clear) and continue
+// at the vector with I set, RTI returns.
+void mos6502_irq(MOS6502 *cpu, uint8_t source, uint8_t level);
+void mos6502_interrupt(MOS6502 *cpu, MOS6502Interrupts line);
+
+// Memory map, addr and size are rounded to whole pages. Everything starts
+// out as private RAM, allocated a page at a time on the first write.
+// Host memory passed to maprom and mapshared is never written, so one
+// image can back any number of instances.
+void mos6502_mapram(MOS6502 *cpu, uint16_t addr, uint32_t size, uint8_t *host);
+void mos6502_maprom(MOS6502 *cpu, uint16_t addr, uint32_t size,
+                    const uint8_t *host);
+void mos6502_mapshared(MOS6502 *cpu, uint16_t addr, uint32_t size,
+                       const uint8_t *host);
+void mos6502_mapio(MOS6502 *cpu, uint16_t addr, uint32_t size,
+                   readbusfunc read, writebusfunc write);
+// ROM that keeps the write handlers of its pages, for bank switching
+void mos6502_mapbank(MOS6502 *cpu, uint16_t addr, uint32_t size,
+                     const uint8_t *host);
+// Writes to ROM pages go to write, reads still come from the page
+void mos6502_mapcontrol(MOS6502 *cpu, uint16_t addr, uint32_t size,
+                        writebusfunc write);
+// I/O pages whose read handler has no side effects and keeps returning the
+// same value until a write, an event or an interrupt changes it. Idle
+// loops polling them are skipped up to the next event. Mark them before
+// running, the JIT looks for idle loops when it translates them. Cleared
+// by remapping.
+void mos6502_markpure(MOS6502 *cpu, uint16_t addr, uint32_t size);
+uint8_t mos6502_writeslow(MOS6502 *cpu, uint16_t addr, uint8_t data);
+uint8_t mos6502_replayread(MOS6502 *cpu, uint16_t addr);
+void mos6502_invalidate(MOS6502 *cpu, uint16_t addr);
+// Page holding an image or written memory, not I/O or untouched RAM
+uint8_t mos6502_isloaded(MOS6502 *cpu, uint8_t index);
+
+// Dirty pages, a page is dirty from its first write (or remap) after
+// mos6502_cleardirty. Writable pages are write protected until then, so
+// tracking costs nothing on the mos6502_write fast path.
+void mos6502_cleardirty(MOS6502 *cpu);
+
+static inline uint8_t mos6502_isdirty(MOS6502 *cpu, uint8_t index) {
+  return cpu->bus.dirty[index >> 3] & (1 << (index & 7));
+}
+
+// Status register, materialized from the lazy flags
+static inline uint8_t mos6502_getps(MOS6502 *cpu) {
+  return (cpu->status.ps & 0x3C) | (cpu->c != 0) |
+         ((uint8_t)cpu->nz == 0) << 1 | (cpu->v & 0x80) >> 1 |
+         ((cpu->nz & 0x8080) != 0) << 7;
+}
+
+static inline void mos6502_setps(MOS6502 *cpu, uint8_t ps) {
+  cpu->status.ps = ps;
+  cpu->nz = ((ps & 0x02) == 0) | (ps & 0x80) << 8;
+  cpu->c = ps & 0x01;
+  cpu->v = (ps & 0x40) << 1;
+}
+
+// Leave the engine at the next instruction, unless it's halting anyway
+static inline void mos6502_attention(MOS6502 *cpu) {
+  if (!cpu->halt)
+    cpu->halt = HALTPENDING;
+}
+
+// For instructions that can clear I
+static inline void mos6502_checkirq(MOS6502 *cpu) {
+  if (cpu->irq && !cpu->status.flags.I)
+    mos6502_attention(cpu);
+}
+
+static inline uint8_t mos6502_ioread(MOS6502 *cpu, uint16_t addr) {
+  MOS6502IOHandlers *io = cpu->bus.io ? &cpu->bus.io[addr >> 8] : NULL;
+  return io && io->read ? io->read(cpu, addr) : 0xFF;
+}
+
+static inline uint8_t mos6502_read(MOS6502 *cpu, uint16_t addr) {
+  MOS6502Page *page = &cpu->bus.pages[addr >> 8];
+
+  if (page->read)
+    return page->read[addr & 0xFF];
+
+  // Logged or fed back from a log, see replay.h
+  if (cpu->replay)
+    return mos6502_replayread(cpu, addr);
+
+  return mos6502_ioread(cpu, addr);
+}
+
+static inline uint8_t mos6502_write(MOS6502 *cpu, uint16_t addr, uint8_t data) {
+  MOS6502Page *page = &cpu->bus.pages[addr >> 8];
+
+  if (cpu->bus.codepages[addr >> 8])
+    mos6502_invalidate(cpu, addr);
+
+  if (page->write) {
+    page->write[addr & 0xFF] = data;
+    return 1;
+  }
+
+  return mos6502_writeslow(cpu, addr, data);
+}
 
 #endif
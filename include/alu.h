@@ -0,0 +1,126 @@
+#ifndef _ALU_H
+#define _ALU_H
+
+#include "6502.h"
+
+// ALU
+//
+// ADC and SBC come from tables built once by mos6502_aluinit, one entry
+// per decimal flag, carry, A and operand:
+//
+//   index  D << 17 | C << 16 | A << 8 | M
+//   entry  bits 0-15 nz, 16-23 result, 24 C, 31 V
+//
+// so an instruction is one load and a few shifts straight into the lazy
+// flags, in binary and decimal mode alike. Decimal mode follows the NMOS
+// 6502, invalid BCD digits included: ADC takes N and V from the sum before
+// the high digit is adjusted and Z from the binary sum, SBC takes every
+// flag from the binary difference. CMP, CPX and CPY always compare in
+// binary, they use the SBC entries with D clear and C set.
+//
+// mos6502_alucheck runs every A, operand, carry and decimal combination
+// through the ADC, SBC, CMP, CPX and CPY handlers and compares them with the
+// reference below, written straight from the datasheet arithmetic. The
+// conformance vector generator works its results out with it too.
+
+#define ALUENTRIES (1 << 18)
+#define ALUDECIMAL (1 << 17)
+#define ALUCARRY (1 << 16)
+#define ALUCHECKED 5 // Opcodes mos6502_alucheck runs
+
+typedef struct alumismatch {
+  uint8_t opcode; // Immediate mode ADC, SBC, CMP, CPX or CPY
+  uint8_t A, M;
+  uint8_t P;      // Before, C and D are the ones that matter
+  uint8_t result, expected;
+  uint8_t flags, expectedflags;
+} MOS6502AluMismatch;
+
+extern uint32_t aluadc[ALUENTRIES];
+extern uint32_t alusbc[ALUENTRIES];
+
+// Builds the tables the first time, from any thread
+void mos6502_aluinit(void);
+// Returns the mismatches, first is the first one when there are any
+uint64_t mos6502_alucheck(MOS6502AluMismatch *first);
+
+static inline uint32_t aluindex(uint8_t decimal, uint8_t carry, uint8_t A,
+                                uint8_t M) {
+  return decimal << 17 | carry << 16 | A << 8 | M;
+}
+
+// Reference ----------------------------------------
+// The datasheet arithmetic on plain ints: signed ranges for V and whole
+// numbers for the digit carries, nothing shared with the tables
+typedef struct aluexpected {
+  uint8_t result;
+  uint8_t flags; // C, Z, V and N
+} MOS6502AluExpected;
+
+static inline uint8_t alunvzc(int n, int v, int z, int c) {
+  return (c ? 0x01 : 0) | (z ? 0x02 : 0) | (v ? 0x40 : 0) | (n ? 0x80 : 0);
+}
+
+static inline MOS6502AluExpected aluexpectedadc(int A, int M, int carry,
+                                                int decimal) {
+  int binary = A + M + carry;
+  int sign = (int8_t)A + (int8_t)M + carry;
+  MOS6502AluExpected e = {binary,
+                          alunvzc(binary & 0x80, sign < -128 || sign > 127,
+                                  !(binary & 0xFF), binary > 0xFF)};
+
+  if (!decimal)
+    return e;
+
+  int lo = (A & 0x0F) + (M & 0x0F) + carry;
+  if (lo >= 0x0A)
+    lo = ((lo + 0x06) & 0x0F) + 0x10;
+
+  int sum = (A & 0xF0) + (M & 0xF0) + lo;
+  int signedsum = (int8_t)(A & 0xF0) + (int8_t)(M & 0xF0) + lo;
+  int n = sum & 0x80, v = signedsum < -128 || signedsum > 127;
+
+  if (sum >= 0xA0)
+    sum += 0x60;
+
+  e.result = sum;
+  e.flags = alunvzc(n, v, !(binary & 0xFF), sum >= 0x100);
+  return e;
+}
+
+static inline MOS6502AluExpected aluexpectedsbc(int A, int M, int carry,
+                                                int decimal) {
+  int binary = A - M - !carry;
+  int sign = (int8_t)A - (int8_t)M - !carry;
+  MOS6502AluExpected e = {binary,
+                          alunvzc(binary & 0x80, sign < -128 || sign > 127,
+                                  !(binary & 0xFF), binary >= 0)};
+
+  if (!decimal)
+    return e;
+
+  int lo = (A & 0x0F) - (M & 0x0F) + carry - 1;
+  if (lo < 0)
+    lo = ((lo - 0x06) & 0x0F) - 0x10;
+
+  int difference = (A & 0xF0) - (M & 0xF0) + lo;
+  if (difference < 0)
+    difference -= 0x60;
+
+  e.result = difference;
+  return e;
+}
+
+// Result is A, the register compared is left as it was
+static inline MOS6502AluExpected aluexpectedcmp(int A, int M) {
+  MOS6502AluExpected e = {A, alunvzc((A - M) & 0x80, 0, A == M, A >= M)};
+  return e;
+}
+
+// Status register bits of an entry, for callers without lazy flags
+static inline uint8_t aluflags(uint32_t entry) {
+  return (entry >> 24 & 0x01) | ((uint8_t)entry == 0) << 1 |
+         (entry >> 25 & 0x40) | ((entry & 0x8080) != 0) << 7;
+}
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef _ASSEMBLER_H
+#define _ASSEMBLER_H
+
+#include "6502.h"
+
+// Assembler
+//
+// Assembles 6502 source in the syntax of the samples (vasm's standard
+// syntax) straight into memory, no files or processes involved. Mnemonics
+// and addressing modes come from the opcode table, so anything the table
+// describes can be assembled:
+//
+//   label:                  Labels, case sensitive
+//   .equ NAME, expr         Also NAME = expr and .set
+//   .org expr               Sets the address, 0 at the start
+//   .byte expr, "text"      Also .db, and .word / .dw (little endian)
+//   lda #expr               Operands: #imm, addr, addr,X, addr,Y, (ind),
+//   sta (addr),Y            (ind,X), (ind),Y and A; zero page is picked
+//                           when the address is known and fits
+//   ; comment
+//
+// Numbers are decimal, $hex, 0xhex, %binary or 'c'. Expressions have
+// + - * / % & | ^ << >>, unary - ~ < (low byte) > (high byte), parens and
+// * for the current address. Addresses start at 0, like the samples
+// assembled with -Fbin, and are loaded at a base (START for the samples).
+// Forward references are resolved by repeating passes until every address
+// settles.
+
+#define ASMMAXSYMBOL 32
+#define ASMMAXPASSES 16
+
+typedef struct asmerror {
+  uint32_t line; // From 1, 0 when it isn't about one line
+  char message[96];
+} MOS6502AsmError;
+
+typedef void (*asmemitfunc)(void *context, uint16_t addr, uint8_t data);
+
+// Calls emit for every assembled byte. Returns the size of the image (the
+// highest address written + 1), or -1 with error filled in.
+int32_t mos6502_assemblewith(const char *source, size_t size,
+                             asmemitfunc emit, void *context,
+                             MOS6502AsmError *error);
+// Into out, indexed by address, bytes past max are an error
+int32_t mos6502_assemblebuffer(const char *source, size_t size, uint8_t *out,
+                               uint32_t max, MOS6502AsmError *error);
+// Into cpu memory at base + address, then resets cpu
+int32_t mos6502_assembleinto(MOS6502 *cpu, uint16_t base, const char *source,
+                             size_t size, MOS6502AsmError *error);
+
+#endif
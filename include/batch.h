@@ -0,0 +1,26 @@
+#ifndef _BATCH_H
+#define _BATCH_H
+
+#include "6502.h"
+
+// Batch runner
+//
+// Runs every job of a manifest on a pool of worker threads and writes the
+// final state of each job, in manifest order, to a results file. One job
+// per line, '#' starts a comment:
+//
+//   <image> <cycle budget> [addr=value ...]
+//
+// Images (any format of loader.h) are opened once and mapped copy-on-write
+// into every job that uses them. Jobs stop on their budget or on the same
+// halt conditions as headless mode (NOP, BRK, illegal opcodes).
+//
+// With lanes set, runs of up to lanes consecutive jobs with the same image
+// and budget are run together on the lockstep core instead (lockstep.h).
+
+#define BATCHMAXPATCHES 16
+
+int mos6502_batch(const char *manifest, const char *results, int threads,
+                  MOS6502Engine engine, size_t lanes);
+
+#endif
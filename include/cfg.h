@@ -0,0 +1,84 @@
+#ifndef _CFG_H
+#define _CFG_H
+
+#include <stddef.h>
+
+#include "6502.h"
+
+// Static control flow graph
+//
+// mos6502_cfgbuild disassembles a loaded image without running it. From
+// the reset vector, the NMI and IRQ vectors and any extra roots it follows
+// every path the way the core executes it: branches to pc + 2 + signed
+// offset, JMP and JSR to START | addr, and JSR falls
+// through to its return address. RTS, RTI, BRK, JMP (ind) and illegal
+// opcodes end a path, as do bytes in I/O pages, which are never read.
+//
+// The code found is split into basic blocks at every root, jump target and
+// fall through after a control transfer. Bytes of loaded pages that aren't
+// code are data regions. Both lists are sorted by address.
+//
+// The graph is a snapshot: code written after it was built isn't in it.
+// mos6502_cfgattach hands it to an instance, which predecodes (PREDECODE)
+// or translates (JIT) its blocks up front and adds hot blocks to the
+// profile report.
+
+#define CFGMAXROOTS 16
+
+typedef enum cfg_flags {
+  CFGINSTRUCTION = 1 << 0, // First byte of an instruction
+  CFGOPERAND = 1 << 1,     // Operand byte of an instruction
+  CFGLEADER = 1 << 2,      // A block starts here
+  CFGTARGET = 1 << 3,      // Target of a branch, JMP or JSR
+  CFGROOT = 1 << 4         // Vector or extra root
+} MOS6502CfgFlags;
+
+typedef enum cfg_exits {
+  CFGFALL = 0, // Into the next block, which is a leader
+  CFGBRANCH,   // Not taken, then taken
+  CFGJUMP,
+  CFGCALL,     // JSR, target then return address
+  CFGRETURN,   // RTS or RTI
+  CFGSTOP      // BRK, JMP (ind), illegal opcode or unreadable bytes
+} MOS6502CfgExit;
+
+typedef struct cfgblock {
+  uint16_t start;
+  uint32_t size;         // Bytes
+  uint32_t instructions;
+  uint32_t cycles;       // Base cycles of one trip through
+  uint8_t exit;          // MOS6502CfgExit
+  uint8_t nsuccs;
+  uint16_t succs[2];
+} MOS6502CfgBlock;
+
+typedef struct cfgregion {
+  uint16_t start;
+  uint32_t size;
+} MOS6502CfgRegion;
+
+typedef struct cfg {
+  uint8_t flags[RAM]; // MOS6502CfgFlags per byte
+
+  MOS6502CfgBlock *blocks;
+  uint32_t nblocks, maxblocks;
+  MOS6502CfgRegion *data;
+  uint32_t ndata, maxdata;
+
+  uint32_t instructions;
+  uint32_t overlaps; // Instructions starting inside another one
+} MOS6502Cfg;
+
+// NULL when out of memory
+MOS6502Cfg *mos6502_cfgbuild(MOS6502 *cpu, const uint16_t *roots,
+                             size_t nroots);
+void mos6502_cfgfree(MOS6502Cfg *cfg);
+// The block holding addr, NULL when it isn't code
+const MOS6502CfgBlock *mos6502_cfgblock(const MOS6502Cfg *cfg, uint16_t addr);
+// Graphviz, one node per block and data region. Returns 0 on failure.
+uint8_t mos6502_cfgwrite(const MOS6502Cfg *cfg, const char *path);
+
+// cpu owns cfg from here on, and frees it with mos6502_uninit
+void mos6502_cfgattach(MOS6502 *cpu, MOS6502Cfg *cfg);
+
+#endif
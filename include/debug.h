@@ -2,6 +2,7 @@
 #define _UTILS_H
 
 #include "6502.h"
+#include "trace.h"
 
 typedef enum {
   RESET = 0,
@@ -12,10 +13,20 @@ typedef enum {
   GREEN
 } Color;
 
+extern const char *addrmodesstr[]; // By MOS6502AddressingModes
+
 void printfc(Color c, const char *fmt, ...);
 size_t getprogramsize(const char *path);
+void mos6502_printregisters(MOS6502 *cpu);
 void mos6502_printstatus(MOS6502 *cpu);
+// Called by mos6502_uninit, so an instance allocated at the same address
+// isn't diffed against this one's snapshot
+void mos6502_forgetstatus(const MOS6502 *cpu);
 void mos6502_printopcodes();
 void mos6502_disassemble(MOS6502 *cpu, uint8_t opcode, uint16_t pc);
+void mos6502_disassemblebytes(uint8_t opcode, uint8_t lo, uint8_t hi,
+                              uint16_t pc);
+void mos6502_printtracerecord(const MOS6502TraceRecord *record,
+                              uint16_t nextpc, uint64_t cycles);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,83 @@
+#ifndef _ENGINES_H
+#define _ENGINES_H
+
+#include "6502.h"
+
+// Internals shared by the execution engines behind mos6502_run
+
+static inline uint8_t ishaltop(MOS6502 *cpu, uint8_t opcode) {
+  return cpu->haltops[opcode >> 3] & (1 << (opcode & 7));
+}
+
+// Opcode and operand bytes, for the decoders and the CFG builder
+static inline uint8_t instructionlength(MOS6502AddressingModes mode) {
+  switch (mode) {
+    case IMM:
+    case ZP0:
+    case ZP0X:
+    case ZP0Y:
+    case RELT:
+    case IDEIND:
+    case INDIDE:
+      return 2;
+    case ABS:
+    case ABSX:
+    case ABSY:
+    case IND:
+      return 3;
+    default:
+      return 1;
+  }
+}
+
+// Idle loops. A JMP or a taken branch back to the start of a loop that
+// only reads memory and registers, and leaves them as they were, spins
+// until something outside the CPU changes: BEQ * waiting on a flag, or
+// LDA $D012 / CMP #$80 / BNE * polling a device. mos6502_idle checks the
+// loop closed by the jump at pc by running it once more, and when it
+// didn't change anything and came back to the start skips the whole
+// iterations left before the deadline (or stops the run with HALTIDLE
+// when there is none). Loops that make progress are checked again after
+// exponentially more jumps, so they cost next to nothing.
+
+#define IDLEMAXBODY 32 // Bytes from the loop start to the closing jump
+#define IDLEMAXBACKOFF 4096
+
+// BPL, BMI, BVC, BVS, BCC, BCS, BNE and BEQ are xxx10000
+static inline uint8_t isbranchop(uint8_t opcode) {
+  return (opcode & 0x1F) == 0x10;
+}
+
+// Whether the loop from target to the JMP or branch at pc could be idle,
+// and the most cycles one trip around it takes
+uint8_t mos6502_idleloop(MOS6502 *cpu, uint16_t pc, uint16_t target,
+                         uint32_t *worst);
+void mos6502_idle(MOS6502 *cpu, uint16_t pc, uint64_t deadline);
+
+// Called right after the JMP or branch at pc jumped back to cpu->PC
+static inline void mos6502_backjump(MOS6502 *cpu, uint16_t pc,
+                                    uint64_t deadline) {
+  if (cpu->idle.pc == pc && cpu->idle.wait) {
+    cpu->idle.wait--;
+    return;
+  }
+
+  mos6502_idle(cpu, pc, deadline);
+}
+
+// Predecode cache entry for pc, decoded now when it isn't cached yet.
+// NULL when out of memory.
+MOS6502Decoded *mos6502_predecode(MOS6502 *cpu, uint16_t pc);
+
+// Threaded (computed goto) engine, runs until cpu->cycles >= deadline
+uint64_t mos6502_runthreaded(MOS6502 *cpu, uint64_t deadline);
+
+// Basic-block JIT, mos6502_jitinit returns 0 when it isn't available here
+uint8_t mos6502_jitinit(MOS6502 *cpu);
+void mos6502_jitfree(MOS6502 *cpu);
+void mos6502_jitinvalidate(MOS6502 *cpu, uint16_t addr);
+// Translates the block at pc ahead of its first run, 0 when it can't be
+uint8_t mos6502_jittranslate(MOS6502 *cpu, uint16_t pc);
+uint64_t mos6502_runjit(MOS6502 *cpu, uint64_t deadline);
+
+#endif
@@ -0,0 +1,455 @@
+#ifndef _INSTRUCTIONS_H
+#define _INSTRUCTIONS_H
+
+#include "6502.h"
+#include "alu.h"
+
+// Instructions
+//
+// Each handler says with ACCESS_<handler> what it does with its operand,
+// and takes it in that form:
+//
+//   NONE, STACK, CONTROL    nothing, CONTROL handlers set PC themselves
+//   READ                    the operand value, read by the caller
+//   WRITE, MODIFY           the effective address
+//   BRANCH                  the relative offset
+//   JUMP                    the absolute address
+//   IGNORE                  not implemented, the operand is skipped
+//
+// The specialized handlers at the end combine that with the addressing
+// mode of every opcode, so each one does only the bus accesses its
+// instruction does.
+
+// Lazy flags, materialized by mos6502_getps
+static inline void setzeroandnegative(MOS6502 *cpu, uint8_t value) {
+  cpu->nz = value;
+}
+
+static inline uint8_t flagz(MOS6502 *cpu) { return (uint8_t)cpu->nz == 0; }
+static inline uint8_t flagn(MOS6502 *cpu) { return (cpu->nz & 0x8080) != 0; }
+static inline uint8_t flagc(MOS6502 *cpu) { return cpu->c != 0; }
+static inline uint8_t flagv(MOS6502 *cpu) { return cpu->v >> 7; }
+
+// Illegal opcodes, and shifts until they're implemented
+#define ACCESS_illg IGNORE
+
+// Load/Store ---------------------------------------
+#define ACCESS_lda READ
+static inline void lda(MOS6502 *cpu, uint8_t value) {
+  cpu->A = value;
+
+  setzeroandnegative(cpu, cpu->A);
+}
+#define ACCESS_ldx READ
+static inline void ldx(MOS6502 *cpu, uint8_t value) {
+  cpu->X = value;
+
+  setzeroandnegative(cpu, cpu->X);
+}
+#define ACCESS_ldy READ
+static inline void ldy(MOS6502 *cpu, uint8_t value) {
+  cpu->Y = value;
+
+  setzeroandnegative(cpu, cpu->Y);
+}
+#define ACCESS_sta WRITE
+static inline void sta(MOS6502 *cpu, uint16_t addr) {
+  mos6502_write(cpu, addr, cpu->A);
+}
+#define ACCESS_stx WRITE
+static inline void stx(MOS6502 *cpu, uint16_t addr) {
+  mos6502_write(cpu, addr, cpu->X);
+}
+#define ACCESS_sty WRITE
+static inline void sty(MOS6502 *cpu, uint16_t addr) {
+  mos6502_write(cpu, addr, cpu->Y);
+}
+
+// Registers Transfer -----------------------------
+#define ACCESS_tax NONE
+static inline void tax(MOS6502 *cpu) {
+  cpu->X = cpu->A;
+
+  setzeroandnegative(cpu, cpu->X);
+}
+#define ACCESS_tay NONE
+static inline void tay(MOS6502 *cpu) {
+  cpu->Y = cpu->A;
+
+  setzeroandnegative(cpu, cpu->Y);
+}
+#define ACCESS_txa NONE
+static inline void txa(MOS6502 *cpu) {
+  cpu->A = cpu->X;
+
+  setzeroandnegative(cpu, cpu->A);
+}
+#define ACCESS_tya NONE
+static inline void tya(MOS6502 *cpu) {
+  cpu->A = cpu->Y;
+
+  setzeroandnegative(cpu, cpu->A);
+}
+
+// Stack Operations -----------------------------
+#define ACCESS_tsx NONE
+static inline void tsx(MOS6502 *cpu) {
+  cpu->X = cpu->SP;
+
+  setzeroandnegative(cpu, cpu->X);
+}
+#define ACCESS_txs NONE
+static inline void txs(MOS6502 *cpu) {
+  cpu->SP = cpu->X;
+}
+#define ACCESS_pha STACK
+static inline void pha(MOS6502 *cpu) {
+  mos6502_write(cpu, STACKBASE | cpu->SP--, cpu->A);
+}
+#define ACCESS_php STACK
+static inline void php(MOS6502 *cpu) {
+  mos6502_write(cpu, STACKBASE | cpu->SP--, mos6502_getps(cpu));
+}
+#define ACCESS_pla STACK
+static inline void pla(MOS6502 *cpu) {
+  cpu->A = mos6502_read(cpu, STACKBASE | ++cpu->SP);
+
+  setzeroandnegative(cpu, cpu->A);
+}
+#define ACCESS_plp STACK
+static inline void plp(MOS6502 *cpu) {
+  mos6502_setps(cpu, mos6502_read(cpu, STACKBASE | ++cpu->SP));
+
+  mos6502_checkirq(cpu);
+}
+
+// Logical ------------------------------------------
+#define ACCESS_and READ
+static inline void and(MOS6502 *cpu, uint8_t value) {
+  cpu->A = cpu->A & value;
+
+  setzeroandnegative(cpu, cpu->A);
+}
+#define ACCESS_eor READ
+static inline void eor(MOS6502 *cpu, uint8_t value) {
+  cpu->A = cpu->A ^ value;
+
+  setzeroandnegative(cpu, cpu->A);
+}
+#define ACCESS_ora READ
+static inline void ora(MOS6502 *cpu, uint8_t value) {
+  cpu->A = cpu->A | value;
+
+  setzeroandnegative(cpu, cpu->A);
+}
+// Z from A & value, N and V straight from bits 7 and 6 of value
+#define ACCESS_bit READ
+static inline void bit(MOS6502 *cpu, uint8_t value) {
+  cpu->v = value << 1;
+  cpu->nz = (cpu->A & value) | (value & 0x80) << 8;
+}
+
+// Arithmetic --------------------------------------
+// Result and flags of an ALU table entry, see alu.h
+static inline void setalu(MOS6502 *cpu, uint32_t entry) {
+  cpu->nz = entry;
+  cpu->A = entry >> 16;
+  cpu->c = entry >> 24 & 1;
+  cpu->v = entry >> 24;
+}
+
+#define ACCESS_adc READ
+static inline void adc(MOS6502 *cpu, uint8_t value) {
+  setalu(cpu, aluadc[aluindex(cpu->status.flags.D, flagc(cpu), cpu->A,
+                              value)]);
+}
+#define ACCESS_sbc READ
+static inline void sbc(MOS6502 *cpu, uint8_t value) {
+  setalu(cpu, alusbc[aluindex(cpu->status.flags.D, flagc(cpu), cpu->A,
+                              value)]);
+}
+
+// Binary A - value with C set, whatever D is
+static inline void compare(MOS6502 *cpu, uint8_t reg, uint8_t value) {
+  uint32_t entry = alusbc[aluindex(0, 1, reg, value)];
+
+  cpu->c = entry >> 24 & 1;
+  cpu->nz = entry;
+}
+
+#define ACCESS_cmp READ
+static inline void cmp(MOS6502 *cpu, uint8_t value) {
+  compare(cpu, cpu->A, value);
+}
+#define ACCESS_cpx READ
+static inline void cpx(MOS6502 *cpu, uint8_t value) {
+  compare(cpu, cpu->X, value);
+}
+#define ACCESS_cpy READ
+static inline void cpy(MOS6502 *cpu, uint8_t value) {
+  compare(cpu, cpu->Y, value);
+}
+
+// Increment and decrement
+#define ACCESS_inc MODIFY
+static inline void inc(MOS6502 *cpu, uint16_t addr) {
+  uint8_t value = mos6502_read(cpu, addr);
+  mos6502_write(cpu, addr, ++value);
+
+  setzeroandnegative(cpu, value);
+}
+#define ACCESS_inx NONE
+static inline void inx(MOS6502 *cpu) {
+  cpu->X++;
+
+  setzeroandnegative(cpu, cpu->X);
+}
+#define ACCESS_iny NONE
+static inline void iny(MOS6502 *cpu) {
+  cpu->Y++;
+
+  setzeroandnegative(cpu, cpu->Y);
+}
+#define ACCESS_dec MODIFY
+static inline void dec(MOS6502 *cpu, uint16_t addr) {
+  uint8_t value = mos6502_read(cpu, addr);
+  mos6502_write(cpu, addr, --value);
+
+  setzeroandnegative(cpu, value);
+}
+#define ACCESS_dex NONE
+static inline void dex(MOS6502 *cpu) {
+  cpu->X--;
+
+  setzeroandnegative(cpu, cpu->X);
+}
+#define ACCESS_dey NONE
+static inline void dey(MOS6502 *cpu) {
+  cpu->Y--;
+
+  setzeroandnegative(cpu, cpu->Y);
+}
+
+// Shifts
+// -----
+
+// Jumps
+#define ACCESS_jmp JUMP
+static inline void jmp(MOS6502 *cpu, uint16_t addr) {
+  cpu->PC = START | addr;
+}
+#define ACCESS_jsr JUMP
+static inline void jsr(MOS6502 *cpu, uint16_t addr) {
+  uint16_t return_address = cpu->PC + 3;
+  mos6502_write(cpu, STACKBASE | cpu->SP--, return_address >> 8);
+  mos6502_write(cpu, STACKBASE | cpu->SP--, return_address & 0x00FF);
+  cpu->PC = START | addr;
+}
+#define ACCESS_rts CONTROL
+static inline void rts(MOS6502 *cpu) {
+  uint8_t lo = mos6502_read(cpu, STACKBASE | ++cpu->SP);
+  uint8_t hi = mos6502_read(cpu, STACKBASE | ++cpu->SP);
+  uint16_t return_address = (hi << 8) | lo;
+
+  cpu->PC = return_address;
+}
+
+// Interrupts
+#define ACCESS_brk CONTROL
+static inline void brk(MOS6502 *cpu) {
+  uint16_t return_address = cpu->PC + 2;
+  mos6502_write(cpu, STACKBASE | cpu->SP--, return_address >> 8);
+  mos6502_write(cpu, STACKBASE | cpu->SP--, return_address & 0x00FF);
+  mos6502_write(cpu, STACKBASE | cpu->SP--, mos6502_getps(cpu) | 0x30);
+  cpu->status.flags.I = 1;
+  cpu->PC = mos6502_read(cpu, IRQVL) | mos6502_read(cpu, IRQVH) << 8;
+}
+#define ACCESS_rti CONTROL
+static inline void rti(MOS6502 *cpu) {
+  uint8_t ps = mos6502_read(cpu, STACKBASE | ++cpu->SP);
+  mos6502_setps(cpu, (ps & ~0x10) | (cpu->status.ps & 0x10)); // B stays
+  uint8_t lo = mos6502_read(cpu, STACKBASE | ++cpu->SP);
+  uint8_t hi = mos6502_read(cpu, STACKBASE | ++cpu->SP);
+
+  cpu->PC = (hi << 8) | lo;
+  mos6502_checkirq(cpu);
+}
+
+// Branches
+static void branch(MOS6502 *cpu, uint8_t relative, uint8_t flag) {
+  if (flag) {
+    uint16_t next = cpu->PC + 2;
+    cpu->PC += (int8_t)relative + 2; // Back up to 128 bytes, forward 127
+
+    // Taken: +1 cycle, +1 more when the target is on another page
+    cpu->cycles += 1 + ((next & 0xFF00) != (cpu->PC & 0xFF00));
+  } else {
+    cpu->PC += 2;
+  }
+}
+#define ACCESS_bcc BRANCH
+static inline void bcc(MOS6502 *cpu, uint8_t offset) {
+  branch(cpu, offset, !flagc(cpu));
+}
+#define ACCESS_bcs BRANCH
+static inline void bcs(MOS6502 *cpu, uint8_t offset) {
+  branch(cpu, offset, flagc(cpu));
+}
+#define ACCESS_beq BRANCH
+static inline void beq(MOS6502 *cpu, uint8_t offset) {
+  branch(cpu, offset, flagz(cpu));
+}
+#define ACCESS_bmi BRANCH
+static inline void bmi(MOS6502 *cpu, uint8_t offset) {
+  branch(cpu, offset, flagn(cpu));
+}
+#define ACCESS_bne BRANCH
+static inline void bne(MOS6502 *cpu, uint8_t offset) {
+  branch(cpu, offset, !flagz(cpu));
+}
+#define ACCESS_bpl BRANCH
+static inline void bpl(MOS6502 *cpu, uint8_t offset) {
+  branch(cpu, offset, !flagn(cpu));
+}
+#define ACCESS_bvc BRANCH
+static inline void bvc(MOS6502 *cpu, uint8_t offset) {
+  branch(cpu, offset, !flagv(cpu));
+}
+#define ACCESS_bvs BRANCH
+static inline void bvs(MOS6502 *cpu, uint8_t offset) {
+  branch(cpu, offset, flagv(cpu));
+}
+
+// Status Flags
+#define ACCESS_clc NONE
+static inline void clc(MOS6502 *cpu) {
+  cpu->c = 0;
+}
+#define ACCESS_cld NONE
+static inline void cld(MOS6502 *cpu) {
+  cpu->status.flags.D = 0;
+}
+#define ACCESS_cli NONE
+static inline void cli(MOS6502 *cpu) {
+  cpu->status.flags.I = 0;
+
+  mos6502_checkirq(cpu);
+}
+#define ACCESS_clv NONE
+static inline void clv(MOS6502 *cpu) {
+  cpu->v = 0;
+}
+#define ACCESS_sec NONE
+static inline void sec(MOS6502 *cpu) {
+  cpu->c = 1;
+}
+#define ACCESS_sed NONE
+static inline void sed(MOS6502 *cpu) {
+  cpu->status.flags.D = 1;
+}
+#define ACCESS_sei NONE
+static inline void sei(MOS6502 *cpu) {
+  cpu->status.flags.I = 1;
+}
+
+// Other
+#define ACCESS_nop NONE
+static inline void nop(MOS6502 *cpu) {
+}
+
+// Specialized handlers ----------------------------
+// execute_<opcode>(cpu, operand) runs one instruction: base cycles, the
+// effective address, the accesses of its ACCESS kind and the PC update.
+// operand is the byte or address after the opcode. Returns 0, without
+// running anything, for the modes the core doesn't implement.
+
+// Indexed absolute address, +1 cycle on a page cross when penalty is set
+static inline uint16_t indexed(MOS6502 *cpu, uint16_t base, uint8_t index,
+                               uint8_t penalty) {
+  uint16_t addr = base + index;
+
+  if (penalty && (base & 0xFF00) != (addr & 0xFF00))
+    cpu->cycles++;
+  return addr;
+}
+
+#define IMPLIED_NONE(exec)                                                     \
+  exec(cpu);                                                                   \
+  cpu->PC++;
+#define IMPLIED_STACK(exec) IMPLIED_NONE(exec)
+#define IMPLIED_CONTROL(exec) exec(cpu);
+#define IMPLIED_IGNORE(exec) cpu->PC++;
+
+#define IMMEDIATE_READ(exec) exec(cpu, operand);
+#define IMMEDIATE_IGNORE(exec)
+
+#define RELATIVE_BRANCH(exec) exec(cpu, operand);
+
+#define MEMORY_READ(exec, addr, length)                                        \
+  exec(cpu, mos6502_read(cpu, addr));                                          \
+  cpu->PC += length;
+#define MEMORY_WRITE(exec, addr, length)                                       \
+  exec(cpu, addr);                                                             \
+  cpu->PC += length;
+#define MEMORY_MODIFY(exec, addr, length) MEMORY_WRITE(exec, addr, length)
+#define MEMORY_JUMP(exec, addr, length) exec(cpu, addr);
+#define MEMORY_IGNORE(exec, addr, length) cpu->PC += length;
+
+#define OPERATE_IMP(kind, exec, penalty) IMPLIED_##kind(exec)
+#define OPERATE_ACC(kind, exec, penalty) IMPLIED_##kind(exec)
+#define OPERATE_IMM(kind, exec, penalty)                                       \
+  IMMEDIATE_##kind(exec);                                                      \
+  cpu->PC += 2;
+#define OPERATE_RELT(kind, exec, penalty) RELATIVE_##kind(exec)
+#define OPERATE_ZP0(kind, exec, penalty)                                       \
+  MEMORY_##kind(exec, (uint8_t)operand, 2)
+#define OPERATE_ZP0X(kind, exec, penalty)                                      \
+  MEMORY_##kind(exec, (uint8_t)(operand + cpu->X), 2)
+#define OPERATE_ZP0Y(kind, exec, penalty)                                      \
+  MEMORY_##kind(exec, (uint8_t)(operand + cpu->Y), 2)
+#define OPERATE_ABS(kind, exec, penalty) MEMORY_##kind(exec, operand, 3)
+#define OPERATE_ABSX(kind, exec, penalty)                                      \
+  MEMORY_##kind(exec, indexed(cpu, operand, cpu->X, penalty), 3)
+#define OPERATE_ABSY(kind, exec, penalty)                                      \
+  MEMORY_##kind(exec, indexed(cpu, operand, cpu->Y, penalty), 3)
+
+// Not implemented by the core yet
+#define OPERATE_IND(kind, exec, penalty)
+#define OPERATE_IDEIND(kind, exec, penalty)
+#define OPERATE_INDIDE(kind, exec, penalty)
+#define OPERATE_ILL(kind, exec, penalty)
+
+#define SUPPORTED_IMP 1
+#define SUPPORTED_ACC 1
+#define SUPPORTED_IMM 1
+#define SUPPORTED_ZP0 1
+#define SUPPORTED_ZP0X 1
+#define SUPPORTED_ZP0Y 1
+#define SUPPORTED_RELT 1
+#define SUPPORTED_ABS 1
+#define SUPPORTED_ABSX 1
+#define SUPPORTED_ABSY 1
+#define SUPPORTED_IND 0
+#define SUPPORTED_IDEIND 0
+#define SUPPORTED_INDIDE 0
+#define SUPPORTED_ILL 0
+
+// Expands ACCESS_<handler> before pasting it
+#define SPECIALIZE(kind, exec, mode, ncycles, penalty)                         \
+  SPECIALIZEKIND(kind, exec, mode, ncycles, penalty)
+#define SPECIALIZEKIND(kind, exec, mode, ncycles, penalty)                     \
+  if (!SUPPORTED_##mode)                                                       \
+    return 0;                                                                  \
+  cpu->cycles += ncycles;                                                      \
+  cpu->instructions++;                                                         \
+  OPERATE_##mode(kind, exec, penalty);                                         \
+  return 1;
+
+#define OPCODE(opcode, mnemonic, exec, mode, ncycles, penalty)                 \
+  static inline uint8_t execute_##opcode(MOS6502 *cpu, uint16_t operand) {     \
+    SPECIALIZE(ACCESS_##exec, exec, mode, ncycles, penalty)                    \
+  }
+#include "opcodes.def"
+#undef OPCODE
+
+#endif
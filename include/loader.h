@@ -0,0 +1,76 @@
+#ifndef _LOADER_H
+#define _LOADER_H
+
+#include "6502.h"
+
+// Program images
+//
+// The image file is mapped with mmap and split into segments that point
+// into the mapping, so an instance maps whole pages of it directly
+// (mos6502_loadsegment) instead of copying. A program can be mapped into
+// any number of instances and must outlive them. Formats:
+//
+//   raw           The whole file at START, up to the end of memory
+//   Intel HEX     .hex or .ihx. Data (00), end (01), extended segment (02)
+//                 and linear (04) address records, and start address
+//                 records (03, 05) for the reset vector.
+//   segments      A "6502SEG" container, little endian:
+//
+//     char     magic[8]    "6502SEG\0"
+//     uint16_t count       Segments
+//     uint16_t vectors     Bit 0 NMI, bit 1 RESET, bit 2 IRQ present
+//     uint16_t nmi, reset, irq
+//     uint16_t reserved
+//     count times:
+//       uint16_t addr
+//       uint16_t reserved
+//       uint32_t size
+//       uint32_t offset    From the start of the file
+//
+// Only the pages a segment covers completely are mapped, the partial pages
+// at either end are copied. Vectors are kept as extra 2 byte segments, so
+// they're loaded like the rest of the image.
+
+#define SEGMAGIC "6502SEG"
+#define SEGHEADER 20
+#define SEGENTRY 12
+#define LOADERMAXSEGMENTS 64
+
+typedef enum image_formats {
+  IMAGERAW = 0,
+  IMAGEHEX,
+  IMAGESEGMENTS
+} MOS6502ImageFormat;
+
+typedef enum image_vectors {
+  VECTORNMI = 1 << 0,
+  VECTORRESET = 1 << 1,
+  VECTORIRQ = 1 << 2
+} MOS6502ImageVectors;
+
+typedef struct segment {
+  uint16_t addr;
+  uint32_t size;
+  const uint8_t *bytes;
+} MOS6502Segment;
+
+typedef struct program {
+  MOS6502ImageFormat format;
+  uint8_t *map; // The file
+  size_t mapsize;
+  uint8_t *decoded; // Intel HEX data, RAM bytes
+
+  MOS6502Segment segments[LOADERMAXSEGMENTS];
+  size_t nsegments;
+  size_t size; // Bytes in all segments but the vectors
+  uint8_t vectors[VECTORSLEN];
+} MOS6502Program;
+
+MOS6502Program *mos6502_programopen(const char *path);
+void mos6502_programclose(MOS6502Program *program);
+// Loads every segment and resets cpu, returns 0 when one didn't fit
+uint8_t mos6502_programmap(MOS6502 *cpu, const MOS6502Program *program);
+
+extern const char *imageformatsstr[];
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef _LOCKSTEP_H
+#define _LOCKSTEP_H
+
+#include "6502.h"
+
+// Lockstep multi-CPU
+//
+// Runs many CPUs that share one program image but differ in their initial
+// memory. Registers are stored as one array per register (structure of
+// arrays) and memory is interleaved per lane, so an access to the same
+// address in every lane is one contiguous row. Lanes at the same PC are
+// stepped together, with AVX2 when the host supports it. Lanes that take
+// different paths are split into groups and merged again when their PCs
+// meet. A lane that stops (halt opcode, illegal opcode or its budget)
+// leaves its group for good.
+
+#define LOCKSTEPALIGN 32
+
+typedef struct lockstepgroup MOS6502LockstepGroup;
+typedef struct lockstepops MOS6502LockstepOps;
+
+typedef struct lockstep {
+  size_t lanes;
+  size_t stride; // lanes rounded up to LOCKSTEPALIGN
+
+  // Per lane state, stride entries each
+  uint8_t *A, *X, *Y, *SP, *P;
+  uint16_t *PC; // Valid once the lane stopped
+  uint64_t *cycles;
+  uint64_t *instructions;
+  uint8_t *halt; // MOS6502HaltReasons
+
+  uint8_t haltops[MAXOPCODESTABLE / 8];
+
+  // Memory, 256 * stride bytes per page, allocated on the first write
+  uint8_t *pages[RAM / PAGESIZE];
+  uint8_t diverged[RAM / PAGESIZE]; // Lanes may hold different bytes
+  uint8_t *zero;                    // Row read from unallocated pages
+
+  MOS6502LockstepGroup *groups;
+  size_t ngroups;
+
+  // Scratch rows
+  uint8_t *operand;
+  uint8_t *taken;
+  uint16_t *addr;
+
+  const MOS6502LockstepOps *ops;
+} MOS6502Lockstep;
+
+MOS6502Lockstep *mos6502_lockstepinit(size_t lanes);
+void mos6502_lockstepuninit(MOS6502Lockstep *ls);
+uint32_t mos6502_lockstepload(MOS6502Lockstep *ls, uint16_t addr,
+                              const uint8_t *bytes, uint32_t size);
+// Every lane starts at the reset vector of lane 0, before the first run
+uint8_t mos6502_lockstepreset(MOS6502Lockstep *ls);
+uint8_t mos6502_lockstepread(MOS6502Lockstep *ls, size_t lane, uint16_t addr);
+void mos6502_lockstepwrite(MOS6502Lockstep *ls, size_t lane, uint16_t addr,
+                           uint8_t data);
+// Runs until every lane stopped, lanes stop once cycles >= deadline
+void mos6502_locksteprun(MOS6502Lockstep *ls, uint64_t deadline);
+void mos6502_lockstepsethaltop(MOS6502Lockstep *ls, uint8_t opcode);
+const char *mos6502_lockstepisa(MOS6502Lockstep *ls);
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef _MAPPER_H
+#define _MAPPER_H
+
+#include "6502.h"
+
+// Bank-switching mappers
+//
+// Run images larger than the address space through fixed and switchable
+// windows of 8 or 16 KB. Banks are mapped as ROM and read from the image
+// file the first time they are switched in, so only the banks a program
+// uses are ever loaded. A switch repoints the pages of one window
+// (mos6502_mapbank), nothing is copied. Writes to the register range of a
+// switchable window select the bank it shows, modulo the number of banks.
+//
+//   uxrom   16 KB at 0x8000 switched by writes to 0x8000-0xFFFF,
+//           last bank fixed at 0xC000
+//   bank8   8 KB at 0x8000, 0xA000 and 0xC000, each switched by writes to
+//           its own window, last bank fixed at 0xE000
+//
+// The fixed last bank holds the vectors.
+
+#define MAPPERMAXWINDOWS 4
+
+typedef struct mapperwindow {
+  uint16_t addr;
+  int32_t bank; // At start, negative counts back from the last bank
+  uint8_t switchable;
+  uint16_t regfirst, reglast; // Bank select writes, switchable windows only
+} MOS6502MapperWindow;
+
+typedef struct mapperkind {
+  const char *name;
+  uint32_t banksize;
+  uint8_t nwindows;
+  MOS6502MapperWindow windows[MAPPERMAXWINDOWS];
+} MOS6502MapperKind;
+
+typedef struct mapper {
+  const MOS6502MapperKind *kind;
+  int fd;
+  uint64_t filesize;
+
+  uint32_t nbanks;
+  uint8_t **banks;   // NULL until first switched in
+  uint8_t *mapped;   // banks[i] is an mmap of the file, or allocated
+  uint32_t selected[MAPPERMAXWINDOWS];
+
+  uint32_t loaded;   // Banks read from the file so far
+  uint64_t switches;
+} MOS6502Mapper;
+
+// NULL when there's no mapper called name
+const MOS6502MapperKind *mos6502_mapperkind(const char *name);
+// Maps the starting banks of the image at path and resets cpu
+uint8_t mos6502_mapperstart(MOS6502 *cpu, const MOS6502MapperKind *kind,
+                            const char *path);
+void mos6502_mapperstop(MOS6502 *cpu);
+uint8_t mos6502_mapperselect(MOS6502 *cpu, uint8_t window, uint32_t bank);
+
+extern const MOS6502MapperKind mapperkinds[];
+extern const size_t nmapperkinds;
+
+#endif
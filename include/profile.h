@@ -0,0 +1,96 @@
+#ifndef _PROFILE_H
+#define _PROFILE_H
+
+#include "6502.h"
+
+// Guest profiler
+//
+// Counts executions and cycles per PC and per opcode, and follows JSR/RTS
+// to keep a call tree. Every node of the tree is one call stack and owns
+// the cycles spent in it outside of its callees, which gives exclusive
+// time per subroutine and the folded stacks for flame graphs. Inclusive
+// time is the cycles between a JSR and its RTS, only counted for the
+// outermost call of a recursive subroutine. Interrupt entries are counted
+// on their own and their cycles go to the call stack they interrupted.
+
+#define PROFILEJSR 0x20
+#define PROFILERTS 0x60
+#define PROFILEMAXDEPTH 128 // JSRs that fit on the stack
+#define PROFILETOP 20       // Rows in the hot instruction report
+
+typedef struct profilecounter {
+  uint64_t count;
+  uint64_t cycles;
+} MOS6502ProfileCounter;
+
+typedef struct profilesubroutine {
+  uint64_t calls;
+  uint64_t inclusive;
+  uint32_t active; // Calls on the stack right now
+} MOS6502ProfileSubroutine;
+
+typedef struct profilenode {
+  uint16_t addr; // Subroutine entry
+  uint32_t parent, child, sibling; // 0 is the root, also "none"
+  uint64_t cycles; // Exclusive
+} MOS6502ProfileNode;
+
+typedef struct profileframe {
+  uint32_t node;
+  uint64_t entry; // cycles at the JSR
+} MOS6502ProfileFrame;
+
+typedef struct profile {
+  uint64_t cycles;
+  uint64_t instructions;
+  MOS6502ProfileCounter interrupts;
+
+  MOS6502ProfileCounter pcs[RAM];
+  MOS6502ProfileCounter opcodes[MAXOPCODESTABLE];
+  MOS6502ProfileSubroutine subroutines[RAM];
+
+  MOS6502ProfileNode *nodes;
+  uint32_t nnodes, maxnodes;
+
+  MOS6502ProfileFrame frames[PROFILEMAXDEPTH + 1]; // frames[0] is the root
+  uint32_t depth;
+  uint32_t overflow; // Untracked JSRs waiting for their RTS
+  uint64_t lost;     // JSRs past PROFILEMAXDEPTH, and RTSs without a JSR
+} MOS6502Profile;
+
+uint8_t mos6502_profilestart(MOS6502 *cpu);
+void mos6502_profilestop(MOS6502 *cpu);
+// Hot instructions, blocks (when cpu has a CFG attached), opcodes and
+// subroutines to stdout, and folded stacks
+// ("main;sub_8010;sub_8020 cycles" per line) to folded unless it's NULL.
+// Returns 0 when folded can't be written.
+uint8_t mos6502_profilereport(MOS6502 *cpu, const char *folded);
+void mos6502_profilecall(MOS6502Profile *profile, uint8_t opcode,
+                         uint16_t target);
+
+// Called after each retired instruction, next is the PC after it
+static inline void mos6502_profilestep(MOS6502Profile *profile, uint16_t pc,
+                                       uint8_t opcode, uint32_t cycles,
+                                       uint16_t next) {
+  profile->cycles += cycles;
+  profile->instructions++;
+  profile->pcs[pc].count++;
+  profile->pcs[pc].cycles += cycles;
+  profile->opcodes[opcode].count++;
+  profile->opcodes[opcode].cycles += cycles;
+  profile->nodes[profile->frames[profile->depth].node].cycles += cycles;
+
+  if (opcode == PROFILEJSR || opcode == PROFILERTS)
+    mos6502_profilecall(profile, opcode, next);
+}
+
+// Called after an interrupt was taken
+static inline void mos6502_profileinterrupt(MOS6502Profile *profile,
+                                            uint32_t cycles) {
+  profile->cycles += cycles;
+  profile->interrupts.count++;
+  profile->interrupts.cycles += cycles;
+  profile->nodes[profile->frames[profile->depth].node].cycles += cycles;
+}
+
+#endif
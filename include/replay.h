@@ -0,0 +1,89 @@
+#ifndef _REPLAY_H
+#define _REPLAY_H
+
+#include "6502.h"
+
+// Record and replay of external inputs
+//
+// The only inputs a guest gets from outside are the values of I/O reads
+// and the interrupts it takes. Recording appends both to a log with the
+// cycle they happened at, replaying feeds them back instead of asking the
+// devices, so the run is repeated exactly, on any engine. The log is a
+// header followed by variable length entries, buffered in memory and
+// appended to the file with write():
+//
+//   tag          REPLAYREAD or a MOS6502Interrupts line, | REPLAYSAMEADDR
+//   delta        cycles since the previous entry, LEB128
+//   addr         2 bytes, reads not tagged REPLAYSAMEADDR
+//   value        1 byte, reads
+//
+// A poll of one register costs 3 bytes an iteration. When not recording,
+// an I/O read pays one test of cpu->replay.
+//
+// A replay stops with HALTREPLAY when the guest reads another address
+// than the log has next or the log runs out. Devices still see writes and
+// their events still run, but their reads and interrupts are ignored.
+
+#define REPLAYMAGIC "6502RPL"
+#define REPLAYVERSION 1
+#define REPLAYBUFFER (1 << 16)
+#define REPLAYSAMEADDR 0x80
+
+typedef enum replay_modes {
+  REPLAYRECORD = 0,
+  REPLAYPLAY
+} MOS6502ReplayMode;
+
+typedef struct replayheader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t startcycles; // cpu->cycles when the recording started
+} MOS6502ReplayHeader;
+
+typedef struct replayentry {
+  uint8_t tag;
+  uint64_t cycles;
+  uint16_t addr;
+  uint8_t value;
+} MOS6502ReplayEntry;
+
+#define REPLAYREAD 0
+
+typedef struct replay {
+  MOS6502ReplayMode mode;
+  int fd;
+  uint64_t last;     // Cycles of the previous entry
+  uint16_t lastaddr; // Address of the previous read
+  uint64_t entries;  // Recorded or replayed so far
+  uint8_t failed;    // Recording: a write failed, the log is cut short
+
+  // Recording, entries not written yet
+  uint8_t buffer[REPLAYBUFFER];
+  size_t used;
+
+  // Replaying, the mapped log and its next entry
+  const uint8_t *map;
+  size_t mapsize, at;
+  MOS6502ReplayEntry next;
+  uint8_t hasnext;
+} MOS6502Replay;
+
+// Returns 0 on failure
+uint8_t mos6502_recordstart(MOS6502 *cpu, const char *path);
+uint8_t mos6502_replaystart(MOS6502 *cpu, const char *path);
+// Flushes a recording, returns the entries recorded or replayed
+uint64_t mos6502_replaystop(MOS6502 *cpu);
+
+// Called by the core
+void mos6502_recordinterrupt(MOS6502 *cpu, uint8_t line);
+// The logged interrupt line due now, 0 for none
+uint8_t mos6502_replayinterrupt(MOS6502 *cpu);
+// Cycle of the next logged interrupt, UINT64_MAX for none
+uint64_t mos6502_replaynext(MOS6502 *cpu);
+
+static inline uint8_t mos6502_replaying(MOS6502 *cpu) {
+  return cpu->replay && cpu->replay->mode == REPLAYPLAY;
+}
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef _SCHEDULER_H
+#define _SCHEDULER_H
+
+#include "6502.h"
+
+// Event scheduler
+//
+// Devices schedule callbacks on the cycle counter instead of polling on
+// every instruction. Events are kept in a binary min-heap on their cycle
+// and mos6502_run only runs the engine up to the earliest one, so nothing
+// is checked between events. Callbacks run between instructions, once
+// cpu->cycles reached their cycle, and can schedule more events and raise
+// interrupts. An event scheduled in the past runs before the next
+// instruction.
+
+typedef void (*eventfunc)(MOS6502 *cpu, void *data);
+
+typedef struct event {
+  uint64_t when;
+  uint32_t id;
+  eventfunc func;
+  void *data;
+} MOS6502Event;
+
+typedef struct scheduler {
+  MOS6502Event *heap; // heap[0] is the earliest
+  uint32_t nevents, maxevents;
+  uint32_t nextid;
+  uint64_t until; // The engine runs up to here
+} MOS6502Scheduler;
+
+// Returns the event id, 0 when it can't be scheduled
+uint32_t mos6502_schedule(MOS6502 *cpu, uint64_t when, eventfunc func,
+                          void *data);
+uint8_t mos6502_unschedule(MOS6502 *cpu, uint32_t id);
+// Runs every event that is due
+void mos6502_runevents(MOS6502 *cpu);
+void mos6502_schedulerfree(MOS6502 *cpu);
+
+static inline uint64_t mos6502_nextevent(MOS6502 *cpu) {
+  MOS6502Scheduler *scheduler = cpu->scheduler;
+
+  return scheduler && scheduler->nevents ? scheduler->heap[0].when
+                                         : UINT64_MAX;
+}
+
+#endif
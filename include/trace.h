@@ -0,0 +1,78 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include "6502.h"
+
+// Binary trace
+//
+// Every retired instruction appends one fixed size record to a ring in
+// memory. A full ring is copied into a file mapped with mmap, which grows
+// as needed. The file starts with a header, then the records in order:
+//
+//   MOS6502TraceHeader, MOS6502TraceRecord[count]
+//
+// Records hold the instruction bytes and the registers after it ran, so
+// mos6502_tracedump can print the same disassembly as the interactive
+// mode without the program image. Taking an interrupt appends a record of
+// its own (TRACEINT), so the PC after a record is always the PC of the
+// next one, or endpc for the last, and the cycles of the records add up
+// to the cycles of the run.
+
+#define TRACEMAGIC "6502TRC"
+#define TRACEVERSION 2
+#define TRACERING 4096 // Records, 64 KB
+
+typedef enum trace_flags {
+  TRACEMEM = 1 << 0, // addr/data hold the memory operand
+  TRACEIO = 1 << 1,  // addr is on an I/O page, data isn't sampled
+  TRACEINT = 1 << 2  // Interrupt entry: pc is the interrupted PC and
+                     // operand[0] the MOS6502Interrupts line, no opcode
+} MOS6502TraceFlags;
+
+typedef struct traceheader {
+  char magic[8];
+  uint32_t version;
+  uint32_t recordsize;
+  uint64_t startcycles; // cpu->cycles before the first record
+  uint64_t count;
+  uint16_t endpc; // PC after the last record
+} MOS6502TraceHeader;
+
+typedef struct tracerecord {
+  uint16_t pc;
+  uint16_t addr; // Effective address of the memory operand
+  uint8_t opcode;
+  uint8_t operand[2];
+  uint8_t A, X, Y, SP, P; // After the instruction
+  uint8_t data;           // Byte at addr after the instruction
+  uint8_t cycles;         // Taken by this instruction
+  uint8_t flags;          // MOS6502TraceFlags
+} MOS6502TraceRecord;
+
+typedef struct trace {
+  MOS6502TraceRecord ring[TRACERING];
+  size_t used;
+
+  int fd;
+  uint8_t *map; // Header and records flushed so far
+  size_t mapsize;
+  uint64_t count; // Records in the file
+  uint8_t failed; // A flush couldn't grow the file, later records are lost
+} MOS6502Trace;
+
+// Starts writing a trace of cpu to path, returns 0 on failure
+uint8_t mos6502_tracestart(MOS6502 *cpu, const char *path);
+// Flushes and closes the trace, returns the number of records written
+uint64_t mos6502_tracestop(MOS6502 *cpu);
+void mos6502_traceflush(MOS6502Trace *trace);
+// Prints a trace file, returns the number of records or -1 on failure
+int64_t mos6502_tracedump(const char *path);
+
+static inline MOS6502TraceRecord *mos6502_tracenext(MOS6502Trace *trace) {
+  if (trace->used == TRACERING)
+    mos6502_traceflush(trace);
+
+  return &trace->ring[trace->used++];
+}
+
+#endif
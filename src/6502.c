@@ -3,48 +3,71 @@
 #include <string.h>
 
 #include "6502.h"
-
-static uint8_t readbyte(MOS6502 *cpu, uint16_t addr) {
-  if (addr >= 0x0000 && addr <= 0xFFFF)
-    return cpu->bus.ram[addr];
-
-  return -1;
-}
-
-static uint8_t writebyte(MOS6502 *cpu, uint16_t addr, uint8_t data) {
-  if (addr >= 0x0000 && addr <= 0xFFFF) {
-    cpu->bus.ram[addr] = data;
-    return 1;
-  }
-
-  return -1;
-}
+#include "cfg.h"
+#include "debug.h"
+#include "engines.h"
+#include "instructions.h"
+#include "mapper.h"
+#include "profile.h"
+#include "replay.h"
+#include "scheduler.h"
+#include "trace.h"
 
 static uint16_t resetvector(MOS6502 *cpu) {
-  return ((cpu->bus.read(cpu, RESETVH) << 8) | cpu->bus.read(cpu, RESETVL));
+  return ((mos6502_read(cpu, RESETVH) << 8) | mos6502_read(cpu, RESETVL));
 }
 
+// The RESET sequence is an interrupt with its three pushes turned into
+// reads: SP still moves down by three and I is set, so no IRQ is taken
+// before the handler gets to run. A, X and Y start out cleared.
 uint8_t mos6502_reset(MOS6502 *cpu) {
   cpu->PC = resetvector(cpu);
   cpu->A = cpu->X = cpu->Y = 0;
-  cpu->SP = 0xFF;
+  cpu->SP -= 3;
+  cpu->status.flags.I = 1;
 
   return 1;
 }
 
-MOS6502 *mos6502_init() {
+MOS6502 *mos6502_init(MOS6502Engine engine) {
   MOS6502 *cpu = malloc(sizeof(MOS6502));
   if (!cpu)
     return NULL;
 
-  cpu->A = cpu->X = cpu->Y = 0;
-  cpu->SP = 0xFF;
-  cpu->status.ps = 0x00;
+  mos6502_aluinit();
+
+  cpu->engine = engine;
+  memset(cpu->icache, 0, sizeof(cpu->icache));
+  cpu->jit = NULL;
+  cpu->trace = NULL;
+  cpu->profile = NULL;
+  cpu->mapper = NULL;
+  cpu->cfg = NULL;
 
-  cpu->bus.read = readbyte;
-  cpu->bus.write = writebyte;
-  cpu->bus.write(cpu, RESETVL, STARTL);
-  cpu->bus.write(cpu, RESETVH, STARTH);
+  // Power on, the first reset takes SP to 0xFD
+  cpu->A = cpu->X = cpu->Y = 0;
+  cpu->SP = 0x00;
+  mos6502_setps(cpu, 0x00);
+
+  cpu->cycles = cpu->instructions = 0;
+  cpu->breakpoint = NOBREAKPOINT;
+  cpu->halt = HALTNONE;
+  memset(cpu->haltops, 0, sizeof(cpu->haltops));
+  memset(&cpu->idle, 0, sizeof(cpu->idle));
+  cpu->idle.skip = 1;
+  memset(&cpu->fusion, 0, sizeof(cpu->fusion));
+  cpu->fusion.enabled = 1;
+  cpu->irq = cpu->pending = 0;
+  cpu->scheduler = NULL;
+  cpu->replay = NULL;
+
+  memset(cpu->bus.flags, 0, sizeof(cpu->bus.flags));
+  memset(cpu->bus.codepages, 0, sizeof(cpu->bus.codepages));
+  memset(cpu->bus.dirty, 0, sizeof(cpu->bus.dirty));
+  cpu->bus.io = NULL;
+  mos6502_mapram(cpu, 0x0000, RAM, NULL);
+  mos6502_write(cpu, RESETVL, STARTL);
+  mos6502_write(cpu, RESETVH, STARTH);
 
   cpu->PC = resetvector(cpu);
 
@@ -55,763 +78,972 @@ void mos6502_uninit(MOS6502 *cpu) {
   if (!cpu)
     return;
 
+  mos6502_mapperstop(cpu); // Windows go back to RAM first
+  mos6502_forgetstatus(cpu);
+
+  for (int i = 0; i < RAM / PAGESIZE; i++)
+    free(cpu->icache[i]);
+
+  for (int i = 0; i < RAM / PAGESIZE; i++)
+    if (cpu->bus.flags[i] & PAGEOWNED)
+      free((uint8_t *)cpu->bus.pages[i].read);
+
+  free(cpu->bus.io);
+  mos6502_jitfree(cpu);
+  mos6502_tracestop(cpu);
+  mos6502_profilestop(cpu);
+  mos6502_schedulerfree(cpu);
+  mos6502_replaystop(cpu);
+  mos6502_cfgfree(cpu->cfg);
   free(cpu);
 }
 
-uint16_t mos6502_loadbytes(MOS6502 *cpu, uint8_t *bytes, uint16_t size) {
-  uint16_t max = (RAM / 2) - VECTORSLEN;
+// Memory map --------------------------------------
+typedef enum { MAPRAM = 0, MAPROM, MAPSHARED, MAPIO, MAPBANK } MOS6502MapKind;
 
-  if (!cpu || !bytes || size > max) {
-    return -1;
+// Backs private RAM pages until they are first written
+static const uint8_t zeropage[PAGESIZE];
+
+static void markdirty(MOS6502 *cpu, uint8_t index) {
+  cpu->bus.dirty[index >> 3] |= 1 << (index & 7);
+}
+
+// Private copy of a RAM or ROM page, made on the first write to it
+static uint8_t *privatepage(MOS6502 *cpu, uint8_t index) {
+  MOS6502Page *page = &cpu->bus.pages[index];
+  uint8_t *flags = &cpu->bus.flags[index];
+
+  if (!(*flags & PAGEOWNED)) {
+    uint8_t *copy = malloc(PAGESIZE);
+    if (!copy)
+      return NULL;
+
+    memcpy(copy, page->read, PAGESIZE);
+    page->read = copy;
+    *flags |= PAGEOWNED;
   }
 
-  size_t amount = 0;
-  for (uint16_t i = START; i < START + size; i++) {
-    amount += cpu->bus.write(cpu, i, bytes[amount]);
+  if (*flags & PAGECOW) {
+    page->write = (uint8_t *)page->read;
+    *flags &= ~PAGECOW;
   }
 
-  return amount;
+  return (uint8_t *)page->read;
 }
 
-// Instructions
-static uint8_t setzeroandnegative(MOS6502 *cpu, uint8_t value) {
-  cpu->status.flags.Z = value == 0;
-  cpu->status.flags.N = (value & 0x80) == 0x80;
+uint8_t mos6502_writeslow(MOS6502 *cpu, uint16_t addr, uint8_t data) {
+  uint8_t index = addr >> 8;
+  MOS6502Page *page = &cpu->bus.pages[index];
+  uint8_t *flags = &cpu->bus.flags[index];
 
-  return 1;
-}
+  // First write since mos6502_cleardirty, lift the write protection
+  if (*flags & PAGEWATCH) {
+    page->write = (uint8_t *)page->read;
+    *flags &= ~PAGEWATCH;
+    markdirty(cpu, index);
 
-// Illegal
-static uint8_t illg(MOS6502 *cpu, MOS6502IContext *ctx) { return 1; }
+    page->write[addr & 0xFF] = data;
+    return 1;
+  }
 
-// Load/Store ---------------------------------------
-static uint8_t lda(MOS6502 *cpu, MOS6502IContext *ctx) {
-  cpu->A = ctx->operand_immediate;
+  if (*flags & PAGECOW) {
+    uint8_t *host = privatepage(cpu, index);
+    if (!host)
+      return 0;
 
-  setzeroandnegative(cpu, cpu->A);
-  return 1;
-}
-static uint8_t ldx(MOS6502 *cpu, MOS6502IContext *ctx) {
-  cpu->X = ctx->operand_immediate;
+    markdirty(cpu, index);
+    host[addr & 0xFF] = data;
+    return 1;
+  }
 
-  setzeroandnegative(cpu, cpu->X);
-  return 1;
-}
-static uint8_t ldy(MOS6502 *cpu, MOS6502IContext *ctx) {
-  cpu->Y = ctx->operand_immediate;
+  // I/O pages, and ROM pages with registers behind them (mos6502_mapcontrol)
+  MOS6502IOHandlers *io = cpu->bus.io ? &cpu->bus.io[index] : NULL;
+  if (io && io->write) {
+    markdirty(cpu, index);
+    return io->write(cpu, addr, data);
+  }
 
-  setzeroandnegative(cpu, cpu->Y);
-  return 1;
+  return 0;
 }
-static uint8_t sta(MOS6502 *cpu, MOS6502IContext *ctx) {
-  cpu->bus.write(cpu, ctx->absolute_addr, cpu->A);
 
-  return 1;
-}
-static uint8_t stx(MOS6502 *cpu, MOS6502IContext *ctx) {
-  cpu->bus.write(cpu, ctx->absolute_addr, cpu->X);
+void mos6502_cleardirty(MOS6502 *cpu) {
+  memset(cpu->bus.dirty, 0, sizeof(cpu->bus.dirty));
 
-  return 1;
+  for (int i = 0; i < RAM / PAGESIZE; i++) {
+    if (cpu->bus.pages[i].write) {
+      cpu->bus.pages[i].write = NULL;
+      cpu->bus.flags[i] |= PAGEWATCH;
+    }
+  }
 }
-static uint8_t sty(MOS6502 *cpu, MOS6502IContext *ctx) {
-  cpu->bus.write(cpu, ctx->absolute_addr, cpu->Y);
 
-  return 1;
-}
+// Drops the whole page at once instead of one address at a time
+static void invalidatepage(MOS6502 *cpu, uint8_t index) {
+  if (cpu->jit)
+    for (uint32_t a = index << 8; a < (uint32_t)(index + 1) << 8; a++)
+      mos6502_jitinvalidate(cpu, a);
 
-// Registers Transfer -----------------------------
-static uint8_t tax(MOS6502 *cpu, MOS6502IContext *ctx) {
-  cpu->X = cpu->A;
+  if (cpu->icache[index])
+    memset(cpu->icache[index], 0, PAGESIZE * sizeof(MOS6502Decoded));
 
-  setzeroandnegative(cpu, cpu->X);
-  return 1;
+  // Instructions on the page before that run into this one
+  mos6502_invalidate(cpu, index << 8);
+  mos6502_invalidate(cpu, (index << 8) + 1);
 }
-static uint8_t tay(MOS6502 *cpu, MOS6502IContext *ctx) {
-  cpu->Y = cpu->A;
 
-  setzeroandnegative(cpu, cpu->Y);
-  return 1;
-}
-static uint8_t txa(MOS6502 *cpu, MOS6502IContext *ctx) {
-  cpu->A = cpu->X;
+static void mappages(MOS6502 *cpu, uint16_t addr, uint32_t size,
+                     MOS6502MapKind kind, const uint8_t *host,
+                     readbusfunc read, writebusfunc write) {
+  uint32_t first = addr >> 8;
+  uint32_t last = (addr + size + PAGESIZE - 1) >> 8;
 
-  setzeroandnegative(cpu, cpu->A);
-  return 1;
-}
-static uint8_t tya(MOS6502 *cpu, MOS6502IContext *ctx) {
-  cpu->A = cpu->Y;
+  if (last > RAM / PAGESIZE)
+    last = RAM / PAGESIZE;
 
-  setzeroandnegative(cpu, cpu->A);
-  return 1;
-}
+  for (uint32_t i = first; i < last; i++) {
+    MOS6502Page *page = &cpu->bus.pages[i];
+    uint8_t *flags = &cpu->bus.flags[i];
 
-// Stack Operations -----------------------------
-static uint8_t tsx(MOS6502 *cpu, MOS6502IContext *ctx) {
-  cpu->X = cpu->SP;
+    if (*flags & PAGEOWNED)
+      free((uint8_t *)page->read);
+    *flags = 0;
+    markdirty(cpu, i);
 
-  setzeroandnegative(cpu, cpu->X);
-  return 1;
-}
-static uint8_t txs(MOS6502 *cpu, MOS6502IContext *ctx) {
-  cpu->SP = cpu->X;
+    const uint8_t *base = host ? host + ((i - first) << 8) : zeropage;
 
-  return 1;
+    // Banks keep the registers of the window they're switched into
+    if (cpu->bus.io && kind != MAPBANK) {
+      cpu->bus.io[i].read = read;
+      cpu->bus.io[i].write = write;
+    }
+
+    switch (kind) {
+      case MAPRAM: // Host memory is shared and writable
+        page->read = base;
+        page->write = host ? (uint8_t *)base : NULL;
+        *flags = host ? 0 : PAGECOW;
+        break;
+      case MAPROM:
+      case MAPBANK:
+        page->read = base;
+        page->write = NULL;
+        break;
+      case MAPSHARED:
+        page->read = base;
+        page->write = NULL;
+        *flags = PAGECOW;
+        break;
+      case MAPIO:
+        page->read = NULL;
+        page->write = NULL;
+        break;
+    }
+
+    // Whatever was cached from the old mapping is stale now
+    if (cpu->bus.codepages[i])
+      invalidatepage(cpu, i);
+  }
 }
-static uint8_t pha(MOS6502 *cpu, MOS6502IContext *ctx) {
-  cpu->bus.write(cpu, STACKBASE | cpu->SP--, cpu->A);
 
-  return 1;
+uint8_t mos6502_isloaded(MOS6502 *cpu, uint8_t index) {
+  const uint8_t *read = cpu->bus.pages[index].read;
+  return read && read != zeropage;
 }
-static uint8_t php(MOS6502 *cpu, MOS6502IContext *ctx) {
-  cpu->bus.write(cpu, STACKBASE | cpu->SP--, cpu->status.ps);
 
-  return 1;
+void mos6502_mapram(MOS6502 *cpu, uint16_t addr, uint32_t size,
+                    uint8_t *host) {
+  mappages(cpu, addr, size, MAPRAM, host, NULL, NULL);
 }
-static uint8_t pla(MOS6502 *cpu, MOS6502IContext *ctx) {
-  cpu->A = cpu->bus.read(cpu, STACKBASE | ++cpu->SP);
 
-  setzeroandnegative(cpu, cpu->A);
-  return 1;
+void mos6502_maprom(MOS6502 *cpu, uint16_t addr, uint32_t size,
+                    const uint8_t *host) {
+  mappages(cpu, addr, size, MAPROM, host, NULL, NULL);
 }
-static uint8_t plp(MOS6502 *cpu, MOS6502IContext *ctx) {
-  cpu->status.ps = cpu->bus.read(cpu, STACKBASE | ++cpu->SP);
 
-  return 1;
+void mos6502_mapshared(MOS6502 *cpu, uint16_t addr, uint32_t size,
+                       const uint8_t *host) {
+  mappages(cpu, addr, size, MAPSHARED, host, NULL, NULL);
 }
 
-// Logical ------------------------------------------
-static uint8_t and (MOS6502 * cpu, MOS6502IContext *ctx) {
-  cpu->A = cpu->A & ctx->operand_immediate;
+void mos6502_mapio(MOS6502 *cpu, uint16_t addr, uint32_t size,
+                   readbusfunc read, writebusfunc write) {
+  if (!cpu->bus.io) {
+    cpu->bus.io = calloc(RAM / PAGESIZE, sizeof(MOS6502IOHandlers));
+    if (!cpu->bus.io)
+      return;
+  }
 
-  setzeroandnegative(cpu, cpu->A);
-  return 1;
+  mappages(cpu, addr, size, MAPIO, NULL, read, write);
 }
-static uint8_t eor(MOS6502 *cpu, MOS6502IContext *ctx) {
-  cpu->A = cpu->A ^ ctx->operand_immediate;
 
-  setzeroandnegative(cpu, cpu->A);
-  return 1;
+void mos6502_mapbank(MOS6502 *cpu, uint16_t addr, uint32_t size,
+                     const uint8_t *host) {
+  mappages(cpu, addr, size, MAPBANK, host, NULL, NULL);
 }
-static uint8_t ora(MOS6502 *cpu, MOS6502IContext *ctx) {
-  cpu->A = cpu->A | ctx->operand_immediate;
 
-  setzeroandnegative(cpu, cpu->A);
-  return 1;
+void mos6502_mapcontrol(MOS6502 *cpu, uint16_t addr, uint32_t size,
+                        writebusfunc write) {
+  if (!cpu->bus.io) {
+    cpu->bus.io = calloc(RAM / PAGESIZE, sizeof(MOS6502IOHandlers));
+    if (!cpu->bus.io)
+      return;
+  }
+
+  uint32_t last = (addr + size + PAGESIZE - 1) >> 8;
+  for (uint32_t i = addr >> 8; i < last && i < RAM / PAGESIZE; i++)
+    cpu->bus.io[i].write = write;
 }
-static uint8_t bit(MOS6502 *cpu, MOS6502IContext *ctx) {
-  uint8_t result = cpu->A & ctx->operand_immediate;
 
-  cpu->status.flags.V = (result & (1 << 6)) == (1 << 6);
-  setzeroandnegative(cpu, result);
-  return 1;
+void mos6502_markpure(MOS6502 *cpu, uint16_t addr, uint32_t size) {
+  uint32_t last = (addr + size + PAGESIZE - 1) >> 8;
+
+  for (uint32_t i = addr >> 8; i < last && i < RAM / PAGESIZE; i++)
+    if (!cpu->bus.pages[i].read)
+      cpu->bus.flags[i] |= PAGEPURE;
 }
 
-// Arithmetic --------------------------------------
-static uint8_t adc(MOS6502 *cpu, MOS6502IContext *ctx) {
-  uint16_t result = cpu->A + ctx->operand_immediate + cpu->status.flags.C;
+// Loader store, goes around the ROM write protection
+static uint8_t load(MOS6502 *cpu, uint16_t addr, uint8_t data) {
+  MOS6502Page *page = &cpu->bus.pages[addr >> 8];
 
-  cpu->status.flags.C = result > 0xFF;
-  cpu->status.flags.V =
-      ((~(cpu->A ^ ctx->operand_immediate) & (cpu->A ^ result)) & 0x0080) ==
-      0x0080;
-  cpu->A = result & 0x00FF;
+  if (!page->read || page->write || cpu->bus.flags[addr >> 8] & PAGEWATCH)
+    return mos6502_write(cpu, addr, data);
 
-  setzeroandnegative(cpu, cpu->A);
-  return 1;
-}
-static uint8_t sbc(MOS6502 *cpu, MOS6502IContext *ctx) {
-  uint16_t result = ctx->operand_immediate ^ 0x00FF;
-  uint16_t temp = cpu->A + result + cpu->status.flags.C;
+  uint8_t *host = privatepage(cpu, addr >> 8);
+  if (!host)
+    return 0;
 
-  cpu->status.flags.C = (temp & 0x00FF) != 0;
-  cpu->status.flags.V = ((temp ^ cpu->A) & (temp ^ result) & 0x0080) == 0x0080;
-  cpu->A = temp & 0x00FF;
+  if (cpu->bus.codepages[addr >> 8])
+    mos6502_invalidate(cpu, addr);
 
-  setzeroandnegative(cpu, cpu->A);
+  markdirty(cpu, addr >> 8);
+  host[addr & 0xFF] = data;
   return 1;
 }
-static uint8_t cmp(MOS6502 *cpu, MOS6502IContext *ctx) {
-  uint16_t result = cpu->A - ctx->operand_immediate;
 
-  cpu->status.flags.C = cpu->A >= ctx->operand_immediate;
-  cpu->status.flags.Z = cpu->A == ctx->operand_immediate;
-  cpu->status.flags.N = (result & 0x0080) == 0x0080;
+uint16_t mos6502_loadbytes(MOS6502 *cpu, uint8_t *bytes, uint16_t size) {
+  uint16_t max = (RAM / 2) - VECTORSLEN;
 
-  return 1;
-}
-static uint8_t cpx(MOS6502 *cpu, MOS6502IContext *ctx) {
-  uint16_t result = cpu->X - ctx->operand_immediate;
+  if (!cpu || !bytes || size > max) {
+    return -1;
+  }
 
-  cpu->status.flags.C = cpu->X >= ctx->operand_immediate;
-  cpu->status.flags.Z = cpu->A == ctx->operand_immediate;
-  cpu->status.flags.N = (result & 0x0080) == 0x0080;
+  size_t amount = 0;
+  for (uint16_t i = START; i < START + size; i++) {
+    amount += load(cpu, i, bytes[amount]);
+  }
 
-  return 1;
+  return amount;
 }
-static uint8_t cpy(MOS6502 *cpu, MOS6502IContext *ctx) {
-  uint16_t result = cpu->Y - ctx->operand_immediate;
 
-  cpu->status.flags.C = cpu->Y >= ctx->operand_immediate;
-  cpu->status.flags.Z = cpu->Y == ctx->operand_immediate;
-  cpu->status.flags.N = (result & 0x0080) == 0x0080;
+uint32_t mos6502_loadsegment(MOS6502 *cpu, uint16_t addr, const uint8_t *bytes,
+                             uint32_t size) {
+  uint32_t end = addr + size;
 
-  return 1;
-}
+  if (!cpu || !bytes || end > RAM)
+    return 0;
 
-// Increment and decrement
-static uint8_t inc(MOS6502 *cpu, MOS6502IContext *ctx) {
-  uint8_t value = cpu->bus.read(cpu, ctx->absolute_addr);
-  cpu->bus.write(cpu, ctx->absolute_addr, ++value);
+  // Whole pages in [first, last) are mapped, the rest is copied
+  uint32_t first = (addr + PAGESIZE - 1) & ~(PAGESIZE - 1);
+  uint32_t last = end & ~(PAGESIZE - 1);
+  uint32_t head = first < end ? first : end;
+  uint32_t amount = 0;
 
-  setzeroandnegative(cpu, value);
-  return 1;
-}
-static uint8_t inx(MOS6502 *cpu, MOS6502IContext *ctx) {
-  cpu->X++;
+  for (uint32_t i = addr; i < head; i++)
+    amount += load(cpu, i, bytes[i - addr]);
 
-  setzeroandnegative(cpu, cpu->X);
-  return 1;
-}
-static uint8_t iny(MOS6502 *cpu, MOS6502IContext *ctx) {
-  cpu->Y++;
+  if (first < last) {
+    mos6502_mapshared(cpu, first, last - first, bytes + (first - addr));
+    amount += last - first;
+  }
 
-  setzeroandnegative(cpu, cpu->Y);
-  return 1;
-}
-static uint8_t dec(MOS6502 *cpu, MOS6502IContext *ctx) {
-  uint8_t value = cpu->bus.read(cpu, ctx->absolute_addr);
-  cpu->bus.write(cpu, ctx->absolute_addr, --value);
+  for (uint32_t i = last > head ? last : head; i < end; i++)
+    amount += load(cpu, i, bytes[i - addr]);
 
-  setzeroandnegative(cpu, value);
-  return 1;
+  return amount;
 }
-static uint8_t dex(MOS6502 *cpu, MOS6502IContext *ctx) {
-  cpu->X--;
 
-  setzeroandnegative(cpu, cpu->X);
-  return 1;
-}
-static uint8_t dey(MOS6502 *cpu, MOS6502IContext *ctx) {
-  cpu->Y--;
+// -----------------------------------------
 
-  setzeroandnegative(cpu, cpu->Y);
-  return 1;
+// ACCESS_lda is READ, ACCESSOF(lda) is ACCESSREAD
+#define ACCESSOF(exec) ACCESSKIND(ACCESS_##exec)
+#define ACCESSKIND(kind) ACCESSPASTE(kind)
+#define ACCESSPASTE(kind) ACCESS##kind
+
+MOS6502Instruction opcodes[MAXOPCODESTABLE] = {
+#define OPCODE(opcode, mnemonic, exec, mode, cycles, pagecross)                \
+  {opcode, mnemonic, execute_##opcode, mode, cycles, pagecross, ACCESSOF(exec)},
+#include "opcodes.def"
+#undef OPCODE
+};
+
+// Pages backed by memory, reading I/O could return something new each time
+static uint8_t ismemory(MOS6502 *cpu, uint16_t first, uint16_t last) {
+  return cpu->bus.pages[first >> 8].read && cpu->bus.pages[last >> 8].read;
 }
 
-// Shifts
-// -----
+// Fetch the opcode and its operand bytes at pc
+static void decode(MOS6502 *cpu, uint16_t pc, MOS6502Decoded *decoded) {
+  uint8_t opcode = mos6502_read(cpu, pc);
 
-// Jumps
-static uint8_t jmp(MOS6502 *cpu, MOS6502IContext *ctx) {
-  cpu->PC = START | ctx->absolute_addr;
+  decoded->opcode = opcode;
+  decoded->exec = opcodes[opcode].exec;
+  decoded->mode = opcodes[opcode].mode;
+  decoded->length = instructionlength(opcodes[opcode].mode);
 
-  return 1;
+  switch (decoded->length) {
+    case 2:
+      decoded->operand = mos6502_read(cpu, pc + 1);
+      break;
+    case 3: {
+      uint8_t lo = mos6502_read(cpu, pc + 1);
+      uint8_t hi = mos6502_read(cpu, pc + 2);
+      decoded->operand = (hi << 8) | lo;
+      break;
+    }
+    default:
+      decoded->operand = 0;
+  }
+
+  decoded->fused = FUSENONE;
+  decoded->span = decoded->length;
 }
-static uint8_t jsr(MOS6502 *cpu, MOS6502IContext *ctx) {
-  uint16_t return_address = cpu->PC + 3;
-  cpu->bus.write(cpu, STACKBASE | cpu->SP--, return_address >> 8);
-  cpu->bus.write(cpu, STACKBASE | cpu->SP--, return_address & 0x00FF);
-  cpu->PC = START | ctx->absolute_addr;
 
-  return 1;
+// Run the specialized handler, which resolves the effective address and
+// updates PC
+static inline uint16_t dispatch(MOS6502 *cpu, MOS6502Decoded *decoded) {
+  if (!decoded->exec(cpu, decoded->operand))
+    return 0x7FFF;
+
+  return decoded->opcode;
 }
-static uint8_t rts(MOS6502 *cpu, MOS6502IContext *ctx) {
-  uint8_t lo = cpu->bus.read(cpu, STACKBASE | ++cpu->SP);
-  uint8_t hi = cpu->bus.read(cpu, STACKBASE | ++cpu->SP);
-  uint16_t return_address = (hi << 8) | lo;
 
-  cpu->PC = return_address;
-  return 1;
+// Superinstructions -------------------------------
+// A few pairs and triples make up most of typical code. When the
+// predecode cache decodes the first instruction of one, it decodes the
+// rest into the same entry, and the interpreter loop runs the whole
+// sequence through fused(). The entry spans every byte of it, so a write
+// to any of them drops it like any other cached instruction.
+
+static const uint8_t fusionlength[FUSIONS] = {1, 2, 2, 2, 2, 3};
+
+static uint8_t ismnemonic(uint8_t opcode, const char *mnemonic) {
+  return opcodes[opcode].mode < IND &&
+         !strcmp(opcodes[opcode].mnemonic, mnemonic);
 }
 
-// Branches
-static void branch(MOS6502 *cpu, uint8_t relative, uint8_t flag) {
-  if (flag) {
-    cpu->PC += relative + 2;
-  } else {
-    cpu->PC += 2;
+// Records the sequence starting with the instruction at pc, if any
+static void fuse(MOS6502 *cpu, uint16_t pc, MOS6502Decoded *decoded) {
+  MOS6502Decoded next[2];
+  uint8_t kind = FUSENONE;
+  uint16_t at = pc + decoded->length;
+
+  // Never read ahead into I/O
+  if (!ismemory(cpu, at, at + 2))
+    return;
+  decode(cpu, at, &next[0]);
+
+  uint8_t first = decoded->opcode, second = next[0].opcode;
+  if (ismnemonic(first, "LDA") && ismnemonic(second, "STA"))
+    kind = FUSELOADSTORE;
+  else if (ismnemonic(first, "CMP") && ismnemonic(second, "BNE"))
+    kind = FUSECOMPAREBRANCH;
+  else if (ismnemonic(first, "DEX") && ismnemonic(second, "BNE"))
+    kind = FUSECOUNTBRANCH;
+  else if (ismnemonic(first, "CLC") && ismnemonic(second, "ADC"))
+    kind = FUSECLEARADD;
+  else if (ismnemonic(first, "INX") && ismnemonic(second, "CPX")) {
+    at += next[0].length;
+    if (!ismemory(cpu, at, at + 1))
+      return;
+    decode(cpu, at, &next[1]);
+    if (ismnemonic(next[1].opcode, "BNE"))
+      kind = FUSECOUNTCOMPARE;
+  }
+
+  if (kind == FUSENONE)
+    return;
+
+  decoded->fused = kind;
+  for (int i = 0; i < fusionlength[kind] - 1; i++) {
+    decoded->next[i] = next[i].opcode;
+    decoded->operands[i] = next[i].operand;
+    decoded->span += next[i].length;
   }
 }
-static uint8_t bcc(MOS6502 *cpu, MOS6502IContext *ctx) {
-  branch(cpu, ctx->operand_immediate, !cpu->status.flags.C);
-  return 1;
-}
-static uint8_t bcs(MOS6502 *cpu, MOS6502IContext *ctx) {
-  branch(cpu, ctx->operand_immediate, cpu->status.flags.C);
-  return 1;
-}
-static uint8_t beq(MOS6502 *cpu, MOS6502IContext *ctx) {
-  branch(cpu, ctx->operand_immediate, cpu->status.flags.Z);
-  return 1;
-}
-static uint8_t bmi(MOS6502 *cpu, MOS6502IContext *ctx) {
-  branch(cpu, ctx->operand_immediate, cpu->status.flags.N);
-  return 1;
-}
-static uint8_t bne(MOS6502 *cpu, MOS6502IContext *ctx) {
-  branch(cpu, ctx->operand_immediate, !cpu->status.flags.Z);
+
+// Before every instruction after the first, the checks interpret() makes
+// between instructions. A deadline, a pending interrupt or event, a halt,
+// the breakpoint or a halt opcode splits the sequence there, and the loop
+// carries on from that instruction like it would have without fusion.
+#define FUSEDNEXT(opcode)                                                      \
+  if (cpu->cycles >= deadline || cpu->halt || cpu->PC == cpu->breakpoint ||    \
+      ishaltop(cpu, (opcode)))                                                 \
+    goto split;
+
+// Runs the sequence cached at cpu->PC, every instruction with the handler
+// it would have run on its own, so state and cycles are exactly the same.
+// Returns 0 when it was split.
+static uint8_t fused(MOS6502 *cpu, MOS6502Decoded *decoded,
+                     uint64_t deadline) {
+  uint8_t kind = decoded->fused;
+
+  switch (kind) {
+    case FUSELOADSTORE:
+      decoded->exec(cpu, decoded->operand);
+      FUSEDNEXT(decoded->next[0]);
+      opcodes[decoded->next[0]].exec(cpu, decoded->operands[0]);
+      break;
+    case FUSECOMPAREBRANCH:
+      decoded->exec(cpu, decoded->operand);
+      FUSEDNEXT(decoded->next[0]);
+      execute_0xd0(cpu, decoded->operands[0]);
+      break;
+    case FUSECOUNTBRANCH:
+      execute_0xca(cpu, 0);
+      FUSEDNEXT(decoded->next[0]);
+      execute_0xd0(cpu, decoded->operands[0]);
+      break;
+    case FUSECLEARADD:
+      execute_0x18(cpu, 0);
+      FUSEDNEXT(decoded->next[0]);
+      opcodes[decoded->next[0]].exec(cpu, decoded->operands[0]);
+      break;
+    case FUSECOUNTCOMPARE:
+      execute_0xe8(cpu, 0);
+      FUSEDNEXT(decoded->next[0]);
+      opcodes[decoded->next[0]].exec(cpu, decoded->operands[0]);
+      FUSEDNEXT(decoded->next[1]);
+      execute_0xd0(cpu, decoded->operands[1]);
+      break;
+  }
+
+  cpu->fusion.runs[kind]++;
+  cpu->fusion.instructions += fusionlength[kind];
   return 1;
+
+split:
+  cpu->fusion.splits[kind]++;
+  return 0;
 }
-static uint8_t bpl(MOS6502 *cpu, MOS6502IContext *ctx) {
-  branch(cpu, ctx->operand_immediate, !cpu->status.flags.N);
-  return 1;
+
+// Predecode cache ---------------------------------
+static MOS6502Decoded *lookup(MOS6502 *cpu, uint16_t pc) {
+  MOS6502Decoded *page = cpu->icache[pc >> 8];
+
+  if (!page) {
+    page = calloc(PAGESIZE, sizeof(MOS6502Decoded));
+    if (!page)
+      return NULL;
+
+    cpu->icache[pc >> 8] = page;
+  }
+
+  MOS6502Decoded *decoded = &page[pc & 0xFF];
+  if (!decoded->valid) {
+    decode(cpu, pc, decoded);
+    fuse(cpu, pc, decoded);
+    decoded->valid = 1;
+
+    cpu->bus.codepages[pc >> 8] = 1;
+    cpu->bus.codepages[(uint16_t)(pc + decoded->span - 1) >> 8] = 1;
+  }
+
+  return decoded;
 }
-static uint8_t bvc(MOS6502 *cpu, MOS6502IContext *ctx) {
-  branch(cpu, ctx->operand_immediate, !cpu->status.flags.V);
-  return 1;
+
+MOS6502Decoded *mos6502_predecode(MOS6502 *cpu, uint16_t pc) {
+  return lookup(cpu, pc);
 }
-static uint8_t bvs(MOS6502 *cpu, MOS6502IContext *ctx) {
-  branch(cpu, ctx->operand_immediate, cpu->status.flags.V);
-  return 1;
+
+// Drop every cached instruction (or sequence) whose bytes cover addr
+void mos6502_invalidate(MOS6502 *cpu, uint16_t addr) {
+  if (cpu->jit)
+    mos6502_jitinvalidate(cpu, addr);
+
+  for (uint16_t pc = addr - (FUSEMAXSPAN - 1), i = 0; i < FUSEMAXSPAN;
+       pc++, i++) {
+    MOS6502Decoded *page = cpu->icache[pc >> 8];
+    if (!page)
+      continue;
+
+    MOS6502Decoded *decoded = &page[pc & 0xFF];
+    if (decoded->valid && (uint16_t)(addr - pc) < decoded->span)
+      decoded->valid = 0;
+  }
 }
 
-// Status Flags
-static uint8_t clc(MOS6502 *cpu, MOS6502IContext *ctx) {
-  cpu->status.flags.C = 0;
-  return 1;
+// Trace or profile attached, only the interpreter loop takes care of them
+static inline uint8_t observed(MOS6502 *cpu) {
+  return cpu->trace || cpu->profile;
 }
-static uint8_t cld(MOS6502 *cpu, MOS6502IContext *ctx) {
-  cpu->status.flags.D = 0;
-  return 1;
+
+// dispatch, then hand the retired instruction to cpu->trace and
+// cpu->profile
+static uint16_t observeddispatch(MOS6502 *cpu, MOS6502Decoded *decoded) {
+  uint16_t pc = cpu->PC;
+  uint64_t cycles = cpu->cycles;
+  uint16_t addr = decoded->operand;
+  uint8_t flags = 0;
+
+  // Only instructions that access their operand's address, not JMP, JSR
+  // or the ones the core skips
+  switch (opcodes[decoded->opcode].access) {
+    case ACCESSREAD:
+    case ACCESSWRITE:
+    case ACCESSMODIFY:
+      flags = TRACEMEM;
+      break;
+  }
+
+  switch (decoded->mode) {
+    case ZP0:
+    case ABS:
+      break;
+    case ZP0X:
+      addr = (uint8_t)(addr + cpu->X);
+      break;
+    case ZP0Y:
+      addr = (uint8_t)(addr + cpu->Y);
+      break;
+    case ABSX:
+      addr += cpu->X;
+      break;
+    case ABSY:
+      addr += cpu->Y;
+      break;
+    default:
+      flags = 0;
+  }
+
+  uint16_t result = dispatch(cpu, decoded);
+  if (result == 0x7FFF)
+    return result;
+
+  if (cpu->profile)
+    mos6502_profilestep(cpu->profile, pc, decoded->opcode,
+                        cpu->cycles - cycles, cpu->PC);
+
+  if (!cpu->trace)
+    return result;
+
+  MOS6502TraceRecord *record = mos6502_tracenext(cpu->trace);
+  const uint8_t *page = cpu->bus.pages[addr >> 8].read;
+
+  if (flags && !page)
+    flags |= TRACEIO;
+
+  record->pc = pc;
+  record->addr = addr;
+  record->opcode = decoded->opcode;
+  record->operand[0] = decoded->operand;
+  record->operand[1] = decoded->operand >> 8;
+  record->A = cpu->A;
+  record->X = cpu->X;
+  record->Y = cpu->Y;
+  record->SP = cpu->SP;
+  record->P = mos6502_getps(cpu);
+  record->data = page ? page[addr & 0xFF] : 0;
+  record->cycles = cpu->cycles - cycles;
+  record->flags = flags;
+
+  return result;
 }
-static uint8_t cli(MOS6502 *cpu, MOS6502IContext *ctx) {
-  cpu->status.flags.I = 0;
-  return 1;
+
+// The interrupt entry service took, as a record of its own
+static void observeinterrupt(MOS6502 *cpu, uint8_t line, uint16_t pc,
+                             uint64_t cycles) {
+  if (cpu->profile)
+    mos6502_profileinterrupt(cpu->profile, cycles);
+
+  if (!cpu->trace)
+    return;
+
+  MOS6502TraceRecord *record = mos6502_tracenext(cpu->trace);
+  record->pc = pc;
+  record->addr = 0;
+  record->opcode = 0;
+  record->operand[0] = line;
+  record->operand[1] = 0;
+  record->A = cpu->A;
+  record->X = cpu->X;
+  record->Y = cpu->Y;
+  record->SP = cpu->SP;
+  record->P = mos6502_getps(cpu);
+  record->data = 0;
+  record->cycles = cycles;
+  record->flags = TRACEINT;
 }
-static uint8_t clv(MOS6502 *cpu, MOS6502IContext *ctx) {
-  cpu->status.flags.V = 0;
-  return 1;
+
+static uint16_t step(MOS6502 *cpu, MOS6502Decoded *decoded) {
+  MOS6502Decoded *cached = NULL;
+  if (cpu->engine == PREDECODE)
+    cached = lookup(cpu, cpu->PC);
+
+  if (!cached) {
+    cached = decoded;
+    decode(cpu, cpu->PC, decoded);
+  }
+
+  if (observed(cpu))
+    return observeddispatch(cpu, cached);
+
+  return dispatch(cpu, cached);
 }
-static uint8_t sec(MOS6502 *cpu, MOS6502IContext *ctx) {
-  cpu->status.flags.C = 1;
-  return 1;
+
+uint16_t mos6502_execute(MOS6502 *cpu) {
+  MOS6502Decoded decoded;
+
+  return step(cpu, &decoded);
 }
-static uint8_t sed(MOS6502 *cpu, MOS6502IContext *ctx) {
-  cpu->status.flags.D = 1;
-  return 1;
+
+// Idle loops --------------------------------------
+// Instructions that don't write memory or the stack
+static uint8_t isidleop(uint8_t opcode) {
+  if (opcodes[opcode].mode >= IND)
+    return 0;
+
+  switch (opcodes[opcode].access) {
+    case ACCESSNONE:
+    case ACCESSREAD:
+    case ACCESSBRANCH:
+      return 1;
+    default:
+      return 0;
+  }
 }
-static uint8_t sei(MOS6502 *cpu, MOS6502IContext *ctx) {
-  cpu->status.flags.I = 1;
-  return 1;
+
+// Pages a loop can poll without any effect: memory, or I/O marked pure.
+// Not while recording or replaying, where every I/O read is an input.
+static uint8_t ispure(MOS6502 *cpu, uint8_t index) {
+  return cpu->bus.pages[index].read ||
+         (cpu->bus.flags[index] & PAGEPURE && !cpu->replay);
 }
 
-// Other
-static uint8_t nop(MOS6502 *cpu, MOS6502IContext *ctx) {
-  return 1;
+static uint8_t ispollable(MOS6502 *cpu, uint16_t first, uint16_t last) {
+  return ispure(cpu, first >> 8) && ispure(cpu, last >> 8);
 }
 
-// -----------------------------------------
+uint8_t mos6502_idleloop(MOS6502 *cpu, uint16_t pc, uint16_t target,
+                         uint32_t *worst) {
+  uint32_t boundaries = 0, branches = 0; // Bit per body byte
+  MOS6502Decoded closing;
 
-MOS6502Instruction opcodes[MAXOPCODESTABLE] = {
-    {0x00, "BRK", illg, IMP},
-    {0x01, "ORA", ora, IDEIND},
-    {0x02, ILLEGAL, illg, ILL},
-    {0x03, ILLEGAL, illg, ILL},
-    {0x04, ILLEGAL, illg, ILL},
-    {0x05, "ORA", ora, ZP0},
-    {0x06, "ASL", illg, ZP0},
-    {0x07, ILLEGAL, illg, ILL},
-    {0x08, "PHP", php, IMP},
-    {0x09, "ORA", ora, IMM},
-    {0x0a, "ASL", illg, ACC},
-    {0x0b, ILLEGAL, illg, ILL},
-    {0x0c, ILLEGAL, illg, ILL},
-    {0x0d, "ORA", ora, ABS},
-    {0x0e, "ASL", illg, ABS},
-    {0x0f, ILLEGAL, illg, ILL}, // 1
-    // -----------------
-    {0x10, "BPL", bpl, RELT},
-    {0x11, "ORA", ora, INDIDE},
-    {0x12, ILLEGAL, illg, ILL},
-    {0x13, ILLEGAL, illg, ILL},
-    {0x14, ILLEGAL, illg, ILL},
-    {0x15, "ORA", ora, ZP0X},
-    {0x16, "ASL", illg, ZP0X},
-    {0x17, ILLEGAL, illg, ILL},
-    {0x18, "CLC", clc, IMP},
-    {0x19, "ORA", ora, ABSY},
-    {0x1a, ILLEGAL, illg, ILL},
-    {0x1b, ILLEGAL, illg, ILL},
-    {0x1c, ILLEGAL, illg, ILL},
-    {0x1d, "ORA", ora, ABSX},
-    {0x1e, "ASL", illg, ABSX},
-    {0x1f, ILLEGAL, illg, ILL}, // 2
-    // ------------------
-    {0x20, "JSR", jsr, ABS},
-    {0x21, "AND", and, IDEIND},
-    {0x22, ILLEGAL, illg, ILL},
-    {0x23, ILLEGAL, illg, ILL},
-    {0x24, "BIT", bit, ZP0},
-    {0x25, "AND", and, ZP0},
-    {0x26, "ROL", illg, ZP0},
-    {0x27, ILLEGAL, illg, ILL},
-    {0x28, "PLP", plp, IMP},
-    {0x29, "AND", and, IMM},
-    {0x2a, "ROL", illg, ACC},
-    {0x2b, ILLEGAL, illg, ILL},
-    {0x2c, "BIT", bit, ABS},
-    {0x2d, "AND", and, ABS},
-    {0x2e, "ROL", illg, ABS},
-    {0x2f, ILLEGAL, illg, ILL}, // 3
-    // -------------------
-    {0x30, "BMI", bmi, RELT},
-    {0x31, "AND", and, INDIDE},
-    {0x32, ILLEGAL, illg, ILL},
-    {0x33, ILLEGAL, illg, ILL},
-    {0x34, ILLEGAL, illg, ILL},
-    {0x35, "AND", and, ZP0X},
-    {0x36, "ROL", illg, ZP0X},
-    {0x37, ILLEGAL, illg, ILL},
-    {0x38, "SEC", sec, IMP},
-    {0x39, "AND", and, ABSY},
-    {0x3a, ILLEGAL, illg, ILL},
-    {0x3b, ILLEGAL, illg, ILL},
-    {0x3c, ILLEGAL, illg, ILL},
-    {0x3d, "AND", and, ABSX},
-    {0x3e, "ROL", illg, ABSX},
-    {0x3f, ILLEGAL, illg, ILL}, // 4
-    // ---------------------
-    {0x40, "RTI", illg, IMP},
-    {0x41, "EOR", eor, IDEIND},
-    {0x42, ILLEGAL, illg, ILL},
-    {0x43, ILLEGAL, illg, ILL},
-    {0x44, ILLEGAL, illg, ILL},
-    {0x45, "EOR", eor, ZP0},
-    {0x46, "LSR", illg, ZP0},
-    {0x47, ILLEGAL, illg, ILL},
-    {0x48, "PHA", pha, IMP},
-    {0x49, "EOR", eor, IMM},
-    {0x4a, "LSR", illg, ACC},
-    {0x4b, ILLEGAL, illg, ILL},
-    {0x4c, "JMP", jmp, ABS},
-    {0x4d, "EOR", eor, ABS},
-    {0x4e, "LSR", illg, ABS},
-    {0x4f, ILLEGAL, illg, ILL}, // 5
-    // --------------------
-    {0x50, "BVC", bvc, RELT},
-    {0x51, "EOR", eor, INDIDE},
-    {0x52, ILLEGAL, illg, ILL},
-    {0x53, ILLEGAL, illg, ILL},
-    {0x54, ILLEGAL, illg, ILL},
-    {0x55, "EOR", eor, ZP0X},
-    {0x56, "LSR", illg, ZP0X},
-    {0x57, ILLEGAL, illg, ILL},
-    {0x58, "CLI", cli, IMP},
-    {0x59, "EOR", eor, ABSY},
-    {0x5a, ILLEGAL, illg, ILL},
-    {0x5b, ILLEGAL, illg, ILL},
-    {0x5c, ILLEGAL, illg, ILL},
-    {0x5d, "EOR", eor, ABSX},
-    {0x5e, "LSR", illg, ABSX},
-    {0x5f, ILLEGAL, illg, ILL}, // 6
-    // ----------------------
-    {0x60, "RTS", rts, IMP},
-    {0x61, "ADC", adc, IDEIND},
-    {0x62, ILLEGAL, illg, ILL},
-    {0x63, ILLEGAL, illg, ILL},
-    {0x64, ILLEGAL, illg, ILL},
-    {0x65, "ADC", adc, ZP0},
-    {0x66, "ROR", illg, ZP0},
-    {0x67, ILLEGAL, illg, ILL},
-    {0x68, "PLA", pla, IMP},
-    {0x69, "ADC", adc, IMM},
-    {0x6a, "ROR", illg, ACC},
-    {0x6b, ILLEGAL, illg, ILL},
-    {0x6c, "JMP", jmp, IND},
-    {0x6d, "ADC", adc, ABS},
-    {0x6e, "ROR", illg, ABS},
-    {0x6f, ILLEGAL, illg, ILL}, // 7
-    // ----------------------
-    {0x70, "BVS", bvs, RELT},
-    {0x71, "ADC", adc, INDIDE},
-    {0x72, ILLEGAL, illg, ILL},
-    {0x73, ILLEGAL, illg, ILL},
-    {0x74, ILLEGAL, illg, ILL},
-    {0x75, "ADC", adc, ZP0X},
-    {0x76, "ROR", illg, ZP0X},
-    {0x77, ILLEGAL, illg, ILL},
-    {0x78, "SEI", sei, IMP},
-    {0x79, "ADC", adc, ABSY},
-    {0x7a, ILLEGAL, illg, ILL},
-    {0x7b, ILLEGAL, illg, ILL},
-    {0x7c, ILLEGAL, illg, ILL},
-    {0x7d, "ADC", adc, ABSX},
-    {0x7e, "ROR", illg, ABSX},
-    {0x7f, ILLEGAL, illg, ILL}, // 8
-    // ----------------------
-    {0x80, ILLEGAL, illg, ILL},
-    {0x81, "STA", sta, IDEIND},
-    {0x82, ILLEGAL, illg, ILL},
-    {0x83, ILLEGAL, illg, ILL},
-    {0x84, "STY", sty, ZP0},
-    {0x85, "STA", sta, ZP0},
-    {0x86, "STX", stx, ZP0},
-    {0x87, ILLEGAL, illg, ILL},
-    {0x88, "DEY", dey, IMP},
-    {0x89, ILLEGAL, illg, ILL},
-    {0x8a, "TXA", txa, IMP},
-    {0x8b, ILLEGAL, illg, ILL},
-    {0x8c, "STY", sty, ABS},
-    {0x8d, "STA", sta, ABS},
-    {0x8e, "STX", stx, ABS},
-    {0x8f, ILLEGAL, illg, ILL}, // 9
-    // ---------------------
-    {0x90, "BCC", bcc, RELT},
-    {0x91, "STA", sta, INDIDE},
-    {0x92, ILLEGAL, illg, ILL},
-    {0x93, ILLEGAL, illg, ILL},
-    {0x94, "STY", sty, ZP0X},
-    {0x95, "STA", sta, ZP0X},
-    {0x96, "STX", stx, ZP0Y},
-    {0x97, ILLEGAL, illg, ILL},
-    {0x98, "TYA", tya, IMP},
-    {0x99, "STA", sta, ABSY},
-    {0x9a, "TXS", txs, IMP},
-    {0x9b, ILLEGAL, illg, ILL},
-    {0x9c, ILLEGAL, illg, ILL},
-    {0x9d, "STA", sta, ABSX},
-    {0x9e, ILLEGAL, illg, ILL},
-    {0x9f, ILLEGAL, illg, ILL}, // 10
-    // ----------------------
-    {0xa0, "LDY", ldy, IMM},
-    {0xa1, "LDA", lda, IDEIND},
-    {0xa2, "LDX", ldx, IMM},
-    {0xa3, ILLEGAL, illg, ILL},
-    {0xa4, "LDY", ldy, ZP0},
-    {0xa5, "LDA", lda, ZP0},
-    {0xa6, "LDX", ldx, ZP0},
-    {0xa7, ILLEGAL, illg, ILL},
-    {0xa8, "TAY", tay, IMP},
-    {0xa9, "LDA", lda, IMM},
-    {0xaa, "TAX", tax, IMP},
-    {0xab, ILLEGAL, illg, ILL},
-    {0xac, "LDY", ldy, ABS},
-    {0xad, "LDA", lda, ABS},
-    {0xae, "LDX", ldx, ABS},
-    {0xaf, ILLEGAL, illg, ILL}, // 11
-    // --------------------
-    {0xb0, "BCS", bcs, RELT},
-    {0xb1, "LDA", lda, INDIDE},
-    {0xb2, ILLEGAL, illg, ILL},
-    {0xb3, ILLEGAL, illg, ILL},
-    {0xb4, "LDY", ldy, ZP0X},
-    {0xb5, "LDA", lda, ZP0X},
-    {0xb6, "LDX", ldx, ZP0Y},
-    {0xb7, ILLEGAL, illg, ILL},
-    {0xb8, "CLV", clv, IMP},
-    {0xb9, "LDA", lda, ABSY},
-    {0xba, "TSX", tsx, IMP},
-    {0xbb, ILLEGAL, illg, ILL},
-    {0xbc, "LDY", ldy, ABSX},
-    {0xbd, "LDA", lda, ABSX},
-    {0xbe, "LDX", ldx, ABSY},
-    {0xbf, ILLEGAL, illg, ILL}, // 12
-    // -------------------
-    {0xc0, "CPY", cpy, IMM},
-    {0xc1, "CMP", cmp, IDEIND},
-    {0xc2, ILLEGAL, illg, ILL},
-    {0xc3, ILLEGAL, illg, ILL},
-    {0xc4, "CPY", cpy, ZP0},
-    {0xc5, "CMP", cmp, ZP0},
-    {0xc6, "DEC", dec, ZP0},
-    {0xc7, ILLEGAL, illg, ILL},
-    {0xc8, "INY", iny, IMP},
-    {0xc9, "CMP", cmp, IMM},
-    {0xca, "DEX", dex, IMP},
-    {0xcb, ILLEGAL, illg, ILL},
-    {0xcc, "CPY", cpy, ABS},
-    {0xcd, "CMP", cmp, ABS},
-    {0xce, "DEC", dec, ABS},
-    {0xcf, ILLEGAL, illg, ILL}, // 13
-    // --------------------
-    {0xd0, "BNE", bne, RELT},
-    {0xd1, "CMP", cmp, INDIDE},
-    {0xd2, ILLEGAL, illg, ILL},
-    {0xd3, ILLEGAL, illg, ILL},
-    {0xd4, ILLEGAL, illg, ILL},
-    {0xd5, "CMP", cmp, ZP0X},
-    {0xd6, "DEC", dec, ZP0X},
-    {0xd7, ILLEGAL, illg, ILL},
-    {0xd8, "CLD", cld, IMP},
-    {0xd9, "CMP", cmp, ABSY},
-    {0xda, ILLEGAL, illg, ILL},
-    {0xdb, ILLEGAL, illg, ILL},
-    {0xdc, ILLEGAL, illg, ILL},
-    {0xdd, "CMP", cmp, ABSX},
-    {0xde, "DEC", dec, ABSX},
-    {0xdf, ILLEGAL, illg, ILL}, // 14
-    // --------------------
-    {0xe0, "CPX", cpx, IMM},
-    {0xe1, "SBC", sbc, IDEIND},
-    {0xe2, ILLEGAL, illg, ILL},
-    {0xe3, ILLEGAL, illg, ILL},
-    {0xe4, "CPX", cpx, ZP0},
-    {0xe5, "SBC", sbc, ZP0},
-    {0xe6, "INC", inc, ZP0},
-    {0xe7, ILLEGAL, illg, ILL},
-    {0xe8, "INX", inx, IMP},
-    {0xe9, "SBC", sbc, IMM},
-    {0xea, "NOP", nop, IMP},
-    {0xeb, ILLEGAL, illg, ILL},
-    {0xec, "CPX", cpx, ABS},
-    {0xed, "SBC", sbc, ABS},
-    {0xee, "INC", inc, ABS},
-    {0xef, ILLEGAL, illg, ILL}, // 15
-    // ----------------------
-    {0xf0, "BEQ", beq, RELT},
-    {0xf1, "SBC", sbc, INDIDE},
-    {0xf2, ILLEGAL, illg, ILL},
-    {0xf3, ILLEGAL, illg, ILL},
-    {0xf4, ILLEGAL, illg, ILL},
-    {0xf5, "SBC", sbc, ZP0X},
-    {0xf6, "INC", inc, ZP0X},
-    {0xf7, ILLEGAL, illg, ILL},
-    {0xf8, "SED", sed, IMP},
-    {0xf9, "SBC", sbc, ABSY},
-    {0xfa, ILLEGAL, illg, ILL},
-    {0xfb, ILLEGAL, illg, ILL},
-    {0xfc, ILLEGAL, illg, ILL},
-    {0xfd, "SBC", sbc, ABSX},
-    {0xfe, "INC", inc, ABSX},
-    {0xff, ILLEGAL, illg, ILL} // 16
-                               // ----------------------
-                               // ----------------------
-};
+  if (target > pc || pc - target >= IDLEMAXBODY ||
+      (cpu->breakpoint >= target && cpu->breakpoint <= pc) ||
+      !ismemory(cpu, pc, pc + 2))
+    return 0;
+
+  decode(cpu, pc, &closing);
+  if (ishaltop(cpu, closing.opcode) ||
+      (closing.opcode != 0x4C && !isbranchop(closing.opcode)))
+    return 0;
+
+  // Taken branches take one more, two across a page
+  uint32_t cycles = opcodes[closing.opcode].cycles;
+  if (closing.mode == RELT)
+    cycles += 2;
+
+  uint16_t at = target;
+  while (at < pc) {
+    MOS6502Decoded decoded;
+
+    if (!ismemory(cpu, at, at + 2))
+      return 0;
+
+    decode(cpu, at, &decoded);
+    if (!isidleop(decoded.opcode) || ishaltop(cpu, decoded.opcode))
+      return 0;
+
+    uint16_t operand = decoded.operand;
+    switch (decoded.mode) {
+      case ZP0:
+      case ABS:
+        if (!ispollable(cpu, operand, operand))
+          return 0;
+        break;
+      case ZP0X:
+      case ZP0Y: // Anywhere in the zero page
+        if (!ispollable(cpu, 0x00, 0xFF))
+          return 0;
+        break;
+      case ABSX:
+      case ABSY:
+        if (!ispollable(cpu, operand, (uint16_t)(operand + 0xFF)))
+          return 0;
+        break;
+      case RELT: { // Leaving the body is fine, landing inside must be on
+                   // an instruction
+        uint16_t branch = at + (int8_t)operand + 2;
+        if (branch >= target && branch <= pc)
+          branches |= 1u << (branch - target);
+        break;
+      }
+    }
 
-static uint8_t isvalidopcode(uint8_t opcode) {
-  if (opcode <= 0x00 || opcode > 0xff)
+    boundaries |= 1u << (at - target);
+    cycles += opcodes[decoded.opcode].cycles + 2;
+    at += decoded.length;
+  }
+
+  boundaries |= 1u << (pc - target);
+  if (at != pc || (branches & ~boundaries))
     return 0;
 
+  if (worst)
+    *worst = cycles;
   return 1;
 }
 
-uint16_t mos6502_execute(MOS6502 *cpu) {
-  uint8_t opcode = cpu->bus.read(cpu, cpu->PC);
+void mos6502_idle(MOS6502 *cpu, uint16_t pc, uint64_t deadline) {
+  MOS6502Idle *idle = &cpu->idle;
+  uint16_t target = cpu->PC;
+  uint32_t worst;
 
-  if (!isvalidopcode(opcode)) {
-    return 0x7FFF;
+  if (idle->pc != pc) {
+    idle->pc = pc;
+    idle->backoff = 1;
   }
 
-  MOS6502IContext context = {0};
+  // Run one more iteration and see if it changed anything. The deadline
+  // must be far enough not to overrun it.
+  if (!idle->skip || !mos6502_idleloop(cpu, pc, target, &worst) ||
+      cpu->cycles >= deadline ||
+      deadline - cpu->cycles < 2 * (uint64_t)worst)
+    goto busy;
+
+  uint8_t A = cpu->A, X = cpu->X, Y = cpu->Y, SP = cpu->SP;
+  uint8_t ps = mos6502_getps(cpu);
+  uint64_t cycles = cpu->cycles;
+  uint64_t instructions = cpu->instructions;
+  MOS6502Decoded scratch;
+  uint16_t at;
+
+  do {
+    at = cpu->PC;
+    if (at < target || at > pc)
+      goto busy; // Left the loop
+    step(cpu, &scratch);
+  } while (at != pc);
+
+  // A branch closing the loop can fall through instead
+  if (cpu->PC != target || cpu->halt)
+    goto busy;
+
+  if (cpu->A != A || cpu->X != X || cpu->Y != Y || cpu->SP != SP ||
+      mos6502_getps(cpu) != ps)
+    goto busy;
+
+  // Nothing else can change the memory it reads
+  if (deadline == UINT64_MAX) {
+    cpu->halt = HALTIDLE;
+    return;
+  }
 
-  switch (opcodes[opcode].mode) {
-    case IMP: { // Implied
-      opcodes[opcode].exec(cpu, NULL);
+  uint64_t period = cpu->cycles - cycles;
+  uint64_t skip = (deadline - cpu->cycles) / period;
 
-      if ((void *)opcodes[opcode].exec == (void *)rts) {
-        return opcode;
-      }
+  uint64_t loop = cpu->instructions - instructions;
 
-      cpu->PC++;
-      return opcode;
-    }
+  cpu->cycles += skip * period;
+  cpu->instructions += skip * loop;
+  idle->skipped += skip * period;
+  idle->skippedinstructions += skip * loop;
+  idle->backoff = 1;
+  return;
 
-    case ACC: { // Accumulator
-      opcodes[opcode].exec(cpu, NULL);
+busy:
+  idle->wait = idle->backoff;
+  if (idle->backoff < IDLEMAXBACKOFF)
+    idle->backoff *= 2;
+}
 
-      cpu->PC++;
-      return opcode;
-    }
+void mos6502_sethaltop(MOS6502 *cpu, uint8_t opcode) {
+  cpu->haltops[opcode >> 3] |= 1 << (opcode & 7);
+}
 
-    case IMM: { // Immediate
-      context.operand_immediate = cpu->bus.read(cpu, cpu->PC + 1);
-      opcodes[opcode].exec(cpu, &context);
+// Interpreter loop, with watch constant so the copy without the trace and
+// profile hooks doesn't test for them on every instruction
+static inline __attribute__((always_inline)) void
+interpret(MOS6502 *cpu, uint64_t deadline, const uint8_t watch) {
+  MOS6502Decoded scratch;
 
-      cpu->PC += 2;
-      return opcode;
+  while (cpu->cycles < deadline && !cpu->halt) {
+    if (cpu->PC == cpu->breakpoint) {
+      cpu->halt = HALTBREAK;
+      break;
     }
 
-    case ZP0: { // Zero Page
-      uint8_t addr = cpu->bus.read(cpu, cpu->PC + 1);
-      context.operand_immediate = cpu->bus.read(cpu, addr);
-      context.absolute_addr = addr;
-      opcodes[opcode].exec(cpu, &context);
+    MOS6502Decoded *decoded = NULL;
+    if (cpu->engine == PREDECODE)
+      decoded = lookup(cpu, cpu->PC);
 
-      cpu->PC += 2;
-      return opcode;
+    if (!decoded) {
+      decoded = &scratch;
+      decode(cpu, cpu->PC, decoded);
     }
 
-    case ZP0X: { // Zero Page with X
-      uint8_t addr = cpu->bus.read(cpu, cpu->PC + 1);
-      context.operand_immediate = cpu->bus.read(cpu, addr + cpu->X);
-      context.absolute_addr = addr + cpu->X;
-      opcodes[opcode].exec(cpu, &context);
-
-      cpu->PC += 2;
-      return opcode;
+    if (ishaltop(cpu, decoded->opcode)) {
+      cpu->halt = HALTOPCODE;
+      break;
     }
 
-    case ZP0Y: { // Zero Page with Y
-      uint8_t addr = cpu->bus.read(cpu, cpu->PC + 1);
-      context.operand_immediate = cpu->bus.read(cpu, addr + cpu->Y);
-      context.absolute_addr = addr + cpu->Y;
-      opcodes[opcode].exec(cpu, &context);
+    // Every instruction is traced and profiled on its own. The sequences
+    // that end in BNE can close a loop like the branch on its own would.
+    if (!watch && decoded->fused && cpu->fusion.enabled) {
+      uint16_t branch = cpu->PC + decoded->span - 2;
+      uint8_t last = decoded->next[fusionlength[decoded->fused] - 2];
 
-      cpu->PC += 2;
-      return opcode;
+      if (fused(cpu, decoded, deadline) && isbranchop(last) &&
+          cpu->PC <= branch)
+        mos6502_backjump(cpu, branch, deadline);
+      continue;
     }
 
-    case RELT: { // Relative
-      context.operand_immediate = cpu->bus.read(cpu, cpu->PC + 1);
-      opcodes[opcode].exec(cpu, &context);
-      
-      return opcode;
+    uint16_t pc = cpu->PC;
+    uint16_t result = watch ? observeddispatch(cpu, decoded)
+                            : dispatch(cpu, decoded);
+    if (result == 0x7FFF) {
+      cpu->halt = HALTILLEGAL;
+      break;
     }
 
-    case ABS: { // Absolute
-      uint8_t lo = cpu->bus.read(cpu, cpu->PC + 1);
-      uint8_t hi = cpu->bus.read(cpu, cpu->PC + 2);
-      uint16_t addr = ((hi << 8) | lo);
+    // Every trip around a loop is traced and profiled, only skip unwatched
+    if (!watch && (result == 0x4C || isbranchop(result)) && cpu->PC <= pc)
+      mos6502_backjump(cpu, pc, deadline);
+  }
+}
 
-      context.operand_immediate = cpu->bus.read(cpu, addr);
-      context.absolute_addr = addr;
-      opcodes[opcode].exec(cpu, &context);
+// Interrupts --------------------------------------
+void mos6502_irq(MOS6502 *cpu, uint8_t source, uint8_t level) {
+  if (level)
+    cpu->irq |= 1 << (source & 7);
+  else
+    cpu->irq &= ~(1 << (source & 7));
 
-      if ((void *)opcodes[opcode].exec == (void *)jmp ||
-          (void *)opcodes[opcode].exec == (void *)jsr) {
-        return opcode;
-      }
+  mos6502_checkirq(cpu);
+}
 
-      cpu->PC += 3;
-      return opcode;
-    }
+void mos6502_interrupt(MOS6502 *cpu, MOS6502Interrupts line) {
+  cpu->pending |= line;
+  mos6502_attention(cpu);
+}
 
-    case ABSX: { // Absolute with X
-      uint8_t lo = cpu->bus.read(cpu, cpu->PC + 1);
-      uint8_t hi = cpu->bus.read(cpu, cpu->PC + 2);
-      uint16_t addr = ((hi << 8) | lo) + cpu->X;
+// Like BRK, but PC is the next instruction and B is clear
+static void enterinterrupt(MOS6502 *cpu, uint16_t vector) {
+  mos6502_write(cpu, STACKBASE | cpu->SP--, cpu->PC >> 8);
+  mos6502_write(cpu, STACKBASE | cpu->SP--, cpu->PC & 0x00FF);
+  mos6502_write(cpu, STACKBASE | cpu->SP--,
+                (mos6502_getps(cpu) & ~0x10) | 0x20);
+  cpu->status.flags.I = 1;
+  cpu->PC = mos6502_read(cpu, vector) | mos6502_read(cpu, vector + 1) << 8;
+  cpu->cycles += 7;
+}
 
-      context.operand_immediate = cpu->bus.read(cpu, addr);
-      context.absolute_addr = addr;
-      opcodes[opcode].exec(cpu, &context);
+// The interrupt to take now, 0 for none
+static uint8_t takeable(MOS6502 *cpu) {
+  // Devices don't interrupt a replay, the log does
+  if (mos6502_replaying(cpu)) {
+    cpu->pending = 0;
+    return mos6502_replayinterrupt(cpu);
+  }
 
-      cpu->PC += 3;
-      return opcode;
-    }
+  uint8_t line = 0;
+  if (cpu->pending & INTRESET) {
+    line = INTRESET;
+    cpu->pending = 0;
+  } else if (cpu->pending & INTNMI) {
+    line = INTNMI;
+    cpu->pending &= ~INTNMI;
+  } else if (cpu->irq && !cpu->status.flags.I) {
+    line = INTIRQ;
+  }
 
-    case ABSY: { // Absolute with Y
-      uint8_t lo = cpu->bus.read(cpu, cpu->PC + 1);
-      uint8_t hi = cpu->bus.read(cpu, cpu->PC + 2);
-      uint16_t addr = ((hi << 8) | lo) + cpu->Y;
+  if (line && cpu->replay)
+    mos6502_recordinterrupt(cpu, line);
 
-      context.operand_immediate = cpu->bus.read(cpu, addr);
-      context.absolute_addr = addr;
-      opcodes[opcode].exec(cpu, &context);
+  return line;
+}
 
-      cpu->PC += 3;
-      return opcode;
-    }
+// Runs the events that are due and takes the interrupt with the highest
+// priority. Returns where the engine has to stop next.
+static uint64_t service(MOS6502 *cpu, uint64_t deadline) {
+  if (cpu->halt == HALTPENDING)
+    cpu->halt = HALTNONE;
 
-    case IND: { // Indirect
+  mos6502_runevents(cpu);
+
+  uint16_t pc = cpu->PC;
+  uint64_t cycles = cpu->cycles;
+  uint8_t line = takeable(cpu);
+
+  switch (line) {
+    case INTRESET:
+      mos6502_reset(cpu);
+      cpu->cycles += 7;
       break;
-    }
-    case IDEIND: // Indexed Indirect X
+    case INTNMI:
+      enterinterrupt(cpu, NMIVL);
       break;
-    case INDIDE: // Indirect Indexed Y
+    case INTIRQ:
+      enterinterrupt(cpu, IRQVL);
       break;
-    case ILL:
-      return 0x7FFF;
   }
 
-  return 0x7FFF;
+  if (line && observed(cpu))
+    observeinterrupt(cpu, line, pc, cpu->cycles - cycles);
+
+  uint64_t next = mos6502_nextevent(cpu);
+  if (mos6502_replaying(cpu) && mos6502_replaynext(cpu) < next)
+    next = mos6502_replaynext(cpu);
+
+  uint64_t until = next < deadline ? next : deadline;
+
+  if (cpu->scheduler)
+    cpu->scheduler->until = until;
+
+  return until;
+}
+
+static void runengine(MOS6502 *cpu, uint64_t until) {
+  // Traces and profiles are only recorded by the interpreter loop
+  if (observed(cpu)) {
+    interpret(cpu, until, 1);
+    return;
+  }
+
+  if (cpu->engine == THREADED) {
+    mos6502_runthreaded(cpu, until);
+    return;
+  }
+
+  // Falls back to the interpreter loop below when there's no JIT
+  if (cpu->engine == JIT && mos6502_jitinit(cpu)) {
+    mos6502_runjit(cpu, until);
+    return;
+  }
+
+  interpret(cpu, until, 0);
+}
+
+// The engine runs uninterrupted up to the next event. Raising an interrupt
+// or scheduling an earlier event stops it at the next instruction
+// (HALTPENDING), so nothing is polled in between.
+uint64_t mos6502_run(MOS6502 *cpu, uint64_t cycles) {
+  uint64_t start = cpu->cycles;
+  uint64_t deadline = cycles > UINT64_MAX - start ? UINT64_MAX : start + cycles;
+
+  cpu->halt = HALTNONE;
+
+  do {
+    uint64_t until = service(cpu, deadline);
+    if (!cpu->halt)
+      runengine(cpu, until);
+  } while (cpu->halt == HALTPENDING ||
+           (!cpu->halt && cpu->cycles < deadline));
+
+  if (cpu->scheduler)
+    cpu->scheduler->until = UINT64_MAX;
+
+  return cpu->cycles - start;
 }
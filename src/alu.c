@@ -0,0 +1,141 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "6502.h"
+#include "alu.h"
+#include "instructions.h"
+
+uint32_t aluadc[ALUENTRIES];
+uint32_t alusbc[ALUENTRIES];
+
+static pthread_once_t aluonce = PTHREAD_ONCE_INIT;
+
+static uint32_t aluentry(uint16_t nz, uint8_t result, uint8_t c, uint8_t v) {
+  return nz | result << 16 | (uint32_t)(c != 0) << 24 |
+         (uint32_t)(v & 0x80) << 24;
+}
+
+// Z and N that don't come from the same byte, like setps does
+static uint16_t splitnz(uint8_t z, uint8_t n) {
+  return (z == 0) | (n & 0x80) << 8;
+}
+
+// Tables ------------------------------------------
+static uint32_t binaryadc(uint8_t A, uint8_t M, uint8_t carry) {
+  uint16_t sum = A + M + carry;
+
+  return aluentry((uint8_t)sum, sum, sum >> 8, ~(A ^ M) & (A ^ sum));
+}
+
+static uint32_t binarysbc(uint8_t A, uint8_t M, uint8_t carry) {
+  return binaryadc(A, ~M, carry);
+}
+
+// Digit by digit, with the carry between them
+static uint32_t decimaladc(uint8_t A, uint8_t M, uint8_t carry) {
+  uint8_t lo = (A & 0x0F) + (M & 0x0F) + carry;
+  uint8_t hi = (A >> 4) + (M >> 4);
+
+  if (lo > 9) {
+    lo += 6;
+    hi++;
+  }
+
+  // N and V see the high digit before its adjustment
+  uint8_t unadjusted = hi << 4;
+  uint8_t z = (uint8_t)(A + M + carry) == 0;
+  uint8_t v = ~(A ^ M) & (A ^ unadjusted);
+
+  if (hi > 9)
+    hi += 6;
+
+  return aluentry(splitnz(z, unadjusted), hi << 4 | (lo & 0x0F), hi > 15, v);
+}
+
+static uint32_t decimalsbc(uint8_t A, uint8_t M, uint8_t carry) {
+  uint8_t borrow = !carry;
+  uint8_t lo = (A & 0x0F) - (M & 0x0F) - borrow;
+  uint8_t hi = (A >> 4) - (M >> 4);
+
+  if (lo & 0x10) {
+    lo -= 6;
+    hi--;
+  }
+  if (hi & 0x10)
+    hi -= 6;
+
+  // Every flag from the binary difference
+  uint8_t result = hi << 4 | (lo & 0x0F);
+  return (binarysbc(A, M, carry) & ~0x00FF0000) | (uint32_t)result << 16;
+}
+
+static void build(void) {
+  for (uint32_t i = 0; i < ALUENTRIES; i++) {
+    uint8_t decimal = (i & ALUDECIMAL) != 0, carry = (i & ALUCARRY) != 0;
+    uint8_t A = i >> 8, M = i;
+
+    aluadc[i] = decimal ? decimaladc(A, M, carry) : binaryadc(A, M, carry);
+    alusbc[i] = decimal ? decimalsbc(A, M, carry) : binarysbc(A, M, carry);
+  }
+}
+
+void mos6502_aluinit(void) { pthread_once(&aluonce, build); }
+
+// Self-check --------------------------------------
+uint64_t mos6502_alucheck(MOS6502AluMismatch *first) {
+  // ADC, SBC, CMP, CPX and CPY #
+  static const uint8_t checked[ALUCHECKED] = {0x69, 0xE9, 0xC9, 0xE0, 0xC0};
+  MOS6502 cpu;
+  uint64_t failed = 0;
+
+  mos6502_aluinit();
+  memset(&cpu, 0, sizeof(cpu));
+
+  for (int i = 0; i < ALUCHECKED; i++) {
+    for (uint32_t index = 0; index < ALUENTRIES; index++) {
+      uint8_t decimal = (index & ALUDECIMAL) != 0;
+      uint8_t carry = (index & ALUCARRY) != 0;
+      uint8_t A = index >> 8, M = index;
+      uint8_t P = 0x20 | decimal << 3 | carry;
+      MOS6502AluExpected e;
+
+      cpu.A = cpu.X = cpu.Y = A;
+      mos6502_setps(&cpu, P);
+
+      switch (checked[i]) {
+        case 0x69:
+          adc(&cpu, M);
+          e = aluexpectedadc(A, M, carry, decimal);
+          break;
+        case 0xE9:
+          sbc(&cpu, M);
+          e = aluexpectedsbc(A, M, carry, decimal);
+          break;
+        case 0xC9:
+          cmp(&cpu, M);
+          e = aluexpectedcmp(A, M);
+          break;
+        case 0xE0:
+          cpx(&cpu, M);
+          e = aluexpectedcmp(A, M);
+          break;
+        default:
+          cpy(&cpu, M);
+          e = aluexpectedcmp(A, M);
+      }
+
+      // V is untouched by the compares, it stays clear
+      uint8_t flags = mos6502_getps(&cpu) & 0xC3;
+      if (cpu.A == e.result && flags == e.flags)
+        continue;
+
+      if (!failed++ && first) {
+        MOS6502AluMismatch mismatch = {checked[i], A, M, P, cpu.A,
+                                       e.result, flags, e.flags};
+        *first = mismatch;
+      }
+    }
+  }
+
+  return failed;
+}
@@ -0,0 +1,783 @@
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "6502.h"
+#include "assembler.h"
+
+// What an operand looks like, before an addressing mode is picked
+typedef enum operand_kinds {
+  OPNONE = 0,
+  OPACC,  // A
+  OPIMM,  // #expr
+  OPADDR, // expr
+  OPADDRX,
+  OPADDRY,
+  OPIND,  // (expr)
+  OPINDX, // (expr,X)
+  OPINDY  // (expr),Y
+} MOS6502OperandKind;
+
+typedef struct symbol {
+  char name[ASMMAXSYMBOL];
+  int32_t value;
+  uint32_t pass; // Defined in this pass
+} MOS6502Symbol;
+
+typedef struct assembler {
+  const char *at, *end;
+  uint32_t line;
+
+  MOS6502Symbol *symbols;
+  uint32_t nsymbols, maxsymbols;
+
+  uint32_t pass;
+  uint8_t final;   // Emitting, everything must be known
+  uint8_t changed; // A symbol moved this pass
+  uint8_t unknown; // The last expression used an undefined symbol
+  uint8_t failed;
+
+  uint16_t pc;
+  uint16_t here; // Address of the statement, * in expressions
+  int32_t top;
+  asmemitfunc emit;
+  void *context;
+  MOS6502AsmError *error;
+} MOS6502Assembler;
+
+static void fail(MOS6502Assembler *as, const char *format, ...) {
+  if (as->failed)
+    return;
+
+  as->failed = 1;
+  if (!as->error)
+    return;
+
+  va_list args;
+  va_start(args, format);
+  as->error->line = as->line;
+  vsnprintf(as->error->message, sizeof(as->error->message), format, args);
+  va_end(args);
+}
+
+// Symbols ------------------------------------------
+static MOS6502Symbol *findsymbol(MOS6502Assembler *as, const char *name) {
+  for (uint32_t i = 0; i < as->nsymbols; i++)
+    if (!strcmp(as->symbols[i].name, name))
+      return &as->symbols[i];
+
+  return NULL;
+}
+
+static void define(MOS6502Assembler *as, const char *name, int32_t value) {
+  MOS6502Symbol *symbol = findsymbol(as, name);
+
+  if (!symbol) {
+    if (as->nsymbols == as->maxsymbols) {
+      uint32_t max = as->maxsymbols ? 2 * as->maxsymbols : 64;
+      MOS6502Symbol *symbols =
+          realloc(as->symbols, max * sizeof(MOS6502Symbol));
+      if (!symbols) {
+        fail(as, "out of memory");
+        return;
+      }
+
+      as->symbols = symbols;
+      as->maxsymbols = max;
+    }
+
+    symbol = &as->symbols[as->nsymbols++];
+    snprintf(symbol->name, sizeof(symbol->name), "%s", name);
+    symbol->value = value;
+    symbol->pass = 0;
+    as->changed = 1;
+  }
+
+  if (symbol->pass == as->pass) {
+    fail(as, "'%s' redefined", name);
+    return;
+  }
+
+  if (symbol->value != value)
+    as->changed = 1;
+  symbol->value = value;
+  symbol->pass = as->pass;
+}
+
+// Lexing -------------------------------------------
+static void skipspaces(MOS6502Assembler *as) {
+  while (as->at < as->end && (*as->at == ' ' || *as->at == '\t'))
+    as->at++;
+}
+
+static uint8_t ateol(MOS6502Assembler *as) {
+  skipspaces(as);
+  return as->at >= as->end || *as->at == '\n' || *as->at == '\r' ||
+         *as->at == ';';
+}
+
+static uint8_t accept(MOS6502Assembler *as, char c) {
+  skipspaces(as);
+  if (as->at < as->end && *as->at == c) {
+    as->at++;
+    return 1;
+  }
+
+  return 0;
+}
+
+static uint8_t isidentstart(char c) {
+  return isalpha((unsigned char)c) || c == '_' || c == '.';
+}
+
+static uint8_t isident(char c) {
+  return isalnum((unsigned char)c) || c == '_' || c == '.';
+}
+
+// Copies an identifier into name, returns its length, 0 for none
+static size_t identifier(MOS6502Assembler *as, char *name) {
+  const char *start = as->at;
+
+  if (as->at >= as->end || !isidentstart(*as->at))
+    return 0;
+  while (as->at < as->end && isident(*as->at))
+    as->at++;
+
+  size_t length = as->at - start;
+  if (length >= ASMMAXSYMBOL) {
+    fail(as, "name too long");
+    length = ASMMAXSYMBOL - 1;
+  }
+
+  memcpy(name, start, length);
+  name[length] = '\0';
+  return length;
+}
+
+// A register name by itself, "X" in "lda $10, X" but not in "stx X + 1"
+static uint8_t acceptregister(MOS6502Assembler *as, char reg) {
+  const char *start = as->at;
+
+  skipspaces(as);
+  if (as->at < as->end && toupper((unsigned char)*as->at) == reg &&
+      (as->at + 1 >= as->end || !isident(as->at[1]))) {
+    as->at++;
+    return 1;
+  }
+
+  as->at = start;
+  return 0;
+}
+
+// Expressions --------------------------------------
+static int32_t expression(MOS6502Assembler *as);
+
+// Nothing on a 6502 needs more than 16 bits
+#define ASMMAXVALUE 0xFFFF
+
+static int32_t number(MOS6502Assembler *as, int base) {
+  const char *start = as->at;
+  uint32_t value = 0;
+
+  while (as->at < as->end) {
+    int digit = tolower((unsigned char)*as->at);
+
+    if (isdigit(digit))
+      digit -= '0';
+    else if (digit >= 'a' && digit <= 'f')
+      digit -= 'a' - 10;
+    else
+      break;
+
+    if (digit >= base)
+      break;
+    if (value <= ASMMAXVALUE)
+      value = value * base + digit;
+    as->at++;
+  }
+
+  if (as->at == start || (as->at < as->end && isident(*as->at)))
+    fail(as, "bad number");
+  else if (value > ASMMAXVALUE)
+    fail(as, "number too large");
+  return value > ASMMAXVALUE ? 0 : value;
+}
+
+static int32_t primary(MOS6502Assembler *as) {
+  char name[ASMMAXSYMBOL];
+
+  skipspaces(as);
+  if (as->at >= as->end) {
+    fail(as, "expression expected");
+    return 0;
+  }
+
+  char c = *as->at;
+
+  if (c == '(') {
+    as->at++;
+    int32_t value = expression(as);
+    if (!accept(as, ')'))
+      fail(as, "')' expected");
+    return value;
+  }
+
+  if (c == '$') {
+    as->at++;
+    return number(as, 16);
+  }
+
+  if (c == '%') {
+    as->at++;
+    return number(as, 2);
+  }
+
+  if (c == '0' && as->at + 1 < as->end &&
+      tolower((unsigned char)as->at[1]) == 'x') {
+    as->at += 2;
+    return number(as, 16);
+  }
+
+  if (isdigit((unsigned char)c))
+    return number(as, 10);
+
+  if (c == '\'') {
+    if (as->end - as->at < 3 || as->at[2] != '\'') {
+      fail(as, "bad character");
+      return 0;
+    }
+
+    as->at += 3;
+    return (uint8_t)as->at[-2];
+  }
+
+  if (c == '*') {
+    as->at++;
+    return as->here;
+  }
+
+  if (identifier(as, name)) {
+    MOS6502Symbol *symbol = findsymbol(as, name);
+
+    // Forward references are known from the previous pass
+    if (symbol)
+      return symbol->value;
+
+    if (as->final)
+      fail(as, "undefined symbol '%s'", name);
+    as->unknown = 1;
+    return 0;
+  }
+
+  fail(as, "expression expected");
+  return 0;
+}
+
+static int32_t unary(MOS6502Assembler *as) {
+  skipspaces(as);
+
+  if (accept(as, '-'))
+    return -unary(as);
+  if (accept(as, '+'))
+    return unary(as);
+  if (accept(as, '~'))
+    return ~unary(as);
+  if (accept(as, '<'))
+    return unary(as) & 0xFF;
+  if (accept(as, '>'))
+    return (unary(as) >> 8) & 0xFF;
+
+  return primary(as);
+}
+
+// Binary operators from the loosest, each level calls the next
+static const char *binaryops[][4] = {
+    {"|"}, {"^"}, {"&"}, {"<<", ">>"}, {"+", "-"}, {"*", "/", "%"}};
+
+#define BINARYLEVELS (sizeof(binaryops) / sizeof(binaryops[0]))
+
+static const char *binaryop(MOS6502Assembler *as, uint32_t level) {
+  skipspaces(as);
+
+  for (uint32_t i = 0; i < 4 && binaryops[level][i]; i++) {
+    const char *op = binaryops[level][i];
+    size_t length = strlen(op);
+
+    if (as->end - as->at >= length && !memcmp(as->at, op, length)) {
+      as->at += length;
+      return op;
+    }
+  }
+
+  return NULL;
+}
+
+static int32_t binary(MOS6502Assembler *as, uint32_t level) {
+  if (level == BINARYLEVELS)
+    return unary(as);
+
+  int64_t value = binary(as, level + 1);
+  const char *op;
+
+  while (!as->failed && (op = binaryop(as, level))) {
+    int64_t right = binary(as, level + 1);
+
+    // '<' and '>' are only shifts here
+    switch (op[0]) {
+      case '|':
+        value |= right;
+        break;
+      case '^':
+        value ^= right;
+        break;
+      case '&':
+        value &= right;
+        break;
+      case '<':
+        value *= (int64_t)1 << (right & 31);
+        break;
+      case '>':
+        value >>= right & 31;
+        break;
+      case '+':
+        value += right;
+        break;
+      case '-':
+        value -= right;
+        break;
+      case '*':
+        value *= right;
+        break;
+      case '/':
+      case '%':
+        if (!right) {
+          // Unknown symbols are 0 until the last pass
+          if (as->final)
+            fail(as, "division by zero");
+          value = 0;
+        } else {
+          value = op[0] == '/' ? value / right : value % right;
+        }
+        break;
+    }
+
+    // Both sides are in range, so one operator can't overflow 64 bits
+    if (value > ASMMAXVALUE || value < -ASMMAXVALUE - 1) {
+      fail(as, "number too large");
+      value = 0;
+    }
+  }
+
+  return value;
+}
+
+static int32_t expression(MOS6502Assembler *as) {
+  return binary(as, 0);
+}
+
+// Output -------------------------------------------
+static void emitbyte(MOS6502Assembler *as, int32_t value) {
+  if (as->final && !as->failed)
+    as->emit(as->context, as->pc, value & 0xFF);
+
+  if (as->pc + 1 > as->top)
+    as->top = as->pc + 1;
+  as->pc++;
+}
+
+static void checkbyte(MOS6502Assembler *as, int32_t value) {
+  if (as->final && (value < -128 || value > 255))
+    fail(as, "value %d out of range", value);
+}
+
+// Instructions -------------------------------------
+static int16_t findopcode(const char *mnemonic, MOS6502AddressingModes mode) {
+  for (int i = 0; i < MAXOPCODESTABLE; i++)
+    if (opcodes[i].mode == mode && !strcasecmp(opcodes[i].mnemonic, mnemonic))
+      return i;
+
+  return -1;
+}
+
+static uint8_t hasmnemonic(const char *mnemonic) {
+  for (int i = 0; i < MAXOPCODESTABLE; i++)
+    if (opcodes[i].mode != ILL && !strcasecmp(opcodes[i].mnemonic, mnemonic))
+      return 1;
+
+  return 0;
+}
+
+static MOS6502OperandKind operand(MOS6502Assembler *as, const char *mnemonic,
+                                  int32_t *value) {
+  if (ateol(as))
+    return OPNONE;
+
+  if (accept(as, '#')) {
+    *value = expression(as);
+    return OPIMM;
+  }
+
+  const char *start = as->at;
+  if (acceptregister(as, 'A') && ateol(as) && findopcode(mnemonic, ACC) >= 0)
+    return OPACC;
+  as->at = start;
+
+  // A parenthesis is only indirection for instructions that have it,
+  // "lda (2 + 3) * 4" is an expression
+  if (*as->at == '(' && (findopcode(mnemonic, IND) >= 0 ||
+                         findopcode(mnemonic, IDEIND) >= 0 ||
+                         findopcode(mnemonic, INDIDE) >= 0)) {
+    as->at++;
+    *value = expression(as);
+
+    if (accept(as, ',')) {
+      if (!acceptregister(as, 'X') || !accept(as, ')'))
+        fail(as, "',X)' expected");
+      return OPINDX;
+    }
+
+    if (!accept(as, ')'))
+      fail(as, "')' expected");
+    if (!accept(as, ','))
+      return OPIND;
+    if (!acceptregister(as, 'Y'))
+      fail(as, "',Y' expected");
+    return OPINDY;
+  }
+
+  *value = expression(as);
+  if (!accept(as, ','))
+    return OPADDR;
+  if (acceptregister(as, 'X'))
+    return OPADDRX;
+  if (acceptregister(as, 'Y'))
+    return OPADDRY;
+
+  fail(as, "'X' or 'Y' expected");
+  return OPADDR;
+}
+
+// Zero page when the address is known and fits, or there's nothing else
+static int16_t pickaddress(MOS6502Assembler *as, const char *mnemonic,
+                           MOS6502AddressingModes zp,
+                           MOS6502AddressingModes abs, int32_t value) {
+  int16_t zpopcode = findopcode(mnemonic, zp);
+  int16_t absopcode = findopcode(mnemonic, abs);
+
+  if (zpopcode >= 0 && !as->unknown && value >= 0 && value < 0x100)
+    return zpopcode;
+  if (absopcode >= 0)
+    return absopcode;
+  return zpopcode;
+}
+
+static void instruction(MOS6502Assembler *as, const char *mnemonic) {
+  int32_t value = 0;
+
+  as->unknown = 0;
+  MOS6502OperandKind kind = operand(as, mnemonic, &value);
+  int16_t opcode = -1;
+
+  switch (kind) {
+    case OPNONE:
+      opcode = findopcode(mnemonic, IMP);
+      if (opcode < 0)
+        opcode = findopcode(mnemonic, ACC);
+      break;
+    case OPACC:
+      opcode = findopcode(mnemonic, ACC);
+      break;
+    case OPIMM:
+      opcode = findopcode(mnemonic, IMM);
+      break;
+    case OPADDR:
+      opcode = findopcode(mnemonic, RELT);
+      if (opcode < 0)
+        opcode = pickaddress(as, mnemonic, ZP0, ABS, value);
+      break;
+    case OPADDRX:
+      opcode = pickaddress(as, mnemonic, ZP0X, ABSX, value);
+      break;
+    case OPADDRY:
+      opcode = pickaddress(as, mnemonic, ZP0Y, ABSY, value);
+      break;
+    case OPIND:
+      opcode = findopcode(mnemonic, IND);
+      break;
+    case OPINDX:
+      opcode = findopcode(mnemonic, IDEIND);
+      break;
+    case OPINDY:
+      opcode = findopcode(mnemonic, INDIDE);
+      break;
+  }
+
+  if (as->failed)
+    return;
+  if (opcode < 0) {
+    fail(as, "bad addressing mode for %s", mnemonic);
+    return;
+  }
+
+  uint16_t pc = as->pc;
+  emitbyte(as, opcode);
+
+  switch (opcodes[opcode].mode) {
+    case RELT:
+      value -= pc + 2;
+      if (as->final && (value < -128 || value > 127))
+        fail(as, "branch out of range (%d)", value);
+      emitbyte(as, value);
+      break;
+    case IMM:
+    case ZP0:
+    case ZP0X:
+    case ZP0Y:
+    case IDEIND:
+    case INDIDE:
+      checkbyte(as, value);
+      emitbyte(as, value);
+      break;
+    case ABS:
+    case ABSX:
+    case ABSY:
+    case IND:
+      if (as->final && (value < -0x8000 || value > 0xFFFF))
+        fail(as, "address %d out of range", value);
+      emitbyte(as, value);
+      emitbyte(as, value >> 8);
+      break;
+    default:
+      break;
+  }
+}
+
+// Directives ---------------------------------------
+static void data(MOS6502Assembler *as, uint8_t word) {
+  do {
+    skipspaces(as);
+
+    if (!word && as->at < as->end && *as->at == '"') {
+      for (as->at++; as->at < as->end && *as->at != '"'; as->at++) {
+        if (*as->at == '\n') {
+          fail(as, "unterminated string");
+          return;
+        }
+        emitbyte(as, *as->at);
+      }
+
+      if (!accept(as, '"'))
+        fail(as, "unterminated string");
+      continue;
+    }
+
+    as->unknown = 0;
+    int32_t value = expression(as);
+
+    if (word) {
+      emitbyte(as, value);
+      emitbyte(as, value >> 8);
+    } else {
+      checkbyte(as, value);
+      emitbyte(as, value);
+    }
+  } while (!as->failed && accept(as, ','));
+}
+
+static void equate(MOS6502Assembler *as) {
+  char name[ASMMAXSYMBOL];
+
+  skipspaces(as);
+
+  // The samples use ".equ $00, 00" as a note, a number names nothing
+  uint8_t named = identifier(as, name) > 0;
+  if (!named)
+    expression(as);
+
+  if (!accept(as, ',')) {
+    fail(as, "',' expected");
+    return;
+  }
+
+  int32_t value = expression(as);
+  if (named && !as->failed)
+    define(as, name, value);
+}
+
+static uint8_t directive(MOS6502Assembler *as, const char *word) {
+  const char *name = word[0] == '.' ? word + 1 : word;
+
+  if (!strcasecmp(name, "equ") || !strcasecmp(name, "set")) {
+    equate(as);
+  } else if (!strcasecmp(name, "org")) {
+    as->unknown = 0;
+    int32_t value = expression(as);
+    if (as->final && as->unknown)
+      fail(as, "undefined .org");
+    as->pc = value;
+  } else if (!strcasecmp(name, "byte") || !strcasecmp(name, "db")) {
+    data(as, 0);
+  } else if (!strcasecmp(name, "word") || !strcasecmp(name, "dw")) {
+    data(as, 1);
+  } else {
+    return 0;
+  }
+
+  return 1;
+}
+
+// Passes -------------------------------------------
+static void statement(MOS6502Assembler *as) {
+  char word[ASMMAXSYMBOL];
+
+  as->here = as->pc;
+  if (ateol(as))
+    return;
+
+  if (!identifier(as, word)) {
+    fail(as, "syntax error");
+    return;
+  }
+
+  // Label, then maybe a statement on the same line
+  if (accept(as, ':')) {
+    define(as, word, as->pc);
+    skipspaces(as);
+    if (ateol(as) || !identifier(as, word))
+      return;
+  }
+
+  skipspaces(as);
+  if (as->at < as->end && *as->at == '=') {
+    as->at++;
+    int32_t value = expression(as);
+    if (!as->failed)
+      define(as, word, value);
+    return;
+  }
+
+  if (directive(as, word))
+    return;
+
+  if (!hasmnemonic(word)) {
+    fail(as, "unknown instruction '%s'", word);
+    return;
+  }
+
+  instruction(as, word);
+}
+
+static void pass(MOS6502Assembler *as, const char *source, size_t size) {
+  as->at = source;
+  as->end = source + size;
+  as->line = 0;
+  as->pc = 0;
+  as->top = 0;
+  as->changed = 0;
+
+  while (as->at < as->end && !as->failed) {
+    as->line++;
+    statement(as);
+
+    if (!as->failed && !ateol(as))
+      fail(as, "junk after statement");
+
+    while (as->at < as->end && *as->at != '\n')
+      as->at++;
+    if (as->at < as->end)
+      as->at++;
+  }
+}
+
+int32_t mos6502_assemblewith(const char *source, size_t size,
+                             asmemitfunc emit, void *context,
+                             MOS6502AsmError *error) {
+  MOS6502Assembler as = {0};
+
+  as.emit = emit;
+  as.context = context;
+  as.error = error;
+  if (error) {
+    error->line = 0;
+    error->message[0] = '\0';
+  }
+
+  // Sizes depend on values that depend on sizes, repeat until nothing moves
+  for (as.pass = 1; !as.failed; as.pass++) {
+    pass(&as, source, size);
+
+    if (!as.changed)
+      break;
+
+    if (as.pass == ASMMAXPASSES) {
+      as.line = 0;
+      fail(&as, "addresses don't settle after %d passes", ASMMAXPASSES);
+    }
+  }
+
+  if (!as.failed) {
+    as.pass++;
+    as.final = 1;
+    pass(&as, source, size);
+  }
+
+  free(as.symbols);
+  return as.failed ? -1 : as.top;
+}
+
+// Buffers ------------------------------------------
+typedef struct asmbuffer {
+  uint8_t *out;
+  uint32_t max;
+  uint8_t overflow;
+} MOS6502AsmBuffer;
+
+static void bufferemit(void *context, uint16_t addr, uint8_t data) {
+  MOS6502AsmBuffer *buffer = context;
+
+  if (addr < buffer->max)
+    buffer->out[addr] = data;
+  else
+    buffer->overflow = 1;
+}
+
+int32_t mos6502_assemblebuffer(const char *source, size_t size, uint8_t *out,
+                               uint32_t max, MOS6502AsmError *error) {
+  MOS6502AsmBuffer buffer = {out, max, 0};
+  int32_t top = mos6502_assemblewith(source, size, bufferemit, &buffer, error);
+
+  if (top >= 0 && buffer.overflow) {
+    if (error) {
+      error->line = 0;
+      snprintf(error->message, sizeof(error->message),
+               "%d bytes don't fit in %u", top, max);
+    }
+    return -1;
+  }
+
+  return top;
+}
+
+typedef struct asmcpu {
+  MOS6502 *cpu;
+  uint16_t base;
+} MOS6502AsmCpu;
+
+static void cpuemit(void *context, uint16_t addr, uint8_t data) {
+  MOS6502AsmCpu *target = context;
+
+  mos6502_write(target->cpu, target->base + addr, data);
+}
+
+int32_t mos6502_assembleinto(MOS6502 *cpu, uint16_t base, const char *source,
+                             size_t size, MOS6502AsmError *error) {
+  MOS6502AsmCpu target = {cpu, base};
+  int32_t top = mos6502_assemblewith(source, size, cpuemit, &target, error);
+
+  if (top >= 0)
+    mos6502_reset(cpu);
+  return top;
+}
@@ -0,0 +1,480 @@
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "6502.h"
+#include "batch.h"
+#include "debug.h"
+#include "loader.h"
+#include "lockstep.h"
+
+#define NOP 0xEA
+#define BRK 0x00
+#define MAXLINE 1024
+
+static const char *haltstr[] = {"budget", "illegal", "opcode", "break",
+                                "external", "idle", "pending", "replay"};
+
+typedef struct patch {
+  uint16_t addr;
+  uint8_t value;
+} MOS6502Patch;
+
+typedef struct image {
+  char *path;
+  MOS6502Program *program;
+} MOS6502Image;
+
+typedef struct job {
+  size_t image;
+  uint64_t budget;
+  MOS6502Patch patches[BATCHMAXPATCHES];
+  uint8_t npatches;
+
+  // Final state
+  uint8_t loaded;
+  uint8_t halt;
+  uint16_t PC;
+  uint8_t A, X, Y, SP, ps;
+  uint64_t cycles;
+  uint64_t instructions;
+} MOS6502Job;
+
+// Jobs run by one worker in one go, a single job unless running lockstep
+typedef struct unit {
+  size_t first;
+  size_t count;
+} MOS6502Unit;
+
+// Units [head, tail) owned by a worker. The owner takes from the head,
+// thieves take the upper half from the tail.
+typedef struct queue {
+  pthread_mutex_t lock;
+  size_t head, tail;
+} MOS6502Queue;
+
+typedef struct batch {
+  MOS6502Image *images;
+  size_t nimages;
+  MOS6502Job *jobs;
+  size_t njobs;
+  MOS6502Unit *units;
+  size_t nunits;
+  size_t lanes;
+
+  MOS6502Queue *queues;
+  int nqueues;
+  MOS6502Engine engine;
+} MOS6502Batch;
+
+typedef struct worker {
+  MOS6502Batch *batch;
+  int id;
+  pthread_t thread;
+} MOS6502Worker;
+
+// Manifest ----------------------------------------
+// Index of the image at path, loaded on first use
+static long findimage(MOS6502Batch *batch, const char *path) {
+  for (size_t i = 0; i < batch->nimages; i++)
+    if (!strcmp(batch->images[i].path, path))
+      return i;
+
+  MOS6502Image image = {0};
+  image.program = mos6502_programopen(path);
+  if (!image.program)
+    return -1;
+
+  MOS6502Image *images =
+      realloc(batch->images, (batch->nimages + 1) * sizeof(MOS6502Image));
+  if (!images) {
+    mos6502_programclose(image.program);
+    return -1;
+  }
+
+  image.path = strdup(path);
+  batch->images = images;
+  if (!image.path) {
+    mos6502_programclose(image.program);
+    return -1;
+  }
+
+  batch->images[batch->nimages] = image;
+  return batch->nimages++;
+}
+
+// Returns 0 unless string is a number no larger than max followed by stop
+static int parsenumber(const char *string, char stop, unsigned long max,
+                       unsigned long *value) {
+  char *end;
+
+  *value = strtoul(string, &end, 0);
+  return end != string && *end == stop && *string != '-' && *value <= max;
+}
+
+static int parsejob(MOS6502Batch *batch, char *line, MOS6502Job *job) {
+  char *save = NULL;
+  char *path = strtok_r(line, " \t\r\n", &save);
+  char *budget = strtok_r(NULL, " \t\r\n", &save);
+
+  if (!budget)
+    return 0;
+
+  long image = findimage(batch, path);
+  if (image < 0) {
+    printfc(RED, "Error: can't read image '%s'!\n", path);
+    return 0;
+  }
+
+  memset(job, 0, sizeof(MOS6502Job));
+  job->image = image;
+  job->budget = strtoull(budget, NULL, 0);
+
+  char *token;
+  while ((token = strtok_r(NULL, " \t\r\n", &save))) {
+    char *value = strchr(token, '=');
+    unsigned long addr, byte;
+
+    // An address in the 64 KB the image is mapped into, and a byte
+    if (!value || job->npatches == BATCHMAXPATCHES ||
+        !parsenumber(token, '=', 0xFFFF, &addr) ||
+        !parsenumber(value + 1, '\0', 0xFF, &byte)) {
+      printfc(RED, "Error: bad patch '%s' for '%s'!\n", token, path);
+      return 0;
+    }
+
+    job->patches[job->npatches].addr = addr;
+    job->patches[job->npatches].value = byte;
+    job->npatches++;
+  }
+
+  return 1;
+}
+
+static int parsemanifest(MOS6502Batch *batch, const char *path) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    printfc(RED, "Error: can't open manifest '%s'!\n", path);
+    return 0;
+  }
+
+  char line[MAXLINE];
+  size_t capacity = 0;
+
+  for (int n = 1; fgets(line, sizeof(line), file); n++) {
+    char *comment = strchr(line, '#');
+    if (comment)
+      *comment = '\0';
+
+    if (strspn(line, " \t\r\n") == strlen(line))
+      continue;
+
+    if (batch->njobs == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      MOS6502Job *jobs = realloc(batch->jobs, capacity * sizeof(MOS6502Job));
+      if (!jobs) {
+        printfc(RED, "Error: out of memory!\n");
+        fclose(file);
+        return 0;
+      }
+      batch->jobs = jobs;
+    }
+
+    if (!parsejob(batch, line, &batch->jobs[batch->njobs])) {
+      printfc(RED, "Error: manifest line %d is invalid!\n", n);
+      fclose(file);
+      return 0;
+    }
+
+    batch->njobs++;
+  }
+
+  fclose(file);
+  return 1;
+}
+
+// Workers -----------------------------------------
+static void runjob(MOS6502Batch *batch, MOS6502Job *job) {
+  MOS6502Image *image = &batch->images[job->image];
+  MOS6502 *cpu = mos6502_init(batch->engine);
+  if (!cpu)
+    return;
+
+  // Every instance shares the image until it writes to one of its pages
+  if (!mos6502_programmap(cpu, image->program)) {
+    mos6502_uninit(cpu);
+    return;
+  }
+
+  for (uint8_t i = 0; i < job->npatches; i++)
+    mos6502_write(cpu, job->patches[i].addr, job->patches[i].value);
+
+  mos6502_sethaltop(cpu, NOP);
+  mos6502_sethaltop(cpu, BRK);
+  mos6502_run(cpu, job->budget);
+
+  job->loaded = 1;
+  job->halt = cpu->halt;
+  job->PC = cpu->PC;
+  job->A = cpu->A;
+  job->X = cpu->X;
+  job->Y = cpu->Y;
+  job->SP = cpu->SP;
+  job->ps = mos6502_getps(cpu);
+  job->cycles = cpu->cycles;
+  job->instructions = cpu->instructions;
+
+  mos6502_uninit(cpu);
+}
+
+// Consecutive jobs with the same image and budget share a lockstep group
+static void runlockstep(MOS6502Batch *batch, MOS6502Unit *unit) {
+  MOS6502Job *jobs = &batch->jobs[unit->first];
+  MOS6502Image *image = &batch->images[jobs->image];
+  MOS6502Lockstep *ls = mos6502_lockstepinit(unit->count);
+  if (!ls)
+    return;
+
+  const MOS6502Program *program = image->program;
+  for (size_t i = 0; i < program->nsegments; i++) {
+    const MOS6502Segment *segment = &program->segments[i];
+
+    if (mos6502_lockstepload(ls, segment->addr, segment->bytes,
+                             segment->size) != segment->size) {
+      mos6502_lockstepuninit(ls);
+      return;
+    }
+  }
+  mos6502_lockstepreset(ls);
+
+  for (size_t lane = 0; lane < unit->count; lane++)
+    for (uint8_t i = 0; i < jobs[lane].npatches; i++)
+      mos6502_lockstepwrite(ls, lane, jobs[lane].patches[i].addr,
+                            jobs[lane].patches[i].value);
+
+  mos6502_lockstepsethaltop(ls, NOP);
+  mos6502_lockstepsethaltop(ls, BRK);
+  mos6502_locksteprun(ls, jobs->budget);
+
+  for (size_t lane = 0; lane < unit->count; lane++) {
+    MOS6502Job *job = &jobs[lane];
+
+    job->loaded = 1;
+    job->halt = ls->halt[lane];
+    job->PC = ls->PC[lane];
+    job->A = ls->A[lane];
+    job->X = ls->X[lane];
+    job->Y = ls->Y[lane];
+    job->SP = ls->SP[lane];
+    job->ps = ls->P[lane];
+    job->cycles = ls->cycles[lane];
+    job->instructions = ls->instructions[lane];
+  }
+
+  mos6502_lockstepuninit(ls);
+}
+
+static void rununit(MOS6502Batch *batch, MOS6502Unit *unit) {
+  if (batch->lanes) {
+    runlockstep(batch, unit);
+    return;
+  }
+
+  for (size_t i = 0; i < unit->count; i++)
+    runjob(batch, &batch->jobs[unit->first + i]);
+}
+
+static int buildunits(MOS6502Batch *batch) {
+  batch->units = malloc((batch->njobs ? batch->njobs : 1) * sizeof(MOS6502Unit));
+  if (!batch->units)
+    return 0;
+
+  for (size_t i = 0; i < batch->njobs; i++) {
+    MOS6502Unit *last = batch->nunits ? &batch->units[batch->nunits - 1] : NULL;
+    MOS6502Job *first = last ? &batch->jobs[last->first] : NULL;
+
+    if (last && batch->lanes && last->count < batch->lanes &&
+        first->image == batch->jobs[i].image &&
+        first->budget == batch->jobs[i].budget) {
+      last->count++;
+      continue;
+    }
+
+    batch->units[batch->nunits].first = i;
+    batch->units[batch->nunits].count = 1;
+    batch->nunits++;
+  }
+
+  return 1;
+}
+
+static int takeunit(MOS6502Queue *queue, size_t *unit) {
+  int taken = 0;
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->head < queue->tail) {
+    *unit = queue->head++;
+    taken = 1;
+  }
+  pthread_mutex_unlock(&queue->lock);
+
+  return taken;
+}
+
+// Move the upper half of another worker's units into our (empty) queue
+static int stealjobs(MOS6502Batch *batch, int id) {
+  MOS6502Queue *own = &batch->queues[id];
+
+  for (int i = 1; i < batch->nqueues; i++) {
+    MOS6502Queue *victim = &batch->queues[(id + i) % batch->nqueues];
+    size_t head = 0, tail = 0;
+
+    pthread_mutex_lock(&victim->lock);
+    size_t left = victim->tail - victim->head;
+    if (left) {
+      tail = victim->tail;
+      head = tail - (left + 1) / 2;
+      victim->tail = head;
+    }
+    pthread_mutex_unlock(&victim->lock);
+
+    if (head == tail)
+      continue;
+
+    pthread_mutex_lock(&own->lock);
+    own->head = head;
+    own->tail = tail;
+    pthread_mutex_unlock(&own->lock);
+    return 1;
+  }
+
+  return 0;
+}
+
+static void *worker(void *arg) {
+  MOS6502Worker *self = arg;
+  MOS6502Batch *batch = self->batch;
+  size_t unit;
+
+  do {
+    while (takeunit(&batch->queues[self->id], &unit))
+      rununit(batch, &batch->units[unit]);
+  } while (stealjobs(batch, self->id));
+
+  return NULL;
+}
+
+// Returns 0 when out of memory
+static int runjobs(MOS6502Batch *batch, int threads) {
+  MOS6502Worker workers[threads];
+  uint8_t started[threads];
+  int missing = -1;
+
+  batch->nqueues = threads;
+  batch->queues = calloc(threads, sizeof(MOS6502Queue));
+  if (!batch->queues)
+    return 0;
+
+  // Contiguous shards to start with, stealing evens them out
+  for (int i = 0; i < threads; i++) {
+    pthread_mutex_init(&batch->queues[i].lock, NULL);
+    batch->queues[i].head = batch->nunits * i / threads;
+    batch->queues[i].tail = batch->nunits * (i + 1) / threads;
+  }
+
+  for (int i = 0; i < threads; i++) {
+    workers[i].batch = batch;
+    workers[i].id = i;
+    started[i] = !pthread_create(&workers[i].thread, NULL, worker, &workers[i]);
+    if (!started[i] && missing < 0)
+      missing = i;
+  }
+
+  // The shards of workers that didn't start are stolen by the ones that
+  // did, and by the caller, which is all there is when none started
+  if (missing >= 0)
+    worker(&workers[missing]);
+
+  for (int i = 0; i < threads; i++)
+    if (started[i])
+      pthread_join(workers[i].thread, NULL);
+
+  for (int i = 0; i < threads; i++)
+    pthread_mutex_destroy(&batch->queues[i].lock);
+  free(batch->queues);
+  return 1;
+}
+
+// Results -----------------------------------------
+static void writeresults(MOS6502Batch *batch, FILE *file) {
+  fprintf(file, "# job image stop pc a x y sp ps cycles instructions\n");
+
+  for (size_t i = 0; i < batch->njobs; i++) {
+    MOS6502Job *job = &batch->jobs[i];
+    const char *image = batch->images[job->image].path;
+
+    if (!job->loaded) {
+      fprintf(file, "%zu %s error\n", i, image);
+      continue;
+    }
+
+    fprintf(file,
+            "%zu %s %s 0x%04X 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X %" PRIu64
+            " %" PRIu64 "\n",
+            i, image, haltstr[job->halt], job->PC, job->A, job->X, job->Y,
+            job->SP, job->ps, job->cycles, job->instructions);
+  }
+}
+
+static void freebatch(MOS6502Batch *batch) {
+  for (size_t i = 0; i < batch->nimages; i++) {
+    free(batch->images[i].path);
+    mos6502_programclose(batch->images[i].program);
+  }
+
+  free(batch->images);
+  free(batch->jobs);
+  free(batch->units);
+}
+
+int mos6502_batch(const char *manifest, const char *results, int threads,
+                  MOS6502Engine engine, size_t lanes) {
+  MOS6502Batch batch = {0};
+  batch.engine = engine;
+  batch.lanes = lanes;
+
+  if (!parsemanifest(&batch, manifest) || !buildunits(&batch)) {
+    freebatch(&batch);
+    return -1;
+  }
+
+  FILE *file = results ? fopen(results, "w") : stdout;
+  if (!file) {
+    printfc(RED, "Error: can't open results '%s'!\n", results);
+    freebatch(&batch);
+    return -1;
+  }
+
+  if (threads < 1)
+    threads = 1;
+  if ((size_t)threads > batch.nunits)
+    threads = batch.nunits ? batch.nunits : 1;
+
+  if (!runjobs(&batch, threads)) {
+    printfc(RED, "Error: out of memory!\n");
+    if (file != stdout)
+      fclose(file);
+    freebatch(&batch);
+    return -1;
+  }
+  writeresults(&batch, file);
+
+  if (file != stdout)
+    fclose(file);
+
+  int njobs = batch.njobs;
+  freebatch(&batch);
+  return njobs;
+}
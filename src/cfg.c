@@ -0,0 +1,405 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "6502.h"
+#include "cfg.h"
+#include "engines.h"
+
+#define CFGBRK 0x00
+#define CFGJSR 0x20
+#define CFGRTI 0x40
+#define CFGJMP 0x4C
+#define CFGRTS 0x60
+
+typedef struct cfginstruction {
+  uint8_t opcode;
+  uint8_t length;
+  uint16_t operand;
+} MOS6502CfgInstruction;
+
+// Bytes come straight from the page table, I/O pages have none to read
+static uint8_t peek(MOS6502 *cpu, uint16_t addr, uint8_t *byte) {
+  const uint8_t *read = cpu->bus.pages[addr >> 8].read;
+  if (!read)
+    return 0;
+
+  *byte = read[addr & 0xFF];
+  return 1;
+}
+
+static uint8_t decode(MOS6502 *cpu, uint16_t pc,
+                      MOS6502CfgInstruction *instruction) {
+  uint8_t lo = 0, hi = 0;
+
+  if (!peek(cpu, pc, &instruction->opcode))
+    return 0;
+
+  instruction->length = instructionlength(opcodes[instruction->opcode].mode);
+  if ((instruction->length > 1 && !peek(cpu, pc + 1, &lo)) ||
+      (instruction->length > 2 && !peek(cpu, pc + 2, &hi)))
+    return 0;
+
+  instruction->operand = hi << 8 | lo;
+  return 1;
+}
+
+// How the instruction at pc leaves, CFGFALL when it goes on to the next
+static MOS6502CfgExit classify(const MOS6502CfgInstruction *instruction,
+                               uint16_t pc, uint16_t *target) {
+  MOS6502AddressingModes mode = opcodes[instruction->opcode].mode;
+
+  // Indirect modes halt the core, like illegal opcodes
+  if (mode == ILL || mode >= IND)
+    return CFGSTOP;
+
+  switch (instruction->opcode) {
+    case CFGBRK:
+      return CFGSTOP;
+    case CFGRTS:
+    case CFGRTI:
+      return CFGRETURN;
+    case CFGJMP:
+      *target = START | instruction->operand;
+      return CFGJUMP;
+    case CFGJSR:
+      *target = START | instruction->operand;
+      return CFGCALL;
+  }
+
+  if (mode == RELT) {
+    *target = pc + 2 + (int8_t)instruction->operand;
+    return CFGBRANCH;
+  }
+
+  return CFGFALL;
+}
+
+// Discovery ----------------------------------------
+typedef struct cfgwalk {
+  uint16_t *stack;
+  uint32_t depth;
+} MOS6502CfgWalk;
+
+static void addleader(MOS6502Cfg *cfg, MOS6502CfgWalk *walk, uint16_t pc,
+                      uint8_t flags) {
+  uint8_t seen = cfg->flags[pc] & CFGLEADER;
+
+  cfg->flags[pc] |= CFGLEADER | flags;
+  if (!seen)
+    walk->stack[walk->depth++] = pc;
+}
+
+// Decodes from pc until the path leaves, queueing where it goes
+static void follow(MOS6502 *cpu, MOS6502Cfg *cfg, MOS6502CfgWalk *walk,
+                   uint16_t pc) {
+  MOS6502CfgInstruction instruction;
+
+  for (;;) {
+    // Already decoded: falling into it makes it a block of its own
+    if (cfg->flags[pc] & CFGINSTRUCTION) {
+      cfg->flags[pc] |= CFGLEADER;
+      return;
+    }
+
+    if (!decode(cpu, pc, &instruction))
+      return;
+
+    if (cfg->flags[pc] & CFGOPERAND)
+      cfg->overlaps++;
+    cfg->flags[pc] |= CFGINSTRUCTION;
+    for (uint8_t i = 1; i < instruction.length; i++)
+      cfg->flags[(uint16_t)(pc + i)] |= CFGOPERAND;
+    cfg->instructions++;
+
+    uint16_t next = pc + instruction.length;
+    uint16_t target = 0;
+
+    switch (classify(&instruction, pc, &target)) {
+      case CFGFALL:
+        pc = next;
+        continue;
+      case CFGBRANCH:
+      case CFGCALL:
+        addleader(cfg, walk, next, 0);
+        addleader(cfg, walk, target, CFGTARGET);
+        return;
+      case CFGJUMP:
+        addleader(cfg, walk, target, CFGTARGET);
+        return;
+      default:
+        return;
+    }
+  }
+}
+
+// Blocks -------------------------------------------
+static MOS6502CfgBlock *newblock(MOS6502Cfg *cfg) {
+  if (cfg->nblocks == cfg->maxblocks) {
+    uint32_t max = cfg->maxblocks ? 2 * cfg->maxblocks : 256;
+    MOS6502CfgBlock *blocks =
+        realloc(cfg->blocks, max * sizeof(MOS6502CfgBlock));
+    if (!blocks)
+      return NULL;
+
+    cfg->blocks = blocks;
+    cfg->maxblocks = max;
+  }
+
+  return &cfg->blocks[cfg->nblocks++];
+}
+
+static uint8_t buildblock(MOS6502 *cpu, MOS6502Cfg *cfg, uint16_t start) {
+  MOS6502CfgBlock *block = newblock(cfg);
+  if (!block)
+    return 0;
+
+  MOS6502CfgInstruction instruction;
+  uint16_t pc = start;
+
+  memset(block, 0, sizeof(MOS6502CfgBlock));
+  block->start = start;
+
+  // Every instruction here was decoded by follow, so decode can't fail
+  while (block->size < RAM && decode(cpu, pc, &instruction)) {
+    uint16_t next = pc + instruction.length;
+    uint16_t target = 0;
+    MOS6502CfgExit exit = classify(&instruction, pc, &target);
+
+    block->size += instruction.length;
+    block->instructions++;
+    block->cycles += opcodes[instruction.opcode].cycles;
+    block->exit = exit;
+
+    switch (exit) {
+      case CFGBRANCH:
+      case CFGCALL:
+        block->succs[block->nsuccs++] = exit == CFGCALL ? target : next;
+        block->succs[block->nsuccs++] = exit == CFGCALL ? next : target;
+        return 1;
+      case CFGJUMP:
+        block->succs[block->nsuccs++] = target;
+        return 1;
+      case CFGRETURN:
+      case CFGSTOP:
+        return 1;
+      default:
+        break;
+    }
+
+    // Ran into bytes follow couldn't read
+    if (!(cfg->flags[next] & CFGINSTRUCTION)) {
+      block->exit = CFGSTOP;
+      return 1;
+    }
+
+    if (cfg->flags[next] & CFGLEADER) {
+      block->succs[block->nsuccs++] = next;
+      return 1;
+    }
+
+    pc = next;
+  }
+
+  block->exit = CFGSTOP;
+  return 1;
+}
+
+static uint8_t adddata(MOS6502Cfg *cfg, uint16_t start, uint32_t size) {
+  if (cfg->ndata == cfg->maxdata) {
+    uint32_t max = cfg->maxdata ? 2 * cfg->maxdata : 64;
+    MOS6502CfgRegion *data =
+        realloc(cfg->data, max * sizeof(MOS6502CfgRegion));
+    if (!data)
+      return 0;
+
+    cfg->data = data;
+    cfg->maxdata = max;
+  }
+
+  cfg->data[cfg->ndata++] = (MOS6502CfgRegion){start, size};
+  return 1;
+}
+
+// Runs of loaded bytes that aren't code
+static uint8_t finddata(MOS6502 *cpu, MOS6502Cfg *cfg) {
+  uint32_t start = 0, size = 0;
+
+  for (uint32_t addr = 0; addr < RAM; addr++) {
+    uint8_t code = cfg->flags[addr] & (CFGINSTRUCTION | CFGOPERAND);
+
+    if (!code && mos6502_isloaded(cpu, addr >> 8)) {
+      if (!size)
+        start = addr;
+      size++;
+      continue;
+    }
+
+    if (size && !adddata(cfg, start, size))
+      return 0;
+    size = 0;
+  }
+
+  return !size || adddata(cfg, start, size);
+}
+
+MOS6502Cfg *mos6502_cfgbuild(MOS6502 *cpu, const uint16_t *roots,
+                             size_t nroots) {
+  static const uint16_t vectors[] = {RESETVL, NMIVL, IRQVL};
+
+  MOS6502Cfg *cfg = calloc(1, sizeof(MOS6502Cfg));
+  if (!cfg)
+    return NULL;
+
+  // Every address is queued at most once, when it becomes a leader
+  MOS6502CfgWalk walk = {malloc(RAM * sizeof(uint16_t)), 0};
+  if (!walk.stack) {
+    free(cfg);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+    uint8_t lo, hi;
+
+    // Unset vectors point at 0, which is no code
+    if (peek(cpu, vectors[i], &lo) && peek(cpu, vectors[i] + 1, &hi) &&
+        (lo || hi))
+      addleader(cfg, &walk, hi << 8 | lo, CFGROOT);
+  }
+
+  for (size_t i = 0; i < nroots; i++)
+    addleader(cfg, &walk, roots[i], CFGROOT);
+
+  while (walk.depth)
+    follow(cpu, cfg, &walk, walk.stack[--walk.depth]);
+  free(walk.stack);
+
+  for (uint32_t addr = 0; addr < RAM; addr++) {
+    if ((cfg->flags[addr] & (CFGLEADER | CFGINSTRUCTION)) ==
+            (CFGLEADER | CFGINSTRUCTION) &&
+        !buildblock(cpu, cfg, addr)) {
+      mos6502_cfgfree(cfg);
+      return NULL;
+    }
+  }
+
+  if (!finddata(cpu, cfg)) {
+    mos6502_cfgfree(cfg);
+    return NULL;
+  }
+
+  return cfg;
+}
+
+void mos6502_cfgfree(MOS6502Cfg *cfg) {
+  if (!cfg)
+    return;
+
+  free(cfg->blocks);
+  free(cfg->data);
+  free(cfg);
+}
+
+const MOS6502CfgBlock *mos6502_cfgblock(const MOS6502Cfg *cfg, uint16_t addr) {
+  uint32_t low = 0, high = cfg->nblocks;
+
+  // Last block starting at or before addr
+  while (low < high) {
+    uint32_t middle = (low + high) / 2;
+
+    if (cfg->blocks[middle].start <= addr)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  if (!low)
+    return NULL;
+
+  const MOS6502CfgBlock *block = &cfg->blocks[low - 1];
+  return addr - block->start < block->size ? block : NULL;
+}
+
+// Output -------------------------------------------
+static const char *exitsstr[] = {"fall", "branch", "jump",
+                                 "call", "return", "stop"};
+
+uint8_t mos6502_cfgwrite(const MOS6502Cfg *cfg, const char *path) {
+  FILE *file = fopen(path, "w");
+  if (!file)
+    return 0;
+
+  fprintf(file, "digraph cfg {\n  node [shape=box fontname=monospace];\n");
+
+  for (uint32_t i = 0; i < cfg->nblocks; i++) {
+    const MOS6502CfgBlock *block = &cfg->blocks[i];
+    uint16_t last = block->start + block->size - 1;
+
+    fprintf(file, "  b%04x [label=\"%04x-%04x\\n%u instructions, ",
+            block->start, block->start, last, block->instructions);
+    fprintf(file, "%u cycles\\n%s\"%s];\n", block->cycles,
+            exitsstr[block->exit],
+            cfg->flags[block->start] & CFGROOT ? " style=bold" : "");
+  }
+
+  for (uint32_t i = 0; i < cfg->nblocks; i++) {
+    const MOS6502CfgBlock *block = &cfg->blocks[i];
+
+    for (uint8_t s = 0; s < block->nsuccs; s++) {
+      uint16_t succ = block->succs[s];
+
+      // Targets that turned out not to be readable have no block
+      if (!(cfg->flags[succ] & CFGINSTRUCTION))
+        continue;
+
+      const char *label = "";
+      if (block->exit == CFGBRANCH)
+        label = s ? "taken" : "not taken";
+      else if (block->exit == CFGCALL)
+        label = s ? "return" : "call";
+
+      fprintf(file, "  b%04x -> b%04x [label=\"%s\"];\n", block->start, succ,
+              label);
+    }
+  }
+
+  for (uint32_t i = 0; i < cfg->ndata; i++) {
+    const MOS6502CfgRegion *region = &cfg->data[i];
+
+    fprintf(file, "  d%04x [label=\"data %04x-%04x\\n%u bytes\" ",
+            region->start, region->start,
+            (uint16_t)(region->start + region->size - 1), region->size);
+    fprintf(file, "shape=note];\n");
+  }
+
+  fprintf(file, "}\n");
+  return fclose(file) == 0;
+}
+
+// Engines ------------------------------------------
+void mos6502_cfgattach(MOS6502 *cpu, MOS6502Cfg *cfg) {
+  mos6502_cfgfree(cpu->cfg);
+  cpu->cfg = cfg;
+  if (!cfg)
+    return;
+
+  for (uint32_t i = 0; i < cfg->nblocks; i++) {
+    const MOS6502CfgBlock *block = &cfg->blocks[i];
+
+    if (cpu->engine == JIT) {
+      mos6502_jittranslate(cpu, block->start);
+      continue;
+    }
+
+    if (cpu->engine != PREDECODE)
+      return;
+
+    uint16_t pc = block->start;
+    for (uint32_t n = 0; n < block->instructions; n++) {
+      const MOS6502Decoded *decoded = mos6502_predecode(cpu, pc);
+      if (!decoded)
+        return;
+      pc += decoded->length;
+    }
+  }
+}
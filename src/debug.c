@@ -5,18 +5,28 @@
 #include <string.h>
 #include <sys/stat.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "6502.h"
 #include "debug.h"
 
 #define DEBUG 1
 #define DEBUGOPCODES 0
 
+#define ROWSIZE 32
+
+// Memory as of the last mos6502_printstatus, which only prints what changed
+static const MOS6502 *shown;
+static uint8_t snapshot[RAM];
+
 static const char *colors[] = {"\x1b[0m",    "\x1b[1;97m", "\x1b[1;93m",
                                "\x1b[1;31m", "\x1b[2;37m", "\x1B[1;90m"};
-static const char *addrmodesstr[] = {
+const char *addrmodesstr[] = {
     "Implied",      "Accumulator", "Immediate",  "Zero Page",   "Zero Page, X",
     "Zero Page, Y", "Relative",    "Absolute",   "Absolute, X", "Absolute, Y",
-    "Indirect",     "Indirect, X", "Indirect, Y"};
+    "Indirect",     "Indirect, X", "Indirect, Y", "Illegal"};
 
 void printfc(Color c, const char *fmt, ...) {
   va_list args;
@@ -47,7 +57,7 @@ static void print_memory_range(MOS6502 *cpu, const char *mnick, uint16_t start,
                                uint16_t end, uint8_t chunksize) {
   printfc(WHITE, "\n%s\n\t", mnick);
   for (uint16_t i = start; i < end; i++) {
-    uint8_t data = cpu->bus.read(cpu, i);
+    uint8_t data = mos6502_read(cpu, i);
 
     if (data != 0x00) {
       printfc(YELLOW, "%02x ", data);
@@ -63,26 +73,132 @@ static void print_memory_range(MOS6502 *cpu, const char *mnick, uint16_t start,
   printf("\t\n");
 }
 
+static void printregisters(uint16_t pc, uint8_t a, uint8_t x, uint8_t y,
+                           uint8_t sp, uint8_t ps) {
+  printfc(WHITE,
+          "PC: 0x%04X\tA: 0x%02x\tX: 0x%02x\tY: 0x%02x\tSP: 0x%02X\t C: "
+          "%02u\tZ:%02u\tI: %02u\tD: %02u\tB: %02u\tV: %02u\tN: %02u\n",
+          pc, a, x, y, sp, ps & 1, (ps >> 1) & 1, (ps >> 2) & 1,
+          (ps >> 3) & 1, (ps >> 4) & 1, (ps >> 6) & 1, (ps >> 7) & 1);
+}
+
+// Bytes of a row that differ from the snapshot, one bit per byte
+static uint32_t rowdiff(const uint8_t *row, const uint8_t *previous) {
+#if defined(__SSE2__)
+  __m128i lo = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)row),
+                              _mm_loadu_si128((const __m128i *)previous));
+  __m128i hi = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(row + 16)),
+                              _mm_loadu_si128((const __m128i *)(previous + 16)));
+
+  return ~((uint32_t)_mm_movemask_epi8(lo) |
+           (uint32_t)_mm_movemask_epi8(hi) << 16);
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < ROWSIZE; i++)
+    mask |= (uint32_t)(row[i] != previous[i]) << i;
+
+  return mask;
+#endif
+}
+
+// Rows of [start, end) that changed since the snapshot, changed bytes are
+// highlighted. Clean pages are skipped without reading them, I/O pages are
+// always compared. Returns the number of rows printed.
+static int print_memory_diff(MOS6502 *cpu, const char *mnick, uint16_t start,
+                             uint32_t end) {
+  int rows = 0;
+
+  for (uint32_t base = start & ~(ROWSIZE - 1); base < end; base += ROWSIZE) {
+    const uint8_t *host = cpu->bus.pages[base >> 8].read;
+    if (host && !mos6502_isdirty(cpu, base >> 8))
+      continue;
+
+    uint8_t row[ROWSIZE];
+    if (host) {
+      memcpy(row, host + (base & 0xFF), ROWSIZE);
+    } else {
+      for (int i = 0; i < ROWSIZE; i++)
+        row[i] = mos6502_read(cpu, base + i);
+    }
+
+    uint32_t valid = ~0u;
+    if (base < start)
+      valid &= ~0u << (start - base);
+    if (base + ROWSIZE > end)
+      valid &= ~0u >> (base + ROWSIZE - end);
+
+    uint32_t changed = rowdiff(row, &snapshot[base]) & valid;
+    if (!changed)
+      continue;
+
+    if (!rows++)
+      printfc(WHITE, "\n%s\n", mnick);
+
+    printfc(GRAY, "\t$%04x: ", base);
+    for (int i = 0; i < ROWSIZE; i++) {
+      if (!(valid & (1u << i))) {
+        printf("   ");
+      } else if (changed & (1u << i)) {
+        printfc(GREEN, "%02x ", row[i]);
+        snapshot[base + i] = row[i];
+      } else {
+        printfc(row[i] ? YELLOW : GRAY, "%02x ", row[i]);
+      }
+    }
+    printf("\n");
+  }
+
+  return rows;
+}
+
+void mos6502_printregisters(MOS6502 *cpu) {
+  printregisters(cpu->PC, cpu->A, cpu->X, cpu->Y, cpu->SP,
+                 mos6502_getps(cpu));
+}
+
+void mos6502_forgetstatus(const MOS6502 *cpu) {
+  if (shown == cpu)
+    shown = NULL;
+}
+
 void mos6502_printstatus(MOS6502 *cpu) {
 #if DEBUG
 
   drawline(100);
 
-  printfc(WHITE,
-          "PC: 0x%04X\tA: 0x%02x\tX: 0x%02x\tY: 0x%02x\tSP: 0x%02X\t C: "
-          "%02u\tZ:%02u\tI: %02u\tD: %02u\tB: %02u\tV: %02u\tN: %02u\n",
-          cpu->PC, cpu->A, cpu->X, cpu->Y, cpu->SP, cpu->status.flags.C,
-          cpu->status.flags.Z, cpu->status.flags.I, cpu->status.flags.D,
-          cpu->status.flags.B, cpu->status.flags.V, cpu->status.flags.N);
-
-  uint8_t chunksize = (1 << 5);
-  print_memory_range(cpu, "Zero Page = (0x0000 - 0x00FF)", 0x0000, 0x00FF + 1,
-                     chunksize);
-  print_memory_range(cpu, "Stack = (0x0100 - 0x01FF)", 0x0100, 0x01FF + 1,
-                     chunksize);
-  print_memory_range(cpu, "RAM = (0x4e20 - 0x4f20)", 0x4e20, 0x4f20, chunksize);
-  print_memory_range(cpu, "RAM = (0x8000 - 0x80FF)", 0x8000, 0x80FF + 1,
-                     chunksize);
+  mos6502_printregisters(cpu);
+
+  static const struct {
+    const char *mnick;
+    uint16_t start;
+    uint32_t end;
+  } regions[] = {
+      {"Zero Page = (0x0000 - 0x00FF)", 0x0000, 0x00FF + 1},
+      {"Stack = (0x0100 - 0x01FF)", 0x0100, 0x01FF + 1},
+      {"RAM = (0x4e20 - 0x4f20)", 0x4e20, 0x4f20},
+      {"RAM = (0x8000 - 0x80FF)", 0x8000, 0x80FF + 1},
+  };
+  int nregions = sizeof(regions) / sizeof(regions[0]);
+
+  // Whole regions the first time, only the rows that changed after that
+  if (shown != cpu) {
+    for (int i = 0; i < nregions; i++) {
+      print_memory_range(cpu, regions[i].mnick, regions[i].start,
+                         regions[i].end, ROWSIZE);
+      for (uint32_t a = regions[i].start; a < regions[i].end; a++)
+        snapshot[a] = mos6502_read(cpu, a);
+    }
+    shown = cpu;
+  } else {
+    int rows = 0;
+    for (int i = 0; i < nregions; i++)
+      rows += print_memory_diff(cpu, regions[i].mnick, regions[i].start,
+                                regions[i].end);
+    if (!rows)
+      printfc(GRAY, "\nMemory unchanged\n");
+  }
+  mos6502_cleardirty(cpu);
+
   // drawline(100);
   printf("\n");
 
@@ -127,7 +243,8 @@ void mos6502_printopcodes() {
 #endif
 }
 
-void mos6502_disassemble(MOS6502 *cpu, uint8_t opcode, uint16_t pc) {
+void mos6502_disassemblebytes(uint8_t opcode, uint8_t lo, uint8_t hi,
+                              uint16_t pc) {
   switch (opcodes[opcode].mode) {
     case IMP: { // Implied
       printfc(GREEN, "(%02x) ", pc);
@@ -142,7 +259,7 @@ void mos6502_disassemble(MOS6502 *cpu, uint8_t opcode, uint16_t pc) {
     }
 
     case IMM: { // Immediate
-      uint8_t immediate = cpu->bus.read(cpu, pc + 1);
+      uint8_t immediate = lo;
 
       printfc(GREEN, "(%02x) ", pc);
       printfc(WHITE, "%s #$%02x\n", opcodes[opcode].mnemonic, immediate);
@@ -150,7 +267,7 @@ void mos6502_disassemble(MOS6502 *cpu, uint8_t opcode, uint16_t pc) {
     }
 
     case ZP0: { // Zero Page
-      uint8_t addr = cpu->bus.read(cpu, pc + 1);
+      uint8_t addr = lo;
 
       printfc(GREEN, "(%02x) ", pc);
       printfc(WHITE, "%s $%02x\n", opcodes[opcode].mnemonic, addr);
@@ -158,7 +275,7 @@ void mos6502_disassemble(MOS6502 *cpu, uint8_t opcode, uint16_t pc) {
     }
 
     case ZP0X: { // Zero Page with X
-      uint8_t addr = cpu->bus.read(cpu, pc + 1);
+      uint8_t addr = lo;
 
       printfc(GREEN, "(%02x) ", pc);
       printfc(WHITE, "%s $%02x, X\n", opcodes[opcode].mnemonic, addr);
@@ -166,24 +283,22 @@ void mos6502_disassemble(MOS6502 *cpu, uint8_t opcode, uint16_t pc) {
     }
 
     case ZP0Y: { // Zero Page with Y
-      uint8_t addr = cpu->bus.read(cpu, pc + 1);
+      uint8_t addr = lo;
 
       printfc(GREEN, "(%02x) ", pc);
       printfc(WHITE, "%s $%02x, Y\n", opcodes[opcode].mnemonic, addr);
       break;
     }
 
-    case RELT: { // Relative
-      uint8_t relative = cpu->bus.read(cpu, pc + 1);
+    case RELT: { // Relative, shown as the target
+      uint16_t target = pc + 2 + (int8_t)lo;
 
       printfc(GREEN, "(%02x) ", pc);
-      printfc(WHITE, "%s $%02x\n", opcodes[opcode].mnemonic, relative + 2);
+      printfc(WHITE, "%s $%04x\n", opcodes[opcode].mnemonic, target);
       break;
     }
 
     case ABS: { // Absolute
-      uint8_t lo = cpu->bus.read(cpu, pc + 1);
-      uint8_t hi = cpu->bus.read(cpu, pc + 2);
       uint16_t addr = (hi << 8) | lo;
 
       printfc(GREEN, "(%02x) ", pc);
@@ -193,8 +308,6 @@ void mos6502_disassemble(MOS6502 *cpu, uint8_t opcode, uint16_t pc) {
     }
 
     case ABSX: { // Absolute with X
-      uint8_t lo = cpu->bus.read(cpu, pc + 1);
-      uint8_t hi = cpu->bus.read(cpu, pc + 2);
       uint16_t addr = ((hi << 8) | lo);
 
       printfc(GREEN, "(%02x) ", pc);
@@ -203,8 +316,6 @@ void mos6502_disassemble(MOS6502 *cpu, uint8_t opcode, uint16_t pc) {
     }
 
     case ABSY: { // Absolute with Y
-      uint8_t lo = cpu->bus.read(cpu, pc + 1);
-      uint8_t hi = cpu->bus.read(cpu, pc + 2);
       uint16_t addr = ((hi << 8) | lo);
 
       printfc(GREEN, "(%02x) ", pc);
@@ -222,4 +333,33 @@ void mos6502_disassemble(MOS6502 *cpu, uint8_t opcode, uint16_t pc) {
     case ILL:
       break;
   }
-}
\ No newline at end of file
+}
+
+void mos6502_disassemble(MOS6502 *cpu, uint8_t opcode, uint16_t pc) {
+  mos6502_disassemblebytes(opcode, mos6502_read(cpu, pc + 1),
+                           mos6502_read(cpu, pc + 2), pc);
+}
+
+// One record of a binary trace, in the interactive mode's format
+void mos6502_printtracerecord(const MOS6502TraceRecord *record,
+                              uint16_t nextpc, uint64_t cycles) {
+  if (record->flags & TRACEINT) {
+    uint8_t line = record->operand[0];
+    printfc(GREEN, "(%02x) ", record->pc);
+    printfc(YELLOW, "%s\n", line == INTNMI     ? "NMI"
+                            : line == INTRESET ? "RESET"
+                                               : "IRQ");
+  } else {
+    mos6502_disassemblebytes(record->opcode, record->operand[0],
+                             record->operand[1], record->pc);
+  }
+
+  printregisters(nextpc, record->A, record->X, record->Y, record->SP, record->P);
+
+  printfc(GRAY, "Cycles: %" PRIu64, cycles);
+  if (record->flags & TRACEIO)
+    printfc(GRAY, "\tI/O: $%04x", record->addr);
+  else if (record->flags & TRACEMEM)
+    printfc(GRAY, "\tMem: $%04x = $%02x", record->addr, record->data);
+  printf("\n\n");
+}
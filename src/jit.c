@@ -0,0 +1,668 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "6502.h"
+#include "engines.h"
+
+// Basic-block dynamic recompiler to x86-64.
+//
+// Blocks start at a guest PC and run until a control flow instruction, an
+// instruction the translator must leave to the dispatcher (halt opcodes,
+// the breakpoint, illegal opcodes) or JITMAXBLOCK instructions. A handful
+// of register/flag instructions, branches and JMP are emitted natively;
+// everything else calls back into mos6502_execute. Exits with a static
+// target are chained straight into the target block once it exists.
+//
+// Register use inside translated code: rbx = cpu, r12 = cycle deadline.
+
+#define JITBUFFER (4 << 20)
+#define JITMAXBLOCK 64
+#define JITMAXBLOCKBYTES (JITMAXBLOCK * 64 + 256)
+#define JITMAXEXITS 4096
+
+#define OFF(field) ((int32_t)offsetof(MOS6502, field))
+
+typedef void (*jitentry)(MOS6502 *cpu, uint64_t deadline, uint8_t *code);
+
+typedef struct jitexit {
+  uint16_t target;
+  uint32_t patch; // Offset of the rel32 of the exit jump
+} MOS6502JitExit;
+
+typedef struct jit {
+  uint8_t *buffer;
+  size_t used;
+  size_t epilogue;
+
+  uint8_t **blocks[RAM / PAGESIZE]; // Lazily allocated per page
+  uint8_t codemap[RAM / 8];         // Guest bytes covered by translations
+  uint8_t flush;                    // Set when translated code was written
+
+  MOS6502JitExit exits[JITMAXEXITS];
+  size_t nexits;
+
+  // Assumptions baked into the translations
+  int32_t breakpoint;
+  uint8_t haltops[MAXOPCODESTABLE / 8];
+} MOS6502Jit;
+
+#if defined(__x86_64__)
+
+// Emitters -----------------------------------------
+static void emit8(MOS6502Jit *jit, uint8_t byte) {
+  jit->buffer[jit->used++] = byte;
+}
+static void emit16(MOS6502Jit *jit, uint16_t value) {
+  memcpy(&jit->buffer[jit->used], &value, sizeof(value));
+  jit->used += sizeof(value);
+}
+static void emit32(MOS6502Jit *jit, uint32_t value) {
+  memcpy(&jit->buffer[jit->used], &value, sizeof(value));
+  jit->used += sizeof(value);
+}
+static void emit64(MOS6502Jit *jit, uint64_t value) {
+  memcpy(&jit->buffer[jit->used], &value, sizeof(value));
+  jit->used += sizeof(value);
+}
+static void patch32(MOS6502Jit *jit, size_t at, uint32_t value) {
+  memcpy(&jit->buffer[at], &value, sizeof(value));
+}
+
+// rel32 jump/branch to an offset in the buffer, returns the rel32 offset
+static size_t emitrel32(MOS6502Jit *jit, size_t target) {
+  size_t at = jit->used;
+  emit32(jit, (uint32_t)(target - (at + 4)));
+  return at;
+}
+
+// op byte [rbx+disp32], imm8 (0x80 /reg)
+static void emitbyteop(MOS6502Jit *jit, uint8_t reg, int32_t disp,
+                       uint8_t imm) {
+  emit8(jit, 0x80);
+  emit8(jit, 0x83 | (reg << 3));
+  emit32(jit, disp);
+  emit8(jit, imm);
+}
+#define ANDBYTE 4
+#define ORBYTE 1
+#define CMPBYTE 7
+
+// movzx eax, byte [rbx+disp32]
+static void emitload(MOS6502Jit *jit, int32_t disp) {
+  emit8(jit, 0x0F);
+  emit8(jit, 0xB6);
+  emit8(jit, 0x83);
+  emit32(jit, disp);
+}
+
+// mov byte [rbx+disp32], al
+static void emitstore(MOS6502Jit *jit, int32_t disp) {
+  emit8(jit, 0x88);
+  emit8(jit, 0x83);
+  emit32(jit, disp);
+}
+
+// mov byte [rbx+disp32], imm8
+static void emitstoreimm(MOS6502Jit *jit, int32_t disp, uint8_t imm) {
+  emit8(jit, 0xC6);
+  emit8(jit, 0x83);
+  emit32(jit, disp);
+  emit8(jit, imm);
+}
+
+// add qword [rbx+disp32], imm32
+static void emitadd64(MOS6502Jit *jit, int32_t disp, uint32_t imm) {
+  emit8(jit, 0x48);
+  emit8(jit, 0x81);
+  emit8(jit, 0x83);
+  emit32(jit, disp);
+  emit32(jit, imm);
+}
+
+// mov word [rbx+PC], imm16
+static void emitsetpc(MOS6502Jit *jit, uint16_t pc) {
+  emit8(jit, 0x66);
+  emit8(jit, 0xC7);
+  emit8(jit, 0x83);
+  emit32(jit, OFF(PC));
+  emit16(jit, pc);
+}
+
+// Z and N from eax (zero extended al), same as setzeroandnegative()
+static void emitzn(MOS6502Jit *jit) {
+  emit8(jit, 0x66), emit8(jit, 0x89), emit8(jit, 0x83); // mov [nz], ax
+  emit32(jit, OFF(nz));
+}
+
+// Z and N of a value known at translation time
+static void emitznimm(MOS6502Jit *jit, uint8_t value) {
+  emit8(jit, 0x66), emit8(jit, 0xC7), emit8(jit, 0x83); // mov [nz], imm16
+  emit32(jit, OFF(nz));
+  emit16(jit, value);
+}
+
+// Translation -------------------------------------
+static uint8_t isblockstart(MOS6502 *cpu, uint16_t pc, uint8_t opcode) {
+  return pc != cpu->breakpoint && !ishaltop(cpu, opcode) && opcode != 0x00 &&
+         opcodes[opcode].mode < IND;
+}
+
+static void markcode(MOS6502 *cpu, MOS6502Jit *jit, uint16_t pc,
+                     uint8_t length) {
+  for (uint8_t i = 0; i < length; i++) {
+    uint16_t addr = pc + i;
+    jit->codemap[addr >> 3] |= 1 << (addr & 7);
+    cpu->bus.codepages[addr >> 8] = 1;
+  }
+}
+
+static uint8_t **blockslot(MOS6502Jit *jit, uint16_t pc, uint8_t allocate) {
+  uint8_t **page = jit->blocks[pc >> 8];
+
+  if (!page) {
+    if (!allocate)
+      return NULL;
+
+    page = calloc(PAGESIZE, sizeof(uint8_t *));
+    if (!page)
+      return NULL;
+
+    jit->blocks[pc >> 8] = page;
+  }
+
+  return &page[pc & 0xFF];
+}
+
+static void flushcounts(MOS6502Jit *jit, uint32_t *cycles,
+                        uint32_t *instructions) {
+  if (*cycles)
+    emitadd64(jit, OFF(cycles), *cycles);
+  if (*instructions)
+    emitadd64(jit, OFF(instructions), *instructions);
+
+  *cycles = *instructions = 0;
+}
+
+// Leave the block with PC = target, chained when the target is translated
+static void emitexit(MOS6502Jit *jit, uint16_t target, uint8_t chain) {
+  emitsetpc(jit, target);
+  emit8(jit, 0xE9);
+
+  uint8_t **slot = chain ? blockslot(jit, target, 0) : NULL;
+  if (slot && *slot) {
+    emitrel32(jit, *slot - jit->buffer);
+    return;
+  }
+
+  size_t at = emitrel32(jit, jit->epilogue);
+  if (chain && jit->nexits < JITMAXEXITS) {
+    jit->exits[jit->nexits].target = target;
+    jit->exits[jit->nexits].patch = at;
+    jit->nexits++;
+  }
+}
+
+static uint32_t jitstep(MOS6502 *cpu) {
+  if (mos6502_execute(cpu) == 0x7FFF)
+    cpu->halt = HALTILLEGAL;
+
+  return cpu->halt || cpu->jit->flush;
+}
+
+static void emitfallback(MOS6502Jit *jit, uint16_t pc) {
+  emitsetpc(jit, pc);
+  emit8(jit, 0x48), emit8(jit, 0x89), emit8(jit, 0xDF); // mov rdi, rbx
+  emit8(jit, 0x48), emit8(jit, 0xB8);                   // mov rax, imm64
+  emit64(jit, (uint64_t)(uintptr_t)jitstep);
+  emit8(jit, 0xFF), emit8(jit, 0xD0);                   // call rax
+  emit8(jit, 0x85), emit8(jit, 0xC0);                   // test eax, eax
+  emit8(jit, 0x0F), emit8(jit, 0x85);                   // jnz epilogue
+  emitrel32(jit, jit->epilogue);
+}
+
+// mos6502_backjump: chained back to target while the loop is waiting out
+// its backoff, through mos6502_idle and the dispatcher otherwise
+static void emitbackjump(MOS6502Jit *jit, uint16_t pc, uint16_t target) {
+  emit8(jit, 0x66), emit8(jit, 0x81), emit8(jit, 0xBB); // cmp [idle.pc], pc
+  emit32(jit, OFF(idle.pc));
+  emit16(jit, pc);
+  emit8(jit, 0x0F), emit8(jit, 0x85); // jne check
+  size_t otherat = emitrel32(jit, 0);
+  emit8(jit, 0x66), emit8(jit, 0x83), emit8(jit, 0xBB); // cmp [idle.wait], 0
+  emit32(jit, OFF(idle.wait));
+  emit8(jit, 0);
+  emit8(jit, 0x0F), emit8(jit, 0x84); // je check
+  size_t dueat = emitrel32(jit, 0);
+  emit8(jit, 0x66), emit8(jit, 0xFF), emit8(jit, 0x8B); // dec [idle.wait]
+  emit32(jit, OFF(idle.wait));
+  emitexit(jit, target, 1);
+
+  // check:
+  patch32(jit, otherat, (uint32_t)(jit->used - (otherat + 4)));
+  patch32(jit, dueat, (uint32_t)(jit->used - (dueat + 4)));
+  emitsetpc(jit, target);
+  emit8(jit, 0x48), emit8(jit, 0x89), emit8(jit, 0xDF); // mov rdi, rbx
+  emit8(jit, 0xBE);                                     // mov esi, imm32
+  emit32(jit, pc);
+  emit8(jit, 0x4C), emit8(jit, 0x89), emit8(jit, 0xE2); // mov rdx, r12
+  emit8(jit, 0x48), emit8(jit, 0xB8);                   // mov rax, imm64
+  emit64(jit, (uint64_t)(uintptr_t)mos6502_idle);
+  emit8(jit, 0xFF), emit8(jit, 0xD0); // call rax
+  emit8(jit, 0xE9);                   // jmp epilogue
+  emitrel32(jit, jit->epilogue);
+}
+
+// Registers touched by the native transfer and increment instructions
+static int32_t registeroffset(char reg) {
+  switch (reg) {
+    case 'A':
+      return OFF(A);
+    case 'X':
+      return OFF(X);
+    case 'Y':
+      return OFF(Y);
+    default:
+      return OFF(SP);
+  }
+}
+
+// Natively emitted instructions, returns 0 when the opcode isn't one
+static uint8_t emitnative(MOS6502 *cpu, MOS6502Jit *jit, uint8_t opcode,
+                          uint8_t operand) {
+  switch (opcode) {
+    case 0xA9: // LDA #
+    case 0xA2: // LDX #
+    case 0xA0: // LDY #
+      emitstoreimm(jit, registeroffset(opcode == 0xA9   ? 'A'
+                                       : opcode == 0xA2 ? 'X'
+                                                        : 'Y'),
+                   operand);
+      emitznimm(jit, operand);
+      return 1;
+
+    case 0x29: // AND #
+    case 0x09: // ORA #
+    case 0x49: // EOR #
+      emitload(jit, OFF(A));
+      emit8(jit, opcode == 0x29 ? 0x24 : opcode == 0x09 ? 0x0C : 0x34);
+      emit8(jit, operand);
+      emitstore(jit, OFF(A));
+      emitzn(jit);
+      return 1;
+
+    case 0xAA: // TAX
+    case 0xA8: // TAY
+    case 0x8A: // TXA
+    case 0x98: // TYA
+    case 0xBA: // TSX
+    case 0x9A: { // TXS
+      const char *regs = opcode == 0xAA   ? "AX"
+                         : opcode == 0xA8 ? "AY"
+                         : opcode == 0x8A ? "XA"
+                         : opcode == 0x98 ? "YA"
+                         : opcode == 0xBA ? "SX"
+                                          : "XS";
+      emitload(jit, registeroffset(regs[0]));
+      emitstore(jit, registeroffset(regs[1]));
+      if (opcode != 0x9A)
+        emitzn(jit);
+      return 1;
+    }
+
+    case 0xE8: // INX
+    case 0xC8: // INY
+    case 0xCA: // DEX
+    case 0x88: { // DEY
+      int32_t reg = registeroffset(opcode == 0xE8 || opcode == 0xCA ? 'X' : 'Y');
+      emitload(jit, reg);
+      emit8(jit, 0xFE);
+      emit8(jit, opcode == 0xE8 || opcode == 0xC8 ? 0xC0 : 0xC8); // inc/dec al
+      emitstore(jit, reg);
+      emitzn(jit);
+      return 1;
+    }
+
+    case 0x18: // CLC
+      emitstoreimm(jit, OFF(c), 0);
+      return 1;
+    case 0x38: // SEC
+      emitstoreimm(jit, OFF(c), 1);
+      return 1;
+    case 0x78: // SEI
+      emitbyteop(jit, ORBYTE, OFF(status), 0x04);
+      return 1;
+    case 0xD8: // CLD
+      emitbyteop(jit, ANDBYTE, OFF(status), 0xF7);
+      return 1;
+    case 0xF8: // SED
+      emitbyteop(jit, ORBYTE, OFF(status), 0x08);
+      return 1;
+    case 0xB8: // CLV
+      emitstoreimm(jit, OFF(v), 0);
+      return 1;
+
+    case 0xEA: // NOP
+      return 1;
+  }
+
+  return 0;
+}
+
+// Tests the lazy flag a branch depends on, returns the jcc opcode (jnz or
+// jz) that takes it
+static uint8_t emitbranchtest(MOS6502Jit *jit, uint8_t opcode) {
+  uint8_t taken = (opcode >> 5) & 1; // Taken when the flag is set
+
+  switch (opcode >> 6) {
+    case 0: // N
+      emit8(jit, 0x66), emit8(jit, 0xF7), emit8(jit, 0x83); // test [nz], imm16
+      emit32(jit, OFF(nz));
+      emit16(jit, 0x8080);
+      break;
+    case 1: // V
+      emit8(jit, 0xF6), emit8(jit, 0x83); // test byte [v], 0x80
+      emit32(jit, OFF(v));
+      emit8(jit, 0x80);
+      break;
+    case 2: // C
+      emitbyteop(jit, CMPBYTE, OFF(c), 0);
+      break;
+    case 3: // Z, set when the low byte of nz is zero
+      emitbyteop(jit, CMPBYTE, OFF(nz), 0);
+      taken ^= 1;
+      break;
+  }
+
+  return taken ? 0x85 : 0x84;
+}
+
+static uint8_t *translate(MOS6502 *cpu, MOS6502Jit *jit, uint16_t pc) {
+  uint8_t opcode = mos6502_read(cpu, pc);
+  if (!isblockstart(cpu, pc, opcode))
+    return NULL;
+
+  if (jit->used + JITMAXBLOCKBYTES > JITBUFFER)
+    return NULL;
+
+  uint8_t **slot = blockslot(jit, pc, 1);
+  if (!slot)
+    return NULL;
+
+  uint16_t start = pc;
+  uint8_t *code = &jit->buffer[jit->used];
+  uint32_t cycles = 0, instructions = 0, worst = 0;
+
+  // Header: leave to the dispatcher when the whole block might overrun the
+  // deadline (patched below) or a halt was requested
+  emit8(jit, 0x48), emit8(jit, 0x8B), emit8(jit, 0x83); // mov rax, [cycles]
+  emit32(jit, OFF(cycles));
+  emit8(jit, 0x48), emit8(jit, 0x05); // add rax, imm32
+  size_t worstat = jit->used;
+  emit32(jit, 0);
+  emit8(jit, 0x4C), emit8(jit, 0x39), emit8(jit, 0xE0); // cmp rax, r12
+  emit8(jit, 0x0F), emit8(jit, 0x83);                   // jae epilogue
+  emitrel32(jit, jit->epilogue);
+  emitbyteop(jit, CMPBYTE, OFF(halt), 0);
+  emit8(jit, 0x0F), emit8(jit, 0x85); // jne epilogue
+  emitrel32(jit, jit->epilogue);
+
+  for (int count = 0;; count++) {
+    opcode = mos6502_read(cpu, pc);
+
+    if (count && (count == JITMAXBLOCK || !isblockstart(cpu, pc, opcode))) {
+      flushcounts(jit, &cycles, &instructions);
+      emitexit(jit, pc, 1);
+      break;
+    }
+
+    MOS6502Instruction *instruction = &opcodes[opcode];
+    uint8_t length = 1;
+    if (instruction->mode == IMM || instruction->mode == ZP0 ||
+        instruction->mode == ZP0X || instruction->mode == ZP0Y ||
+        instruction->mode == RELT)
+      length = 2;
+    else if (instruction->mode >= ABS)
+      length = 3;
+
+    uint8_t lo = length > 1 ? mos6502_read(cpu, pc + 1) : 0;
+    uint8_t hi = length > 2 ? mos6502_read(cpu, pc + 2) : 0;
+    uint16_t next = pc + length;
+
+    markcode(cpu, jit, pc, length);
+    worst += instruction->cycles + 2;
+
+    // Branches: two chained exits
+    if (instruction->mode == RELT) {
+      uint16_t target = pc + (int8_t)lo + 2;
+
+      cycles += instruction->cycles;
+      instructions++;
+      flushcounts(jit, &cycles, &instructions);
+      uint8_t jcc = emitbranchtest(jit, opcode);
+
+      emit8(jit, 0x0F), emit8(jit, jcc); // jnz/jz taken
+      size_t takenat = emitrel32(jit, 0);
+
+      emitexit(jit, next, 1);
+
+      patch32(jit, takenat, (uint32_t)(jit->used - (takenat + 4)));
+      emitadd64(jit, OFF(cycles),
+                1 + ((next & 0xFF00) != (target & 0xFF00)));
+      if (target <= pc && mos6502_idleloop(cpu, pc, target, NULL))
+        emitbackjump(jit, pc, target);
+      else
+        emitexit(jit, target, 1);
+      break;
+    }
+
+    // JMP absolute
+    if (opcode == 0x4C) {
+      uint16_t target = START | ((hi << 8) | lo);
+
+      cycles += instruction->cycles;
+      instructions++;
+      flushcounts(jit, &cycles, &instructions);
+      if (target <= pc && mos6502_idleloop(cpu, pc, target, NULL))
+        emitbackjump(jit, pc, target);
+      else
+        emitexit(jit, target, 1);
+      break;
+    }
+
+    if (emitnative(cpu, jit, opcode, lo)) {
+      cycles += instruction->cycles;
+      instructions++;
+      pc = next;
+      continue;
+    }
+
+    // Everything else goes through the interpreter
+    flushcounts(jit, &cycles, &instructions);
+    emitfallback(jit, pc);
+
+    // Control flow with a dynamic target ends the block
+    if (opcode == 0x20 || opcode == 0x60 || opcode == 0x6C ||
+        opcode == 0x40) {
+      emit8(jit, 0xE9);
+      emitrel32(jit, jit->epilogue);
+      break;
+    }
+
+    pc = next;
+  }
+
+  patch32(jit, worstat, worst);
+  *slot = code;
+
+  // Chain the exits that were waiting for this block
+  for (size_t i = 0; i < jit->nexits;) {
+    if (jit->exits[i].target != start) {
+      i++;
+      continue;
+    }
+
+    size_t at = jit->exits[i].patch;
+    patch32(jit, at, (uint32_t)((code - jit->buffer) - (at + 4)));
+    jit->exits[i] = jit->exits[--jit->nexits];
+  }
+
+  return code;
+}
+
+// Shared entry trampoline and epilogue at the start of the buffer
+static void emittrampoline(MOS6502Jit *jit) {
+  jit->used = 0;
+
+  emit8(jit, 0x53);                                     // push rbx
+  emit8(jit, 0x41), emit8(jit, 0x54);                   // push r12
+  emit8(jit, 0x41), emit8(jit, 0x55);                   // push r13
+  emit8(jit, 0x48), emit8(jit, 0x89), emit8(jit, 0xFB); // mov rbx, rdi
+  emit8(jit, 0x49), emit8(jit, 0x89), emit8(jit, 0xF4); // mov r12, rsi
+  emit8(jit, 0xFF), emit8(jit, 0xE2);                   // jmp rdx
+
+  jit->epilogue = jit->used;
+  emit8(jit, 0x41), emit8(jit, 0x5D); // pop r13
+  emit8(jit, 0x41), emit8(jit, 0x5C); // pop r12
+  emit8(jit, 0x5B);                   // pop rbx
+  emit8(jit, 0xC3);                   // ret
+}
+
+static void jitflush(MOS6502 *cpu, MOS6502Jit *jit) {
+  for (int i = 0; i < RAM / PAGESIZE; i++) {
+    free(jit->blocks[i]);
+    jit->blocks[i] = NULL;
+  }
+
+  memset(jit->codemap, 0, sizeof(jit->codemap));
+  jit->nexits = 0;
+  jit->flush = 0;
+  jit->breakpoint = cpu->breakpoint;
+  memcpy(jit->haltops, cpu->haltops, sizeof(jit->haltops));
+
+  emittrampoline(jit);
+}
+
+uint8_t mos6502_jitinit(MOS6502 *cpu) {
+  if (cpu->jit)
+    return 1;
+
+  MOS6502Jit *jit = calloc(1, sizeof(MOS6502Jit));
+  if (!jit)
+    return 0;
+
+  jit->buffer = mmap(NULL, JITBUFFER, PROT_READ | PROT_WRITE | PROT_EXEC,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (jit->buffer == MAP_FAILED) {
+    free(jit);
+    return 0;
+  }
+
+  cpu->jit = jit;
+  jitflush(cpu, jit);
+  return 1;
+}
+
+void mos6502_jitfree(MOS6502 *cpu) {
+  MOS6502Jit *jit = cpu->jit;
+  if (!jit)
+    return;
+
+  for (int i = 0; i < RAM / PAGESIZE; i++)
+    free(jit->blocks[i]);
+
+  munmap(jit->buffer, JITBUFFER);
+  free(jit);
+  cpu->jit = NULL;
+}
+
+void mos6502_jitinvalidate(MOS6502 *cpu, uint16_t addr) {
+  MOS6502Jit *jit = cpu->jit;
+
+  if (jit->codemap[addr >> 3] & (1 << (addr & 7)))
+    jit->flush = 1;
+}
+
+// Translations assume the breakpoint and halt set they were made with
+static void checkassumptions(MOS6502 *cpu, MOS6502Jit *jit) {
+  if (jit->breakpoint != cpu->breakpoint ||
+      memcmp(jit->haltops, cpu->haltops, sizeof(jit->haltops)))
+    jit->flush = 1;
+}
+
+uint8_t mos6502_jittranslate(MOS6502 *cpu, uint16_t pc) {
+  if (!mos6502_jitinit(cpu))
+    return 0;
+
+  MOS6502Jit *jit = cpu->jit;
+  checkassumptions(cpu, jit);
+  if (jit->flush)
+    jitflush(cpu, jit);
+
+  uint8_t **slot = blockslot(jit, pc, 0);
+  return (slot && *slot) || translate(cpu, jit, pc);
+}
+
+uint64_t mos6502_runjit(MOS6502 *cpu, uint64_t deadline) {
+  MOS6502Jit *jit = cpu->jit;
+  jitentry enter = (jitentry)jit->buffer;
+  uint64_t start = cpu->cycles;
+
+  checkassumptions(cpu, jit);
+
+  while (cpu->cycles < deadline && !cpu->halt) {
+    if (jit->flush)
+      jitflush(cpu, jit);
+
+    if (cpu->PC == cpu->breakpoint) {
+      cpu->halt = HALTBREAK;
+      break;
+    }
+
+    uint8_t **slot = blockslot(jit, cpu->PC, 0);
+    uint8_t *code = slot ? *slot : NULL;
+    if (!code) {
+      code = translate(cpu, jit, cpu->PC);
+
+      // Out of buffer: start over and retry once
+      if (!code && jit->used + JITMAXBLOCKBYTES > JITBUFFER) {
+        jitflush(cpu, jit);
+        code = translate(cpu, jit, cpu->PC);
+      }
+    }
+
+    if (code) {
+      uint16_t pc = cpu->PC;
+      uint64_t cycles = cpu->cycles;
+
+      enter(cpu, deadline, code);
+      if (cpu->PC != pc || cpu->cycles != cycles || cpu->halt)
+        continue;
+    }
+
+    // Untranslatable, or too close to the deadline: one interpreted step
+    uint8_t opcode = mos6502_read(cpu, cpu->PC);
+    if (ishaltop(cpu, opcode)) {
+      cpu->halt = HALTOPCODE;
+      break;
+    }
+
+    if (mos6502_execute(cpu) == 0x7FFF) {
+      cpu->halt = HALTILLEGAL;
+      break;
+    }
+  }
+
+  return cpu->cycles - start;
+}
+
+#else
+
+uint8_t mos6502_jitinit(MOS6502 *cpu) { return 0; }
+void mos6502_jitfree(MOS6502 *cpu) {}
+void mos6502_jitinvalidate(MOS6502 *cpu, uint16_t addr) {}
+uint8_t mos6502_jittranslate(MOS6502 *cpu, uint16_t pc) { return 0; }
+uint64_t mos6502_runjit(MOS6502 *cpu, uint64_t deadline) { return 0; }
+
+#endif
@@ -0,0 +1,277 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "6502.h"
+#include "loader.h"
+
+const char *imageformatsstr[] = {"raw", "Intel HEX", "segments"};
+
+static uint16_t le16(const uint8_t *bytes) {
+  return bytes[0] | bytes[1] << 8;
+}
+
+static uint32_t le32(const uint8_t *bytes) {
+  return le16(bytes) | (uint32_t)le16(bytes + 2) << 16;
+}
+
+static uint8_t addsegment(MOS6502Program *program, uint32_t addr,
+                          const uint8_t *bytes, uint32_t size) {
+  if (program->nsegments == LOADERMAXSEGMENTS || addr + size > RAM)
+    return 0;
+
+  MOS6502Segment *segment = &program->segments[program->nsegments++];
+  segment->addr = addr;
+  segment->size = size;
+  segment->bytes = bytes;
+  return 1;
+}
+
+// Vectors go last so they override whatever the segments put there
+static uint8_t addvector(MOS6502Program *program, uint16_t addr,
+                         uint16_t value) {
+  uint8_t *bytes = &program->vectors[addr - (RESETVL - 2)];
+
+  bytes[0] = value & 0xFF;
+  bytes[1] = value >> 8;
+  return addsegment(program, addr, bytes, 2);
+}
+
+// Formats ------------------------------------------
+static uint8_t parseraw(MOS6502Program *program) {
+  if (program->mapsize > RAM - START)
+    return 0;
+
+  return addsegment(program, START, program->map, program->mapsize);
+}
+
+static uint8_t parsesegments(MOS6502Program *program) {
+  const uint8_t *map = program->map;
+
+  if (program->mapsize < SEGHEADER)
+    return 0;
+
+  uint16_t count = le16(map + 8);
+  uint16_t vectors = le16(map + 10);
+  if (SEGHEADER + (size_t)count * SEGENTRY > program->mapsize)
+    return 0;
+
+  for (uint16_t i = 0; i < count; i++) {
+    const uint8_t *entry = map + SEGHEADER + i * SEGENTRY;
+    uint16_t addr = le16(entry);
+    uint32_t size = le32(entry + 4);
+    uint32_t offset = le32(entry + 8);
+
+    if (offset > program->mapsize || size > program->mapsize - offset ||
+        !addsegment(program, addr, map + offset, size))
+      return 0;
+
+    program->size += size;
+  }
+
+  if ((vectors & VECTORNMI && !addvector(program, RESETVL - 2, le16(map + 12))) ||
+      (vectors & VECTORRESET && !addvector(program, RESETVL, le16(map + 14))) ||
+      (vectors & VECTORIRQ && !addvector(program, RESETVL + 2, le16(map + 16))))
+    return 0;
+
+  return 1;
+}
+
+static int hexdigit(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+// One byte of a record, -1 past the end or on a bad digit
+static int hexbyte(const char *text, size_t length, size_t at) {
+  if (at + 2 > length)
+    return -1;
+
+  int hi = hexdigit(text[at]);
+  int lo = hexdigit(text[at + 1]);
+  return hi < 0 || lo < 0 ? -1 : hi << 4 | lo;
+}
+
+// Decodes into program->decoded, each run of contiguous bytes becomes a
+// segment
+static uint8_t parsehex(MOS6502Program *program) {
+  const char *text = (const char *)program->map;
+  size_t length = program->mapsize;
+  uint8_t covered[RAM / 8] = {0};
+  uint32_t base = 0;
+  int32_t entry = -1; // Start address
+  uint8_t done = 0;
+
+  program->decoded = malloc(RAM);
+  if (!program->decoded)
+    return 0;
+
+  for (size_t at = 0; at < length && !done;) {
+    if (text[at] != ':') {
+      at++; // Line breaks
+      continue;
+    }
+
+    uint8_t record[5 + 255];
+    int count = hexbyte(text, length, at + 1);
+    if (count < 0)
+      return 0;
+
+    uint8_t sum = 0;
+    for (int i = 0; i < count + 5; i++) {
+      int byte = hexbyte(text, length, at + 1 + 2 * i);
+      if (byte < 0)
+        return 0;
+      record[i] = byte;
+      sum += byte;
+    }
+    at += 1 + 2 * (count + 5);
+
+    if (sum)
+      return 0; // Checksum
+
+    uint16_t offset = record[1] << 8 | record[2];
+    const uint8_t *data = &record[4];
+
+    switch (record[3]) {
+      case 0x00: // Data
+        if (base + offset + count > RAM)
+          return 0;
+        for (int i = 0; i < count; i++) {
+          uint32_t addr = base + offset + i;
+          program->decoded[addr] = data[i];
+          covered[addr >> 3] |= 1 << (addr & 7);
+        }
+        break;
+      case 0x01: // End of file
+        done = 1;
+        break;
+      case 0x02: // Extended segment address
+        base = (data[0] << 8 | data[1]) << 4;
+        break;
+      case 0x04: // Extended linear address
+        base = (uint32_t)(data[0] << 8 | data[1]) << 16;
+        break;
+      case 0x03: // Start segment address, CS:IP
+        if (count != 4)
+          return 0;
+        entry = (((data[0] << 8 | data[1]) << 4) + (data[2] << 8 | data[3])) &
+                0xFFFF;
+        break;
+      case 0x05: // Start linear address
+        if (count != 4)
+          return 0;
+        entry = data[2] << 8 | data[3];
+        break;
+      default:
+        return 0;
+    }
+  }
+
+  for (uint32_t addr = 0; addr < RAM;) {
+    if (!(covered[addr >> 3] & (1 << (addr & 7)))) {
+      addr++;
+      continue;
+    }
+
+    uint32_t end = addr;
+    while (end < RAM && covered[end >> 3] & (1 << (end & 7)))
+      end++;
+
+    if (!addsegment(program, addr, &program->decoded[addr], end - addr))
+      return 0;
+
+    program->size += end - addr;
+    addr = end;
+  }
+
+  return entry < 0 || addvector(program, RESETVL, entry);
+}
+
+// Program ------------------------------------------
+static uint8_t hasextension(const char *path, const char *extension) {
+  size_t length = strlen(path);
+  size_t n = strlen(extension);
+
+  return length > n && !strcasecmp(path + length - n, extension);
+}
+
+MOS6502Program *mos6502_programopen(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+    close(fd);
+    return NULL;
+  }
+
+  MOS6502Program *program = calloc(1, sizeof(MOS6502Program));
+  if (!program) {
+    close(fd);
+    return NULL;
+  }
+
+  program->mapsize = st.st_size;
+  program->map =
+      mmap(NULL, program->mapsize, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (program->map == MAP_FAILED) {
+    free(program);
+    return NULL;
+  }
+
+  uint8_t parsed;
+  if (program->mapsize >= sizeof(SEGMAGIC) &&
+      !memcmp(program->map, SEGMAGIC, sizeof(SEGMAGIC))) {
+    program->format = IMAGESEGMENTS;
+    parsed = parsesegments(program);
+  } else if (hasextension(path, ".hex") || hasextension(path, ".ihx")) {
+    program->format = IMAGEHEX;
+    parsed = parsehex(program);
+  } else {
+    program->format = IMAGERAW;
+    program->size = program->mapsize;
+    parsed = parseraw(program);
+  }
+
+  if (!parsed) {
+    mos6502_programclose(program);
+    return NULL;
+  }
+
+  return program;
+}
+
+void mos6502_programclose(MOS6502Program *program) {
+  if (!program)
+    return;
+
+  munmap(program->map, program->mapsize);
+  free(program->decoded);
+  free(program);
+}
+
+uint8_t mos6502_programmap(MOS6502 *cpu, const MOS6502Program *program) {
+  for (size_t i = 0; i < program->nsegments; i++) {
+    const MOS6502Segment *segment = &program->segments[i];
+
+    if (mos6502_loadsegment(cpu, segment->addr, segment->bytes,
+                            segment->size) != segment->size)
+      return 0;
+  }
+
+  mos6502_reset(cpu);
+  return 1;
+}
@@ -0,0 +1,1230 @@
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "6502.h"
+#include "alu.h"
+#include "lockstep.h"
+
+// Lane operations, handler semantics from instructions.h applied to every
+// lane whose mask byte is 0xFF. n is always a multiple of LOCKSTEPALIGN.
+struct lockstepops {
+  const char *isa;
+
+  // dst = src, Z and N from the result unless P is NULL
+  void (*assign)(uint8_t *dst, const uint8_t *src, uint8_t *P,
+                 const uint8_t *mask, size_t n);
+  // A = A op M for AND, ORA and EOR
+  void (*logic)(uint8_t *A, const uint8_t *M, uint8_t *P, const uint8_t *mask,
+                size_t n, uint8_t op);
+  void (*adc)(uint8_t *A, const uint8_t *M, uint8_t *P, const uint8_t *mask,
+              size_t n);
+  void (*sbc)(uint8_t *A, const uint8_t *M, uint8_t *P, const uint8_t *mask,
+              size_t n);
+  // CMP/CPX/CPY, R against M
+  void (*compare)(const uint8_t *R, const uint8_t *M, uint8_t *P,
+                  const uint8_t *mask, size_t n);
+  void (*bit)(const uint8_t *A, const uint8_t *M, uint8_t *P,
+              const uint8_t *mask, size_t n);
+  // dst += delta, Z and N from the result unless P is NULL
+  void (*step)(uint8_t *dst, uint8_t *P, const uint8_t *mask, size_t n,
+               uint8_t delta);
+  void (*flags)(uint8_t *P, const uint8_t *mask, size_t n, uint8_t and,
+                uint8_t or);
+  // taken = mask & ((P & flag) != 0) == set, returns the taken lanes
+  size_t (*test)(const uint8_t *P, const uint8_t *mask, uint8_t *taken,
+                 size_t n, uint8_t flag, uint8_t set);
+  void (*account)(uint64_t *cycles, uint64_t *instructions,
+                  const uint8_t *mask, size_t n, uint64_t ncycles,
+                  uint64_t ninstructions);
+  // Whether every masked lane of row holds value
+  uint8_t (*uniform)(const uint8_t *row, const uint8_t *mask, size_t n,
+                     uint8_t value);
+};
+
+#define LOGICAND 0
+#define LOGICORA 1
+#define LOGICEOR 2
+
+#define FLAGC 0x01
+#define FLAGZ 0x02
+#define FLAGI 0x04
+#define FLAGD 0x08
+#define FLAGV 0x40
+#define FLAGN 0x80
+
+// Scalar ------------------------------------------
+static uint8_t zn(uint8_t P, uint8_t value) {
+  return (P & ~(FLAGZ | FLAGN)) | (value ? 0 : FLAGZ) | (value & FLAGN);
+}
+
+static void scalarassign(uint8_t *dst, const uint8_t *src, uint8_t *P,
+                         const uint8_t *mask, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    if (!mask[i])
+      continue;
+
+    dst[i] = src[i];
+    if (P)
+      P[i] = zn(P[i], dst[i]);
+  }
+}
+
+static void scalarlogic(uint8_t *A, const uint8_t *M, uint8_t *P,
+                        const uint8_t *mask, size_t n, uint8_t op) {
+  for (size_t i = 0; i < n; i++) {
+    if (!mask[i])
+      continue;
+
+    A[i] = op == LOGICAND   ? A[i] & M[i]
+           : op == LOGICORA ? A[i] | M[i]
+                            : A[i] ^ M[i];
+    P[i] = zn(P[i], A[i]);
+  }
+}
+
+// ADC and SBC from the ALU tables, decimal mode included
+static void scalaralu(const uint32_t *table, uint8_t *A, const uint8_t *M,
+                      uint8_t *P, const uint8_t *mask, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    if (!mask[i])
+      continue;
+
+    uint32_t entry = table[aluindex((P[i] & FLAGD) != 0, P[i] & FLAGC, A[i],
+                                    M[i])];
+
+    P[i] = (P[i] & ~(FLAGC | FLAGZ | FLAGV | FLAGN)) | aluflags(entry);
+    A[i] = entry >> 16;
+  }
+}
+
+static void scalaradc(uint8_t *A, const uint8_t *M, uint8_t *P,
+                      const uint8_t *mask, size_t n) {
+  scalaralu(aluadc, A, M, P, mask, n);
+}
+
+static void scalarsbc(uint8_t *A, const uint8_t *M, uint8_t *P,
+                      const uint8_t *mask, size_t n) {
+  scalaralu(alusbc, A, M, P, mask, n);
+}
+
+static void scalarcompare(const uint8_t *R, const uint8_t *M, uint8_t *P,
+                          const uint8_t *mask, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    if (!mask[i])
+      continue;
+
+    P[i] = (P[i] & ~(FLAGC | FLAGZ | FLAGN)) | (R[i] >= M[i]) |
+           (R[i] == M[i] ? FLAGZ : 0) | ((uint8_t)(R[i] - M[i]) & FLAGN);
+  }
+}
+
+static void scalarbit(const uint8_t *A, const uint8_t *M, uint8_t *P,
+                      const uint8_t *mask, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    if (!mask[i])
+      continue;
+
+    uint8_t result = A[i] & M[i];
+    P[i] = (zn(P[i], result) & ~(FLAGN | FLAGV)) | (M[i] & (FLAGN | FLAGV));
+  }
+}
+
+static void scalarstep(uint8_t *dst, uint8_t *P, const uint8_t *mask, size_t n,
+                       uint8_t delta) {
+  for (size_t i = 0; i < n; i++) {
+    if (!mask[i])
+      continue;
+
+    dst[i] += delta;
+    if (P)
+      P[i] = zn(P[i], dst[i]);
+  }
+}
+
+static void scalarflags(uint8_t *P, const uint8_t *mask, size_t n, uint8_t and,
+                        uint8_t or) {
+  for (size_t i = 0; i < n; i++)
+    if (mask[i])
+      P[i] = (P[i] & and) | or;
+}
+
+static size_t scalartest(const uint8_t *P, const uint8_t *mask, uint8_t *taken,
+                         size_t n, uint8_t flag, uint8_t set) {
+  size_t count = 0;
+
+  for (size_t i = 0; i < n; i++) {
+    taken[i] = mask[i] && !!(P[i] & flag) == set ? 0xFF : 0x00;
+    count += taken[i] & 1;
+  }
+
+  return count;
+}
+
+static void scalaraccount(uint64_t *cycles, uint64_t *instructions,
+                          const uint8_t *mask, size_t n, uint64_t ncycles,
+                          uint64_t ninstructions) {
+  for (size_t i = 0; i < n; i++) {
+    if (!mask[i])
+      continue;
+
+    cycles[i] += ncycles;
+    instructions[i] += ninstructions;
+  }
+}
+
+static uint8_t scalaruniform(const uint8_t *row, const uint8_t *mask, size_t n,
+                             uint8_t value) {
+  for (size_t i = 0; i < n; i++)
+    if (mask[i] && row[i] != value)
+      return 0;
+
+  return 1;
+}
+
+static const MOS6502LockstepOps scalarops = {
+    "scalar",     scalarassign, scalarlogic, scalaradc,
+    scalarsbc,    scalarcompare, scalarbit,  scalarstep,
+    scalarflags,  scalartest,   scalaraccount, scalaruniform};
+
+// AVX2 --------------------------------------------
+#if defined(__x86_64__) && defined(__GNUC__)
+#define AVX2 __attribute__((target("avx2")))
+#define LOAD(p) _mm256_load_si256((const __m256i *)(p))
+#define STORE(p, v) _mm256_store_si256((__m256i *)(p), (v))
+#define SET1(b) _mm256_set1_epi8((char)(b))
+#define BLEND(old, new, mask) _mm256_blendv_epi8((old), (new), (mask))
+
+// Z and N of v merged into P
+AVX2 static inline __m256i vzn(__m256i P, __m256i v) {
+  __m256i z = _mm256_and_si256(_mm256_cmpeq_epi8(v, _mm256_setzero_si256()),
+                               SET1(FLAGZ));
+  __m256i neg = _mm256_and_si256(v, SET1(FLAGN));
+
+  P = _mm256_and_si256(P, SET1(~(FLAGZ | FLAGN)));
+  return _mm256_or_si256(P, _mm256_or_si256(z, neg));
+}
+
+// Unsigned a < b, per byte
+AVX2 static inline __m256i vbelow(__m256i a, __m256i b) {
+  return _mm256_xor_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(a, b), a),
+                          SET1(0xFF));
+}
+
+AVX2 static void avx2assign(uint8_t *dst, const uint8_t *src, uint8_t *P,
+                            const uint8_t *mask, size_t n) {
+  for (size_t i = 0; i < n; i += 32) {
+    __m256i m = LOAD(mask + i);
+    __m256i v = BLEND(LOAD(dst + i), LOAD(src + i), m);
+
+    STORE(dst + i, v);
+    if (P)
+      STORE(P + i, BLEND(LOAD(P + i), vzn(LOAD(P + i), v), m));
+  }
+}
+
+AVX2 static void avx2logic(uint8_t *A, const uint8_t *M, uint8_t *P,
+                           const uint8_t *mask, size_t n, uint8_t op) {
+  for (size_t i = 0; i < n; i += 32) {
+    __m256i m = LOAD(mask + i);
+    __m256i a = LOAD(A + i), b = LOAD(M + i);
+    __m256i v = op == LOGICAND   ? _mm256_and_si256(a, b)
+                : op == LOGICORA ? _mm256_or_si256(a, b)
+                                 : _mm256_xor_si256(a, b);
+
+    STORE(A + i, BLEND(a, v, m));
+    STORE(P + i, BLEND(LOAD(P + i), vzn(LOAD(P + i), v), m));
+  }
+}
+
+// A + M + C, with the carry out of either add
+AVX2 static inline __m256i vadd(__m256i a, __m256i b, __m256i p,
+                                __m256i *carry) {
+  __m256i sum = _mm256_add_epi8(a, b);
+  __m256i c1 = vbelow(sum, a);
+  __m256i result = _mm256_add_epi8(sum, _mm256_and_si256(p, SET1(FLAGC)));
+  __m256i c2 = vbelow(result, sum);
+
+  *carry = _mm256_or_si256(c1, c2);
+  return result;
+}
+
+// Whether a masked lane has D set, those chunks go through the ALU tables
+AVX2 static inline int vdecimal(__m256i p, __m256i m) {
+  return _mm256_movemask_epi8(_mm256_and_si256(m, _mm256_slli_epi16(p, 4)));
+}
+
+AVX2 static void avx2adc(uint8_t *A, const uint8_t *M, uint8_t *P,
+                         const uint8_t *mask, size_t n) {
+  for (size_t i = 0; i < n; i += 32) {
+    __m256i m = LOAD(mask + i);
+    __m256i a = LOAD(A + i), b = LOAD(M + i), p = LOAD(P + i), carry;
+
+    if (vdecimal(p, m)) {
+      scalaradc(A + i, M + i, P + i, mask + i, 32);
+      continue;
+    }
+
+    __m256i result = vadd(a, b, p, &carry);
+
+    __m256i v = _mm256_andnot_si256(_mm256_xor_si256(a, b),
+                                    _mm256_xor_si256(a, result));
+    v = _mm256_and_si256(_mm256_srli_epi16(v, 1), SET1(FLAGV));
+
+    p = _mm256_and_si256(p, SET1(~(FLAGC | FLAGV)));
+    p = _mm256_or_si256(p, _mm256_and_si256(carry, SET1(FLAGC)));
+    p = vzn(_mm256_or_si256(p, v), result);
+
+    STORE(A + i, BLEND(a, result, m));
+    STORE(P + i, BLEND(LOAD(P + i), p, m));
+  }
+}
+
+AVX2 static void avx2sbc(uint8_t *A, const uint8_t *M, uint8_t *P,
+                         const uint8_t *mask, size_t n) {
+  for (size_t i = 0; i < n; i += 32) {
+    __m256i m = LOAD(mask + i);
+    __m256i a = LOAD(A + i), p = LOAD(P + i), carry;
+    __m256i b = _mm256_xor_si256(LOAD(M + i), SET1(0xFF));
+
+    if (vdecimal(p, m)) {
+      scalarsbc(A + i, M + i, P + i, mask + i, 32);
+      continue;
+    }
+
+    // C is the carry out of A + ~M + C, set when nothing was borrowed
+    __m256i result = vadd(a, b, p, &carry);
+    __m256i c = _mm256_and_si256(carry, SET1(FLAGC));
+    __m256i v = _mm256_and_si256(_mm256_xor_si256(result, a),
+                                 _mm256_xor_si256(result, b));
+    v = _mm256_and_si256(_mm256_srli_epi16(v, 1), SET1(FLAGV));
+
+    p = _mm256_and_si256(p, SET1(~(FLAGC | FLAGV)));
+    p = vzn(_mm256_or_si256(p, _mm256_or_si256(c, v)), result);
+
+    STORE(A + i, BLEND(a, result, m));
+    STORE(P + i, BLEND(LOAD(P + i), p, m));
+  }
+}
+
+AVX2 static void avx2compare(const uint8_t *R, const uint8_t *M, uint8_t *P,
+                             const uint8_t *mask, size_t n) {
+  for (size_t i = 0; i < n; i += 32) {
+    __m256i m = LOAD(mask + i);
+    __m256i r = LOAD(R + i), b = LOAD(M + i), p = LOAD(P + i);
+
+    __m256i c = _mm256_cmpeq_epi8(_mm256_max_epu8(r, b), r);
+    __m256i z = _mm256_cmpeq_epi8(r, b);
+    __m256i neg = _mm256_sub_epi8(r, b);
+
+    p = _mm256_and_si256(p, SET1(~(FLAGC | FLAGZ | FLAGN)));
+    p = _mm256_or_si256(p, _mm256_and_si256(c, SET1(FLAGC)));
+    p = _mm256_or_si256(p, _mm256_and_si256(z, SET1(FLAGZ)));
+    p = _mm256_or_si256(p, _mm256_and_si256(neg, SET1(FLAGN)));
+
+    STORE(P + i, BLEND(LOAD(P + i), p, m));
+  }
+}
+
+AVX2 static void avx2bit(const uint8_t *A, const uint8_t *M, uint8_t *P,
+                         const uint8_t *mask, size_t n) {
+  for (size_t i = 0; i < n; i += 32) {
+    __m256i m = LOAD(mask + i);
+    __m256i result = _mm256_and_si256(LOAD(A + i), LOAD(M + i));
+    __m256i nv = SET1(FLAGN | FLAGV);
+    __m256i p = _mm256_andnot_si256(nv, vzn(LOAD(P + i), result));
+
+    p = _mm256_or_si256(p, _mm256_and_si256(LOAD(M + i), nv));
+    STORE(P + i, BLEND(LOAD(P + i), p, m));
+  }
+}
+
+AVX2 static void avx2step(uint8_t *dst, uint8_t *P, const uint8_t *mask,
+                          size_t n, uint8_t delta) {
+  for (size_t i = 0; i < n; i += 32) {
+    __m256i m = LOAD(mask + i);
+    __m256i v = _mm256_add_epi8(LOAD(dst + i), SET1(delta));
+
+    STORE(dst + i, BLEND(LOAD(dst + i), v, m));
+    if (P)
+      STORE(P + i, BLEND(LOAD(P + i), vzn(LOAD(P + i), v), m));
+  }
+}
+
+AVX2 static void avx2flags(uint8_t *P, const uint8_t *mask, size_t n,
+                           uint8_t and, uint8_t or) {
+  for (size_t i = 0; i < n; i += 32) {
+    __m256i p = LOAD(P + i);
+    __m256i v = _mm256_or_si256(_mm256_and_si256(p, SET1(and)), SET1(or));
+
+    STORE(P + i, BLEND(p, v, LOAD(mask + i)));
+  }
+}
+
+AVX2 static size_t avx2test(const uint8_t *P, const uint8_t *mask,
+                            uint8_t *taken, size_t n, uint8_t flag,
+                            uint8_t set) {
+  size_t count = 0;
+
+  for (size_t i = 0; i < n; i += 32) {
+    __m256i clear = _mm256_cmpeq_epi8(
+        _mm256_and_si256(LOAD(P + i), SET1(flag)), _mm256_setzero_si256());
+    __m256i t = set ? _mm256_andnot_si256(clear, LOAD(mask + i))
+                    : _mm256_and_si256(clear, LOAD(mask + i));
+
+    STORE(taken + i, t);
+    count += __builtin_popcount(_mm256_movemask_epi8(t));
+  }
+
+  return count;
+}
+
+AVX2 static void avx2account(uint64_t *cycles, uint64_t *instructions,
+                             const uint8_t *mask, size_t n, uint64_t ncycles,
+                             uint64_t ninstructions) {
+  __m256i c = _mm256_set1_epi64x(ncycles);
+  __m256i in = _mm256_set1_epi64x(ninstructions);
+
+  for (size_t i = 0; i < n; i += 4) {
+    uint32_t bytes;
+    memcpy(&bytes, mask + i, sizeof(bytes));
+    if (!bytes)
+      continue;
+
+    __m256i m = _mm256_cvtepi8_epi64(_mm_cvtsi32_si128(bytes));
+    __m256i *pc = (__m256i *)(cycles + i);
+    __m256i *pi = (__m256i *)(instructions + i);
+
+    _mm256_store_si256(
+        pc, _mm256_add_epi64(_mm256_load_si256(pc), _mm256_and_si256(c, m)));
+    _mm256_store_si256(
+        pi, _mm256_add_epi64(_mm256_load_si256(pi), _mm256_and_si256(in, m)));
+  }
+}
+
+AVX2 static uint8_t avx2uniform(const uint8_t *row, const uint8_t *mask,
+                                size_t n, uint8_t value) {
+  for (size_t i = 0; i < n; i += 32) {
+    __m256i differ = _mm256_andnot_si256(
+        _mm256_cmpeq_epi8(LOAD(row + i), SET1(value)), LOAD(mask + i));
+
+    if (!_mm256_testz_si256(differ, differ))
+      return 0;
+  }
+
+  return 1;
+}
+
+static const MOS6502LockstepOps avx2ops = {
+    "avx2",    avx2assign, avx2logic, avx2adc,     avx2sbc,    avx2compare,
+    avx2bit,   avx2step,   avx2flags, avx2test,    avx2account, avx2uniform};
+#endif
+
+// Groups of lanes sharing a PC --------------------
+struct lockstepgroup {
+  uint16_t PC;
+  uint8_t *mask; // 0xFF for the lanes in the group
+  size_t count;
+  uint64_t maxcycles; // Upper bound of the lanes' cycle counters
+
+  // Not yet added to the lanes' counters
+  uint64_t cycles;
+  uint64_t instructions;
+  uint8_t pinned;     // Split on differing code bytes, don't merge yet
+};
+
+static void *lanealloc(size_t stride, size_t size) {
+  void *ptr = aligned_alloc(LOCKSTEPALIGN, stride * size);
+  if (ptr)
+    memset(ptr, 0, stride * size);
+
+  return ptr;
+}
+
+static MOS6502LockstepGroup *addgroup(MOS6502Lockstep *ls, uint16_t pc) {
+  MOS6502LockstepGroup *groups =
+      realloc(ls->groups, (ls->ngroups + 1) * sizeof(MOS6502LockstepGroup));
+  if (!groups)
+    return NULL;
+
+  ls->groups = groups;
+  MOS6502LockstepGroup *group = &groups[ls->ngroups];
+  group->mask = lanealloc(ls->stride, 1);
+  if (!group->mask)
+    return NULL;
+
+  group->PC = pc;
+  group->count = 0;
+  group->maxcycles = 0;
+  group->cycles = group->instructions = 0;
+  group->pinned = 0;
+  ls->ngroups++;
+  return group;
+}
+
+// Add what the group ran so far to its lanes' counters
+static void flushgroup(MOS6502Lockstep *ls, MOS6502LockstepGroup *group) {
+  if (!group->cycles && !group->instructions)
+    return;
+
+  ls->ops->account(ls->cycles, ls->instructions, group->mask, ls->stride,
+                   group->cycles, group->instructions);
+  group->cycles = group->instructions = 0;
+}
+
+static void removegroup(MOS6502Lockstep *ls, size_t index) {
+  free(ls->groups[index].mask);
+  ls->groups[index] = ls->groups[--ls->ngroups];
+}
+
+// Stop every lane of a group
+static void haltgroup(MOS6502Lockstep *ls, size_t index, uint8_t reason) {
+  MOS6502LockstepGroup *group = &ls->groups[index];
+  flushgroup(ls, group);
+
+  for (size_t i = 0; i < ls->lanes; i++) {
+    if (!group->mask[i])
+      continue;
+
+    ls->PC[i] = group->PC;
+    ls->halt[i] = reason;
+  }
+
+  removegroup(ls, index);
+}
+
+// Move the lanes set in lanes into a new group at pc
+static MOS6502LockstepGroup *splitgroup(MOS6502Lockstep *ls, size_t index,
+                                        const uint8_t *lanes, size_t count,
+                                        uint16_t pc) {
+  MOS6502LockstepGroup *split = addgroup(ls, pc);
+  if (!split)
+    return NULL;
+
+  MOS6502LockstepGroup *group = &ls->groups[index];
+  flushgroup(ls, group);
+
+  for (size_t i = 0; i < ls->stride; i++) {
+    split->mask[i] = lanes[i];
+    group->mask[i] &= ~lanes[i];
+  }
+
+  split->count = count;
+  split->maxcycles = group->maxcycles;
+  group->count -= count;
+  return split;
+}
+
+// Lanes that used up their budget leave the group
+static void expire(MOS6502Lockstep *ls, MOS6502LockstepGroup *group,
+                   uint64_t deadline) {
+  uint64_t maxcycles = 0;
+  flushgroup(ls, group);
+
+  for (size_t i = 0; i < ls->lanes; i++) {
+    if (!group->mask[i])
+      continue;
+
+    if (ls->cycles[i] >= deadline) {
+      group->mask[i] = 0;
+      group->count--;
+      ls->PC[i] = group->PC;
+      ls->halt[i] = HALTNONE;
+    } else if (ls->cycles[i] > maxcycles) {
+      maxcycles = ls->cycles[i];
+    }
+  }
+
+  group->maxcycles = maxcycles;
+}
+
+// Groups that reached the same PC run together again
+static void mergegroups(MOS6502Lockstep *ls) {
+  for (size_t i = 0; i < ls->ngroups; i++) {
+    for (size_t j = i + 1; j < ls->ngroups;) {
+      MOS6502LockstepGroup *a = &ls->groups[i], *b = &ls->groups[j];
+      if (a->PC != b->PC || a->pinned || b->pinned) {
+        j++;
+        continue;
+      }
+
+      flushgroup(ls, a);
+      flushgroup(ls, b);
+      for (size_t l = 0; l < ls->stride; l++)
+        a->mask[l] |= b->mask[l];
+
+      a->count += b->count;
+      if (b->maxcycles > a->maxcycles)
+        a->maxcycles = b->maxcycles;
+      removegroup(ls, j);
+    }
+  }
+}
+
+// Memory ------------------------------------------
+static const uint8_t *row(MOS6502Lockstep *ls, uint16_t addr) {
+  uint8_t *page = ls->pages[addr >> 8];
+
+  return page ? page + (addr & 0xFF) * ls->stride : ls->zero;
+}
+
+static uint8_t *writablerow(MOS6502Lockstep *ls, uint16_t addr) {
+  uint8_t **page = &ls->pages[addr >> 8];
+
+  if (!*page) {
+    *page = lanealloc(ls->stride, PAGESIZE);
+    if (!*page)
+      return NULL;
+  }
+
+  return *page + (addr & 0xFF) * ls->stride;
+}
+
+uint8_t mos6502_lockstepread(MOS6502Lockstep *ls, size_t lane, uint16_t addr) {
+  return row(ls, addr)[lane];
+}
+
+void mos6502_lockstepwrite(MOS6502Lockstep *ls, size_t lane, uint16_t addr,
+                           uint8_t data) {
+  uint8_t *r = writablerow(ls, addr);
+  if (!r)
+    return;
+
+  r[lane] = data;
+  ls->diverged[addr >> 8] = 1;
+}
+
+// Same bytes in every lane
+static uint8_t broadcast(MOS6502Lockstep *ls, uint16_t addr, uint8_t data) {
+  uint8_t *r = writablerow(ls, addr);
+  if (!r)
+    return 0;
+
+  memset(r, data, ls->stride);
+  return 1;
+}
+
+uint32_t mos6502_lockstepload(MOS6502Lockstep *ls, uint16_t addr,
+                              const uint8_t *bytes, uint32_t size) {
+  if (!ls || !bytes || addr + size > RAM)
+    return 0;
+
+  uint32_t amount = 0;
+  while (amount < size && broadcast(ls, addr + amount, bytes[amount]))
+    amount++;
+
+  return amount;
+}
+
+uint8_t mos6502_lockstepreset(MOS6502Lockstep *ls) {
+  if (!ls || ls->ngroups != 1)
+    return 0;
+
+  // Like mos6502_reset
+  ls->groups[0].PC = row(ls, RESETVL)[0] | row(ls, RESETVH)[0] << 8;
+  for (size_t i = 0; i < ls->lanes; i++) {
+    ls->A[i] = ls->X[i] = ls->Y[i] = 0;
+    ls->SP[i] -= 3;
+    ls->P[i] |= FLAGI;
+  }
+  return 1;
+}
+
+// Per lane addresses: gather into ls->operand, scatter back from a row
+static void gather(MOS6502Lockstep *ls, const uint8_t *mask) {
+  for (size_t i = 0; i < ls->lanes; i++)
+    if (mask[i])
+      ls->operand[i] = row(ls, ls->addr[i])[i];
+}
+
+static void scatter(MOS6502Lockstep *ls, const uint8_t *mask,
+                    const uint8_t *values) {
+  for (size_t i = 0; i < ls->lanes; i++) {
+    if (!mask[i])
+      continue;
+
+    uint8_t *r = writablerow(ls, ls->addr[i]);
+    if (r)
+      r[i] = values[i];
+    ls->diverged[ls->addr[i] >> 8] = 1;
+  }
+}
+
+// The stack pointer is per lane, but usually the same in every lane of a
+// group, in which case the stack is a row too
+static size_t firstlane(const uint8_t *mask) {
+  size_t first = 0;
+  while (!mask[first])
+    first++;
+
+  return first;
+}
+
+static uint8_t uniformsp(MOS6502Lockstep *ls, const uint8_t *mask,
+                         uint8_t *sp) {
+  *sp = ls->SP[firstlane(mask)];
+  return ls->ops->uniform(ls->SP, mask, ls->stride, *sp);
+}
+
+static void push(MOS6502Lockstep *ls, const uint8_t *mask,
+                 const uint8_t *values) {
+  uint8_t sp;
+
+  if (uniformsp(ls, mask, &sp)) {
+    uint8_t *r = writablerow(ls, STACKBASE | sp);
+    if (r)
+      ls->ops->assign(r, values, NULL, mask, ls->stride);
+    ls->diverged[STACKBASE >> 8] = 1;
+  } else {
+    for (size_t i = 0; i < ls->lanes; i++)
+      if (mask[i])
+        ls->addr[i] = STACKBASE | ls->SP[i];
+    scatter(ls, mask, values);
+  }
+
+  ls->ops->step(ls->SP, NULL, mask, ls->stride, 0xFF);
+}
+
+// Pulled values, a memory row or ls->operand
+static const uint8_t *pull(MOS6502Lockstep *ls, const uint8_t *mask) {
+  uint8_t sp;
+
+  ls->ops->step(ls->SP, NULL, mask, ls->stride, 1);
+  if (uniformsp(ls, mask, &sp))
+    return row(ls, STACKBASE | sp);
+
+  for (size_t i = 0; i < ls->lanes; i++)
+    if (mask[i])
+      ls->addr[i] = STACKBASE | ls->SP[i];
+  gather(ls, mask);
+  return ls->operand;
+}
+
+// Init --------------------------------------------
+MOS6502Lockstep *mos6502_lockstepinit(size_t lanes) {
+  if (!lanes)
+    return NULL;
+
+  MOS6502Lockstep *ls = calloc(1, sizeof(MOS6502Lockstep));
+  if (!ls)
+    return NULL;
+
+  mos6502_aluinit();
+
+  ls->lanes = lanes;
+  ls->stride = (lanes + LOCKSTEPALIGN - 1) & ~(size_t)(LOCKSTEPALIGN - 1);
+  ls->ops = &scalarops;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+  if (__builtin_cpu_supports("avx2"))
+    ls->ops = &avx2ops;
+#endif
+
+  ls->A = lanealloc(ls->stride, 1);
+  ls->X = lanealloc(ls->stride, 1);
+  ls->Y = lanealloc(ls->stride, 1);
+  ls->SP = lanealloc(ls->stride, 1);
+  ls->P = lanealloc(ls->stride, 1);
+  ls->PC = lanealloc(ls->stride, sizeof(uint16_t));
+  ls->cycles = lanealloc(ls->stride, sizeof(uint64_t));
+  ls->instructions = lanealloc(ls->stride, sizeof(uint64_t));
+  ls->halt = lanealloc(ls->stride, 1);
+  ls->zero = lanealloc(ls->stride, 1);
+  ls->operand = lanealloc(ls->stride, 1);
+  ls->taken = lanealloc(ls->stride, 1);
+  ls->addr = lanealloc(ls->stride, sizeof(uint16_t));
+
+  MOS6502LockstepGroup *group = NULL;
+  if (ls->A && ls->X && ls->Y && ls->SP && ls->P && ls->PC && ls->cycles &&
+      ls->instructions && ls->halt && ls->zero && ls->operand && ls->taken &&
+      ls->addr)
+    group = addgroup(ls, START);
+
+  if (!group || !broadcast(ls, RESETVL, STARTL) ||
+      !broadcast(ls, RESETVH, STARTH)) {
+    mos6502_lockstepuninit(ls);
+    return NULL;
+  }
+
+  memset(group->mask, 0xFF, lanes); // SP starts at 0, like mos6502_init
+  group->count = lanes;
+
+  return ls;
+}
+
+void mos6502_lockstepuninit(MOS6502Lockstep *ls) {
+  if (!ls)
+    return;
+
+  while (ls->ngroups)
+    removegroup(ls, 0);
+
+  for (int i = 0; i < RAM / PAGESIZE; i++)
+    free(ls->pages[i]);
+
+  free(ls->groups);
+  free(ls->A);
+  free(ls->X);
+  free(ls->Y);
+  free(ls->SP);
+  free(ls->P);
+  free(ls->PC);
+  free(ls->cycles);
+  free(ls->instructions);
+  free(ls->halt);
+  free(ls->zero);
+  free(ls->operand);
+  free(ls->taken);
+  free(ls->addr);
+  free(ls);
+}
+
+void mos6502_lockstepsethaltop(MOS6502Lockstep *ls, uint8_t opcode) {
+  ls->haltops[opcode >> 3] |= 1 << (opcode & 7);
+}
+
+const char *mos6502_lockstepisa(MOS6502Lockstep *ls) { return ls->ops->isa; }
+
+// Execution ---------------------------------------
+
+// One operation per handler in opcodes.def
+typedef enum lockstepop {
+  LS_illg = 0, LS_lda, LS_ldx, LS_ldy, LS_sta, LS_stx, LS_sty,
+  LS_tax, LS_tay, LS_txa, LS_tya, LS_tsx, LS_txs, LS_pha, LS_php, LS_pla,
+  LS_plp, LS_and, LS_eor, LS_ora, LS_bit, LS_adc, LS_sbc, LS_cmp, LS_cpx,
+  LS_cpy, LS_inc, LS_inx, LS_iny, LS_dec, LS_dex, LS_dey, LS_jmp, LS_jsr,
+  LS_rts, LS_brk, LS_rti, LS_bcc, LS_bcs, LS_beq, LS_bmi, LS_bne, LS_bpl,
+  LS_bvc, LS_bvs, LS_clc, LS_cld, LS_cli, LS_clv, LS_sec, LS_sed, LS_sei, LS_nop
+} MOS6502LockstepOp;
+
+static const uint8_t lockstepops[MAXOPCODESTABLE] = {
+#define OPCODE(opcode, mnemonic, exec, mode, cycles, pagecross)                \
+  [opcode] = LS_##exec,
+#include "opcodes.def"
+#undef OPCODE
+};
+
+// Status flag and the value that takes the branch
+static const uint8_t branchflags[][2] = {
+    [LS_bcc] = {FLAGC, 0}, [LS_bcs] = {FLAGC, 1}, [LS_beq] = {FLAGZ, 1},
+    [LS_bmi] = {FLAGN, 1}, [LS_bne] = {FLAGZ, 0}, [LS_bpl] = {FLAGN, 0},
+    [LS_bvc] = {FLAGV, 0}, [LS_bvs] = {FLAGV, 1}};
+
+static uint8_t lockstepfetch(MOS6502Lockstep *ls, size_t index, uint16_t addr,
+                             uint8_t *byte) {
+  MOS6502LockstepGroup *group = &ls->groups[index];
+  const uint8_t *r = row(ls, addr);
+
+  if (!ls->diverged[addr >> 8]) {
+    *byte = r[0];
+    return 1;
+  }
+
+  size_t first = 0;
+  while (!group->mask[first])
+    first++;
+
+  *byte = r[first];
+  if (ls->ops->uniform(r, group->mask, ls->stride, *byte))
+    return 1;
+
+  // Lanes holding other bytes here continue as their own group
+  size_t count = 0;
+  for (size_t i = 0; i < ls->stride; i++) {
+    ls->taken[i] = group->mask[i] && r[i] != *byte ? 0xFF : 0x00;
+    count += ls->taken[i] & 1;
+  }
+
+  MOS6502LockstepGroup *split =
+      splitgroup(ls, index, ls->taken, count, group->PC);
+  if (split) {
+    split->pinned = 1;
+    ls->groups[index].pinned = 1;
+  }
+  return 0;
+}
+
+// Split a group whose lanes continue at different PCs (ls->addr)
+static void dividegroup(MOS6502Lockstep *ls, size_t index) {
+  while (1) {
+    MOS6502LockstepGroup *group = &ls->groups[index];
+
+    size_t first = 0;
+    while (!group->mask[first])
+      first++;
+
+    uint16_t pc = ls->addr[first];
+    size_t count = 0;
+    for (size_t i = 0; i < ls->stride; i++) {
+      ls->taken[i] = group->mask[i] && ls->addr[i] != pc ? 0xFF : 0x00;
+      count += ls->taken[i] & 1;
+    }
+
+    group->PC = pc;
+    if (!count || !splitgroup(ls, index, ls->taken, count, pc))
+      return;
+
+    // The split lanes get sorted out in the new group
+    index = ls->ngroups - 1;
+  }
+}
+
+// Continue every lane at (high << 8) | low, split when they differ
+static void jumplanes(MOS6502Lockstep *ls, size_t index, const uint8_t *low,
+                      const uint8_t *high) {
+  MOS6502LockstepGroup *group = &ls->groups[index];
+  const uint8_t *mask = group->mask;
+  size_t first = firstlane(mask);
+
+  // Same target everywhere, the usual case
+  if (ls->ops->uniform(low, mask, ls->stride, low[first]) &&
+      ls->ops->uniform(high, mask, ls->stride, high[first])) {
+    group->PC = (high[first] << 8) | low[first];
+    return;
+  }
+
+  for (size_t i = 0; i < ls->lanes; i++)
+    if (mask[i])
+      ls->addr[i] = (high[i] << 8) | low[i];
+  dividegroup(ls, index);
+}
+
+// Execute one instruction for the group at index
+static void lockstepstep(MOS6502Lockstep *ls, size_t index) {
+  MOS6502LockstepGroup *group = &ls->groups[index];
+  const MOS6502LockstepOps *ops = ls->ops;
+  uint16_t pc = group->PC;
+  uint8_t opcode, lo = 0, hi = 0;
+
+  if (!lockstepfetch(ls, index, pc, &opcode))
+    return;
+
+  if (ls->haltops[opcode >> 3] & (1 << (opcode & 7))) {
+    haltgroup(ls, index, HALTOPCODE);
+    return;
+  }
+
+  MOS6502Instruction *instruction = &opcodes[opcode];
+  if (instruction->mode >= IND) {
+    haltgroup(ls, index, HALTILLEGAL);
+    return;
+  }
+
+  uint8_t length = 1;
+  if (instruction->mode == IMM || instruction->mode == ZP0 ||
+      instruction->mode == ZP0X || instruction->mode == ZP0Y ||
+      instruction->mode == RELT)
+    length = 2;
+  else if (instruction->mode >= ABS)
+    length = 3;
+
+  if ((length > 1 && !lockstepfetch(ls, index, pc + 1, &lo)) ||
+      (length > 2 && !lockstepfetch(ls, index, pc + 2, &hi)))
+    return;
+
+  group = &ls->groups[index];
+  group->pinned = 0;
+  uint8_t *mask = group->mask;
+  size_t n = ls->stride;
+
+  group->cycles += instruction->cycles;
+  group->instructions++;
+  group->maxcycles += instruction->cycles;
+
+  // Effective address, the same for every lane unless indexed
+  uint16_t addr = 0;
+  uint8_t perlane = 0;
+  const uint8_t *M = NULL;
+
+  switch (instruction->mode) {
+    case IMM:
+      memset(ls->operand, lo, n);
+      M = ls->operand;
+      break;
+    case ZP0:
+      addr = lo;
+      break;
+    case ABS:
+      addr = (hi << 8) | lo;
+      break;
+    case ZP0X:
+    case ZP0Y:
+    case ABSX:
+    case ABSY: {
+      uint8_t *index = instruction->mode == ZP0X || instruction->mode == ABSX
+                           ? ls->X
+                           : ls->Y;
+      uint16_t base = instruction->mode <= ZP0Y ? lo : (hi << 8) | lo;
+      uint8_t crossed = 0;
+
+      for (size_t i = 0; i < ls->lanes; i++) {
+        if (!mask[i])
+          continue;
+
+        // Zero page indexing wraps within the zero page
+        ls->addr[i] = instruction->mode <= ZP0Y ? (uint8_t)(base + index[i])
+                                                : base + index[i];
+        if (instruction->pagecross && instruction->mode >= ABSX &&
+            (base & 0xFF00) != (ls->addr[i] & 0xFF00)) {
+          ls->cycles[i]++;
+          crossed = 1;
+        }
+      }
+
+      group->maxcycles += crossed;
+      perlane = 1;
+      break;
+    }
+    default:
+      break;
+  }
+
+  uint8_t memory = instruction->mode >= ZP0 && instruction->mode != RELT;
+  if (memory && !perlane)
+    M = row(ls, addr);
+  else if (perlane) {
+    gather(ls, mask);
+    M = ls->operand;
+  }
+
+  uint8_t op = lockstepops[opcode];
+  uint16_t next = pc + length;
+
+  switch (op) {
+    case LS_lda:
+      ops->assign(ls->A, M, ls->P, mask, n);
+      break;
+    case LS_ldx:
+      ops->assign(ls->X, M, ls->P, mask, n);
+      break;
+    case LS_ldy:
+      ops->assign(ls->Y, M, ls->P, mask, n);
+      break;
+
+    case LS_sta:
+    case LS_stx:
+    case LS_sty: {
+      uint8_t *reg = op == LS_sta ? ls->A : op == LS_stx ? ls->X : ls->Y;
+
+      if (perlane) {
+        scatter(ls, mask, reg);
+      } else {
+        uint8_t *r = writablerow(ls, addr);
+        if (r)
+          ops->assign(r, reg, NULL, mask, n);
+        ls->diverged[addr >> 8] = 1;
+      }
+      break;
+    }
+
+    case LS_tax:
+      ops->assign(ls->X, ls->A, ls->P, mask, n);
+      break;
+    case LS_tay:
+      ops->assign(ls->Y, ls->A, ls->P, mask, n);
+      break;
+    case LS_txa:
+      ops->assign(ls->A, ls->X, ls->P, mask, n);
+      break;
+    case LS_tya:
+      ops->assign(ls->A, ls->Y, ls->P, mask, n);
+      break;
+    case LS_tsx:
+      ops->assign(ls->X, ls->SP, ls->P, mask, n);
+      break;
+    case LS_txs:
+      ops->assign(ls->SP, ls->X, NULL, mask, n);
+      break;
+
+    case LS_pha:
+      push(ls, mask, ls->A);
+      break;
+    case LS_php:
+      push(ls, mask, ls->P);
+      break;
+    case LS_pla:
+      ops->assign(ls->A, pull(ls, mask), ls->P, mask, n);
+      break;
+    case LS_plp:
+      ops->assign(ls->P, pull(ls, mask), NULL, mask, n);
+      break;
+
+    case LS_and:
+      ops->logic(ls->A, M, ls->P, mask, n, LOGICAND);
+      break;
+    case LS_ora:
+      ops->logic(ls->A, M, ls->P, mask, n, LOGICORA);
+      break;
+    case LS_eor:
+      ops->logic(ls->A, M, ls->P, mask, n, LOGICEOR);
+      break;
+    case LS_bit:
+      ops->bit(ls->A, M, ls->P, mask, n);
+      break;
+
+    case LS_adc:
+      ops->adc(ls->A, M, ls->P, mask, n);
+      break;
+    case LS_sbc:
+      ops->sbc(ls->A, M, ls->P, mask, n);
+      break;
+    case LS_cmp:
+      ops->compare(ls->A, M, ls->P, mask, n);
+      break;
+    case LS_cpx:
+      ops->compare(ls->X, M, ls->P, mask, n);
+      break;
+    case LS_cpy:
+      ops->compare(ls->Y, M, ls->P, mask, n);
+      break;
+
+    case LS_inc:
+    case LS_dec: {
+      uint8_t delta = op == LS_inc ? 1 : 0xFF;
+
+      if (perlane) {
+        ops->step(ls->operand, ls->P, mask, n, delta);
+        scatter(ls, mask, ls->operand);
+      } else {
+        uint8_t *r = writablerow(ls, addr);
+        if (r)
+          ops->step(r, ls->P, mask, n, delta);
+        ls->diverged[addr >> 8] = 1;
+      }
+      break;
+    }
+    case LS_inx:
+      ops->step(ls->X, ls->P, mask, n, 1);
+      break;
+    case LS_iny:
+      ops->step(ls->Y, ls->P, mask, n, 1);
+      break;
+    case LS_dex:
+      ops->step(ls->X, ls->P, mask, n, 0xFF);
+      break;
+    case LS_dey:
+      ops->step(ls->Y, ls->P, mask, n, 0xFF);
+      break;
+
+    case LS_bcc:
+    case LS_bcs:
+    case LS_beq:
+    case LS_bmi:
+    case LS_bne:
+    case LS_bpl:
+    case LS_bvc:
+    case LS_bvs: {
+      uint16_t target = pc + (int8_t)lo + 2;
+      uint8_t penalty = 1 + ((next & 0xFF00) != (target & 0xFF00));
+      size_t taken = ops->test(ls->P, mask, ls->taken, n, branchflags[op][0],
+                               branchflags[op][1]);
+
+      if (taken == group->count) {
+        group->cycles += penalty;
+        group->maxcycles += penalty;
+        group->PC = target;
+        return;
+      }
+
+      group->PC = next;
+      if (taken) {
+        MOS6502LockstepGroup *split =
+            splitgroup(ls, index, ls->taken, taken, target);
+        if (split) {
+          split->cycles += penalty;
+          split->maxcycles += penalty;
+        }
+      }
+      return;
+    }
+
+    case LS_jmp:
+      group->PC = START | addr;
+      return;
+    case LS_jsr:
+      memset(ls->operand, next >> 8, n);
+      push(ls, mask, ls->operand);
+      memset(ls->operand, next & 0xFF, n);
+      push(ls, mask, ls->operand);
+      group->PC = START | addr;
+      return;
+    case LS_brk:
+      memset(ls->operand, (pc + 2) >> 8, n);
+      push(ls, mask, ls->operand);
+      memset(ls->operand, (pc + 2) & 0xFF, n);
+      push(ls, mask, ls->operand);
+      for (size_t i = 0; i < ls->lanes; i++)
+        ls->taken[i] = ls->P[i] | 0x30;
+      push(ls, mask, ls->taken);
+      ops->flags(ls->P, mask, n, 0xFF, FLAGI);
+      jumplanes(ls, index, row(ls, IRQVL), row(ls, IRQVH));
+      return;
+    case LS_rti:
+      ops->assign(ls->taken, pull(ls, mask), NULL, mask, n);
+      for (size_t i = 0; i < ls->lanes; i++)
+        if (mask[i])
+          ls->P[i] = (ls->taken[i] & ~0x10) | (ls->P[i] & 0x10); // B stays
+      /* fallthrough */
+    case LS_rts: {
+      ops->assign(ls->taken, pull(ls, mask), NULL, mask, n);
+      jumplanes(ls, index, ls->taken, pull(ls, mask));
+      return;
+    }
+
+    case LS_clc:
+      ops->flags(ls->P, mask, n, ~FLAGC, 0);
+      break;
+    case LS_cld:
+      ops->flags(ls->P, mask, n, ~FLAGD, 0);
+      break;
+    case LS_cli:
+      ops->flags(ls->P, mask, n, ~FLAGI, 0);
+      break;
+    case LS_clv:
+      ops->flags(ls->P, mask, n, ~FLAGV, 0);
+      break;
+    case LS_sec:
+      ops->flags(ls->P, mask, n, 0xFF, FLAGC);
+      break;
+    case LS_sed:
+      ops->flags(ls->P, mask, n, 0xFF, FLAGD);
+      break;
+    case LS_sei:
+      ops->flags(ls->P, mask, n, 0xFF, FLAGI);
+      break;
+
+    case LS_illg:
+    case LS_nop:
+      break;
+  }
+
+  group->PC = next;
+}
+
+void mos6502_locksteprun(MOS6502Lockstep *ls, uint64_t deadline) {
+  while (ls->ngroups) {
+    mergegroups(ls);
+
+    // Lowest PC first, so groups that split on a forward branch can meet
+    // again where the paths join. A group looping back runs first until
+    // it leaves the loop or reaches the deadline.
+    size_t index = 0;
+    for (size_t i = 1; i < ls->ngroups; i++)
+      if (ls->groups[i].PC < ls->groups[index].PC)
+        index = i;
+
+    MOS6502LockstepGroup *group = &ls->groups[index];
+    if (group->maxcycles >= deadline)
+      expire(ls, group, deadline);
+
+    if (!group->count) {
+      removegroup(ls, index);
+      continue;
+    }
+
+    lockstepstep(ls, index);
+  }
+}
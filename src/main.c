@@ -3,20 +3,221 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 #include <string.h>
 
 #include "6502.h"
+#include "assembler.h"
+#include "batch.h"
+#include "cfg.h"
 #include "debug.h"
+#include "loader.h"
+#include "mapper.h"
+#include "profile.h"
+#include "replay.h"
+#include "scheduler.h"
+#include "trace.h"
 
 #define NOP 0xEA
+#define BRK 0x00
 #define INVALID 0x7FFF
-#define OPTS "::p:"
+#define OPTS "::p:a:Hn:c:t:e:i:E:B:o:j:L:T:D:P:m:N:R:F:G:"
+
+static const char *enginesstr[] = {"interpreter", "predecode", "threaded",
+                                    "jit"};
+static const char *fusionsstr[] = {"", "LDA/STA", "CMP/BNE", "DEX/BNE",
+                                   "CLC/ADC", "INX/CPX/BNE"};
+
+// Exit and input ports, the rest of their pages behave like RAM
+static uint16_t exitport = 0;
+static uint16_t inputport = 0;
+static uint8_t useexitport = 0;
+static uint8_t useinputport = 0;
+static uint8_t portmemory[RAM];
+
+// Reads of the input port return the next byte of stdin, 0xFF at the end
+static uint8_t portread(MOS6502 *cpu, uint16_t addr) {
+  if (useinputport && addr == inputport) {
+    int c = getchar();
+    return c == EOF ? 0xFF : c;
+  }
+
+  return portmemory[addr];
+}
+
+static uint8_t portwrite(MOS6502 *cpu, uint16_t addr, uint8_t data) {
+  if (useexitport && addr == exitport)
+    cpu->halt = HALTEXTERNAL;
+
+  portmemory[addr] = data;
+  return 1;
+}
+
+static void mapport(MOS6502 *cpu, uint16_t port) {
+  for (int i = 0; i < PAGESIZE; i++)
+    portmemory[(port & 0xFF00) | i] = mos6502_read(cpu, (port & 0xFF00) | i);
+  mos6502_mapio(cpu, port, 1, portread, portwrite);
+}
+
+// Timer raising an NMI every nmiperiod cycles
+static uint64_t nmiperiod = 0;
+static uint64_t nmicount = 0;
+
+static void nmitimer(MOS6502 *cpu, void *data) {
+  uint64_t *when = data;
+
+  mos6502_interrupt(cpu, INTNMI);
+  nmicount++;
+
+  *when += nmiperiod;
+  mos6502_schedule(cpu, *when, nmitimer, when);
+}
+
+static double elapsedseconds(struct timespec *start, struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) +
+         (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-p program | -a source] [-H] [-n instructions] [-c cycles] "
+          "[-t target pc] [-e exit port] [-i input port] "
+          "[-E interpreter|predecode|threaded|jit] [-T trace] "
+          "[-P folded stacks] [-m uxrom|bank8] [-N nmi period] "
+          "[-R record log | -F replay log] [-G cfg.dot]\n"
+          "       %s -B manifest [-o results] [-j threads] [-E engine] "
+          "[-L lanes]\n"
+          "       %s -D trace\n",
+          name, name, name);
+}
+
+// The whole file, NUL terminated, NULL on failure
+static char *readsource(const char *path, size_t *size) {
+  FILE *file = fopen(path, "rb");
+  if (!file)
+    return NULL;
+
+  struct stat st;
+  char *source = NULL;
+
+  if (!fstat(fileno(file), &st) && (source = malloc(st.st_size + 1))) {
+    *size = fread(source, 1, st.st_size, file);
+    source[*size] = '\0';
+  }
+
+  fclose(file);
+  return source;
+}
+
+static void runheadless(MOS6502 *cpu, uint64_t maxinstructions,
+                        uint64_t maxcycles) {
+  do {
+    uint64_t slice = UINT64_MAX;
+
+    if (maxcycles) {
+      if (cpu->cycles >= maxcycles)
+        break;
+      slice = maxcycles - cpu->cycles;
+    }
+
+    // Every instruction takes at least 2 cycles, so this slice can't
+    // retire more instructions than are left in the budget
+    if (maxinstructions) {
+      if (cpu->instructions >= maxinstructions)
+        break;
+      uint64_t left = 2 * (maxinstructions - cpu->instructions);
+      slice = left < slice ? left : slice;
+    }
+
+    mos6502_run(cpu, slice);
+  } while (!cpu->halt);
+}
+
+static void report(MOS6502 *cpu, const char *foldedpath) {
+  printf("\n");
+  if (!mos6502_profilereport(cpu, foldedpath))
+    printfc(RED, "Error: can't write '%s'!\n", foldedpath);
+}
+
+// Share of the instructions run as superinstructions, and how often each
+// sequence ran through without being split
+static void reportfusion(MOS6502 *cpu) {
+  MOS6502Fusion *fusion = &cpu->fusion;
+  uint64_t sequences = 0;
+
+  for (int kind = FUSENONE + 1; kind < FUSIONS; kind++)
+    sequences += fusion->runs[kind] + fusion->splits[kind];
+  if (!sequences)
+    return;
+
+  printfc(WHITE, "[-] Fused: %" PRIu64 " instructions (%.2f%%)\n",
+          fusion->instructions,
+          cpu->instructions ? 100.0 * fusion->instructions / cpu->instructions
+                            : 0);
+
+  for (int kind = FUSENONE + 1; kind < FUSIONS; kind++) {
+    uint64_t total = fusion->runs[kind] + fusion->splits[kind];
+    if (total)
+      printfc(WHITE, "    %-12s %" PRIu64 " runs, %" PRIu64
+              " split (%.2f%% hits)\n", fusionsstr[kind], fusion->runs[kind],
+              fusion->splits[kind], 100.0 * fusion->runs[kind] / total);
+  }
+}
+
+static int parseengine(const char *name, MOS6502Engine *engine) {
+  for (size_t i = 0; i < sizeof(enginesstr) / sizeof(enginesstr[0]); i++) {
+    if (!strcmp(name, enginesstr[i])) {
+      *engine = i;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static const char *stopreason(MOS6502 *cpu) {
+  switch (cpu->halt) {
+    case HALTNONE:
+      return "Budget";
+    case HALTILLEGAL:
+      return "Illegal opcode";
+    case HALTOPCODE:
+      return opcodes[mos6502_read(cpu, cpu->PC)].mnemonic;
+    case HALTBREAK:
+      return "Target PC";
+    case HALTEXTERNAL:
+      return "Exit port";
+    case HALTIDLE:
+      return "Idle loop";
+    case HALTREPLAY:
+      return "Replay diverged";
+  }
+
+  return "Unknown";
+}
 
 int main(int argc, char **argv) {
 
   // Parse Args
   char *programpath = NULL;
+  char *sourcepath = NULL;
+  uint8_t headless = 0;
+  uint64_t maxinstructions = 0;
+  uint64_t maxcycles = 0;
+  int32_t target = NOBREAKPOINT;
+  MOS6502Engine engine = INTERPRETER;
+  char *manifest = NULL;
+  char *results = NULL;
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t lanes = 0;
+  char *tracepath = NULL;
+  char *dumppath = NULL;
+  char *foldedpath = NULL;
+  const MOS6502MapperKind *mapper = NULL;
+  char *recordpath = NULL;
+  char *replaypath = NULL;
+  char *cfgpath = NULL;
   int option = 0;
 
   while ((option = getopt(argc, argv, OPTS)) != -1) {
@@ -24,48 +225,292 @@ int main(int argc, char **argv) {
       case 'p':
         programpath = optarg;
         break;
+      case 'a':
+        sourcepath = optarg;
+        break;
+      case 'H':
+        headless = 1;
+        break;
+      case 'n':
+        maxinstructions = strtoull(optarg, NULL, 0);
+        break;
+      case 'c':
+        maxcycles = strtoull(optarg, NULL, 0);
+        break;
+      case 't':
+        target = strtoul(optarg, NULL, 0) & 0xFFFF;
+        break;
+      case 'e':
+        exitport = strtoul(optarg, NULL, 0) & 0xFFFF;
+        useexitport = 1;
+        break;
+      case 'i':
+        inputport = strtoul(optarg, NULL, 0) & 0xFFFF;
+        useinputport = 1;
+        break;
+      case 'E':
+        if (!parseengine(optarg, &engine)) {
+          fprintf(stderr, "Unknown engine: %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'B':
+        manifest = optarg;
+        break;
+      case 'o':
+        results = optarg;
+        break;
+      case 'j':
+        threads = strtol(optarg, NULL, 0);
+        break;
+      case 'L':
+        lanes = strtoul(optarg, NULL, 0);
+        break;
+      case 'T':
+        tracepath = optarg;
+        break;
+      case 'D':
+        dumppath = optarg;
+        break;
+      case 'P':
+        foldedpath = optarg;
+        break;
+      case 'm':
+        mapper = mos6502_mapperkind(optarg);
+        if (!mapper) {
+          fprintf(stderr, "Unknown mapper: %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'N':
+        nmiperiod = strtoull(optarg, NULL, 0);
+        break;
+      case 'R':
+        recordpath = optarg;
+        break;
+      case 'F':
+        replaypath = optarg;
+        break;
+      case 'G':
+        cfgpath = optarg;
+        break;
       case ':':
         fprintf(stderr, "Missing argument!\n");
         exit(EXIT_FAILURE);
       case '?':
-        fprintf(stderr, "Usage: %s [-p program]\n", argv[0]);
+        usage(argv[0]);
         exit(EXIT_FAILURE);
     }
   }
 
-  // Init
-  size_t programsize = getprogramsize(programpath);
-  uint8_t programbytes[programsize];
-  memset(&programbytes, 0, sizeof(programbytes));
+  // Trace Dump
+  if (dumppath) {
+    int64_t records = mos6502_tracedump(dumppath);
+    if (records < 0) {
+      printfc(RED, "Error: '%s' is not a trace file!\n", dumppath);
+      exit(EXIT_FAILURE);
+    }
 
-  FILE *file = fopen(programpath, "rb");
-  if (!file) {
-    printfc(RED, "Error: 'open file' failed!\n");
-    exit(EXIT_FAILURE);
+    printfc(WHITE, "[-] Records: %" PRId64 "\n", records);
+    return EXIT_SUCCESS;
   }
 
-  printfc(WHITE, "[-] Program: %s\n", programpath);
-  printfc(WHITE, "[-] Size: %zu bytes\n\n\n", programsize);
+  // Batch Run
+  if (manifest) {
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int njobs = mos6502_batch(manifest, results, threads, engine, lanes);
+    clock_gettime(CLOCK_MONOTONIC, &end);
 
-  MOS6502 *cpu = mos6502_init();
+    if (njobs < 0)
+      exit(EXIT_FAILURE);
 
-  fread(&programbytes, programsize, sizeof(uint8_t), file);
-  size_t nbytes = mos6502_loadbytes(cpu, programbytes, programsize);
-  if (nbytes != programsize) {
-    printfc(RED, "Error: 'load bytes' failed! (%d bytes)\n", nbytes);
+    if (results) {
+      printfc(WHITE, "[-] Jobs: %d\n", njobs);
+      printfc(WHITE, "[-] Threads: %d\n", threads);
+      printfc(WHITE, "[-] Elapsed: %.6f s\n", elapsedseconds(&start, &end));
+    }
+
+    return EXIT_SUCCESS;
+  }
+
+  if (!programpath == !sourcepath || (sourcepath && mapper) ||
+      (recordpath && replaypath)) {
+    usage(argv[0]);
     exit(EXIT_FAILURE);
   }
 
+  // Init
+  MOS6502Program *program = NULL;
+  MOS6502 *cpu = mos6502_init(engine);
+
+  if (sourcepath) {
+    size_t size = 0;
+    char *source = readsource(sourcepath, &size);
+    if (!source) {
+      printfc(RED, "Error: 'open file' failed!\n");
+      exit(EXIT_FAILURE);
+    }
+
+    // Assembled at 0 and placed at START, like the samples
+    MOS6502AsmError error;
+    int32_t assembled = mos6502_assembleinto(cpu, START, source, size, &error);
+    free(source);
+
+    if (assembled < 0) {
+      printfc(RED, "Error: %s:%" PRIu32 ": %s\n", sourcepath, error.line,
+              error.message);
+      exit(EXIT_FAILURE);
+    }
+
+    printfc(WHITE, "[-] Program: %s (assembled)\n", sourcepath);
+    printfc(WHITE, "[-] Size: %" PRId32 " bytes\n\n\n", assembled);
+  } else if (mapper) {
+    // Banks are read on demand, the image can be any size
+    if (!mos6502_mapperstart(cpu, mapper, programpath)) {
+      printfc(RED, "Error: 'open file' failed!\n");
+      exit(EXIT_FAILURE);
+    }
+
+    printfc(WHITE, "[-] Program: %s (%s, %" PRIu32 " banks)\n", programpath,
+            mapper->name, cpu->mapper->nbanks);
+    printfc(WHITE, "[-] Size: %" PRIu64 " bytes\n\n\n",
+            cpu->mapper->filesize);
+  } else {
+    program = mos6502_programopen(programpath);
+    if (!program) {
+      printfc(RED, "Error: 'open file' failed!\n");
+      exit(EXIT_FAILURE);
+    }
+
+    printfc(WHITE, "[-] Program: %s (%s)\n", programpath,
+            imageformatsstr[program->format]);
+    printfc(WHITE, "[-] Size: %zu bytes\n\n\n", program->size);
+
+    if (!mos6502_programmap(cpu, program)) {
+      printfc(RED, "Error: 'load bytes' failed! (%zu bytes)\n",
+              program->size);
+      exit(EXIT_FAILURE);
+    }
+  }
+
   // Writing in some areas for testing
-  cpu->bus.write(cpu, 0x0000, 0xd5);
-  cpu->bus.write(cpu, 0x0001, 0xae);
-  cpu->bus.write(cpu, 0x0002, 0xc9);
+  mos6502_write(cpu, 0x0000, 0xd5);
+  mos6502_write(cpu, 0x0001, 0xae);
+  mos6502_write(cpu, 0x0002, 0xc9);
+
+  mos6502_write(cpu, 0x4e20, 0xd4);
+  mos6502_write(cpu, 0x4e21, 0xb5);
+  mos6502_write(cpu, 0x4e22, 0xa5);
+
+  mos6502_write(cpu, 0x00FF, 89);
 
-  cpu->bus.write(cpu, 0x4e20, 0xd4);
-  cpu->bus.write(cpu, 0x4e21, 0xb5);
-  cpu->bus.write(cpu, 0x4e22, 0xa5);
+  if (useexitport)
+    mapport(cpu, exitport);
+  if (useinputport && (!useexitport || (inputport ^ exitport) & 0xFF00))
+    mapport(cpu, inputport);
 
-  cpu->bus.write(cpu, 0x00FF, 89);
+  // Static analysis of the loaded image, attached once the run is set up
+  MOS6502Cfg *cfg = NULL;
+  if (cfgpath) {
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    cfg = mos6502_cfgbuild(cpu, NULL, 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (!cfg || !mos6502_cfgwrite(cfg, cfgpath)) {
+      printfc(RED, "Error: 'cfg' failed!\n");
+      exit(EXIT_FAILURE);
+    }
+
+    printfc(WHITE, "[-] CFG: %" PRIu32 " blocks, %" PRIu32
+            " instructions, %" PRIu32 " data regions (%.6f s)\n\n",
+            cfg->nblocks, cfg->instructions, cfg->ndata,
+            elapsedseconds(&start, &end));
+  }
+
+  if (tracepath && !mos6502_tracestart(cpu, tracepath)) {
+    printfc(RED, "Error: 'trace start' failed!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (foldedpath && !mos6502_profilestart(cpu)) {
+    printfc(RED, "Error: 'profile start' failed!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Headless Run
+  if (headless) {
+    struct timespec start, end;
+
+    cpu->breakpoint = target;
+    mos6502_sethaltop(cpu, NOP);
+    mos6502_sethaltop(cpu, BRK);
+    mos6502_cfgattach(cpu, cfg);
+
+    uint64_t nmiwhen = nmiperiod;
+    if (nmiperiod && !mos6502_schedule(cpu, nmiwhen, nmitimer, &nmiwhen)) {
+      printfc(RED, "Error: 'schedule' failed!\n");
+      exit(EXIT_FAILURE);
+    }
+
+    // The pokes above are part of the program, only inputs from here on
+    if (recordpath && !mos6502_recordstart(cpu, recordpath)) {
+      printfc(RED, "Error: 'record start' failed!\n");
+      exit(EXIT_FAILURE);
+    }
+
+    if (replaypath && !mos6502_replaystart(cpu, replaypath)) {
+      printfc(RED, "Error: '%s' is not a replay log!\n", replaypath);
+      exit(EXIT_FAILURE);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    runheadless(cpu, maxinstructions, maxcycles);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = elapsedseconds(&start, &end);
+    // Only what actually ran, fast-forwarded idle loops have their own line
+    uint64_t executed = cpu->instructions - cpu->idle.skippedinstructions;
+    double mips = seconds > 0 ? executed / seconds / 1e6 : 0;
+
+    printfc(WHITE, "[-] Engine: %s\n", enginesstr[cpu->engine]);
+    printfc(WHITE, "[-] Stop: %s (PC: 0x%04X)\n", stopreason(cpu), cpu->PC);
+    printfc(WHITE, "[-] Instructions: %" PRIu64 "\n", cpu->instructions);
+    printfc(WHITE, "[-] Cycles: %" PRIu64 "\n", cpu->cycles);
+    printfc(WHITE, "[-] Elapsed: %.6f s\n", seconds);
+    printfc(WHITE, "[-] MIPS: %.2f\n", mips);
+    if (cpu->idle.skipped)
+      printfc(WHITE,
+              "[-] Idle: %" PRIu64 " cycles, %" PRIu64
+              " instructions skipped\n",
+              cpu->idle.skipped, cpu->idle.skippedinstructions);
+    reportfusion(cpu);
+    if (nmiperiod)
+      printfc(WHITE, "[-] NMIs: %" PRIu64 "\n", nmicount);
+    if (cpu->replay)
+      printfc(WHITE, "[-] %s: %" PRIu64 " inputs\n",
+              recordpath ? "Recorded" : "Replayed", mos6502_replaystop(cpu));
+    if (cpu->mapper)
+      printfc(WHITE, "[-] Bank switches: %" PRIu64 " (%" PRIu32
+              " banks loaded)\n", cpu->mapper->switches, cpu->mapper->loaded);
+    if (tracepath)
+      printfc(WHITE, "[-] Trace: %" PRIu64 " records\n",
+              mos6502_tracestop(cpu));
+    printf("\n");
+    mos6502_printregisters(cpu);
+
+    if (foldedpath)
+      report(cpu, foldedpath);
+
+    mos6502_uninit(cpu);
+    mos6502_programclose(program);
+    return EXIT_SUCCESS;
+  }
+
+  mos6502_cfgattach(cpu, cfg);
 
   // Exec Loop
   while (1) {
@@ -87,8 +532,12 @@ int main(int argc, char **argv) {
       break;
     }
   }
-  
+
   mos6502_printopcodes();
+  if (foldedpath)
+    report(cpu, foldedpath);
+
   mos6502_uninit(cpu);
+  mos6502_programclose(program);
   return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
@@ -0,0 +1,175 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "6502.h"
+#include "mapper.h"
+
+const MOS6502MapperKind mapperkinds[] = {
+    {"uxrom", 0x4000, 2, {{0x8000, 0, 1, 0x8000, 0xFFFF},
+                          {0xC000, -1, 0, 0, 0}}},
+    {"bank8", 0x2000, 4, {{0x8000, 0, 1, 0x8000, 0x9FFF},
+                          {0xA000, 1, 1, 0xA000, 0xBFFF},
+                          {0xC000, 2, 1, 0xC000, 0xDFFF},
+                          {0xE000, -1, 0, 0, 0}}},
+};
+
+const size_t nmapperkinds = sizeof(mapperkinds) / sizeof(mapperkinds[0]);
+
+const MOS6502MapperKind *mos6502_mapperkind(const char *name) {
+  for (size_t i = 0; i < nmapperkinds; i++)
+    if (!strcmp(mapperkinds[i].name, name))
+      return &mapperkinds[i];
+
+  return NULL;
+}
+
+// Bank bytes, read from the file on first use. Whole banks are mapped,
+// a short last bank is read into a zeroed copy.
+static const uint8_t *bankbytes(MOS6502Mapper *mapper, uint32_t bank) {
+  if (mapper->banks[bank])
+    return mapper->banks[bank];
+
+  uint32_t size = mapper->kind->banksize;
+  off_t offset = (off_t)bank * size;
+  uint8_t *bytes = MAP_FAILED;
+
+  if (offset + size <= mapper->filesize)
+    bytes = mmap(NULL, size, PROT_READ, MAP_PRIVATE, mapper->fd, offset);
+
+  if (bytes != MAP_FAILED) {
+    mapper->mapped[bank] = 1;
+  } else {
+    bytes = calloc(1, size);
+    if (!bytes)
+      return NULL;
+
+    if (pread(mapper->fd, bytes, size, offset) < 0) {
+      free(bytes);
+      return NULL;
+    }
+  }
+
+  mapper->banks[bank] = bytes;
+  mapper->loaded++;
+  return bytes;
+}
+
+uint8_t mos6502_mapperselect(MOS6502 *cpu, uint8_t window, uint32_t bank) {
+  MOS6502Mapper *mapper = cpu->mapper;
+  if (!mapper || window >= mapper->kind->nwindows || bank >= mapper->nbanks)
+    return 0;
+
+  const uint8_t *bytes = bankbytes(mapper, bank);
+  if (!bytes)
+    return 0;
+
+  mos6502_mapbank(cpu, mapper->kind->windows[window].addr,
+                  mapper->kind->banksize, bytes);
+  mapper->selected[window] = bank;
+  mapper->switches++;
+  return 1;
+}
+
+static uint8_t mapperwrite(MOS6502 *cpu, uint16_t addr, uint8_t data) {
+  MOS6502Mapper *mapper = cpu->mapper;
+  const MOS6502MapperKind *kind = mapper->kind;
+
+  for (uint8_t i = 0; i < kind->nwindows; i++) {
+    const MOS6502MapperWindow *window = &kind->windows[i];
+
+    if (window->switchable && addr >= window->regfirst &&
+        addr <= window->reglast)
+      return mos6502_mapperselect(cpu, i, data % mapper->nbanks);
+  }
+
+  return 0;
+}
+
+uint8_t mos6502_mapperstart(MOS6502 *cpu, const MOS6502MapperKind *kind,
+                            const char *path) {
+  mos6502_mapperstop(cpu);
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+    close(fd);
+    return 0;
+  }
+
+  MOS6502Mapper *mapper = calloc(1, sizeof(MOS6502Mapper));
+  if (!mapper) {
+    close(fd);
+    return 0;
+  }
+
+  mapper->kind = kind;
+  mapper->fd = fd;
+  mapper->filesize = st.st_size;
+  mapper->nbanks = (mapper->filesize + kind->banksize - 1) / kind->banksize;
+  mapper->banks = calloc(mapper->nbanks, sizeof(uint8_t *));
+  mapper->mapped = calloc(mapper->nbanks, 1);
+  cpu->mapper = mapper;
+
+  if (!mapper->banks || !mapper->mapped) {
+    mos6502_mapperstop(cpu);
+    return 0;
+  }
+
+  for (uint8_t i = 0; i < kind->nwindows; i++) {
+    const MOS6502MapperWindow *window = &kind->windows[i];
+    int64_t bank = window->bank < 0 ? (int64_t)mapper->nbanks + window->bank
+                                    : window->bank;
+
+    // Small images repeat
+    bank %= mapper->nbanks;
+    if (bank < 0)
+      bank += mapper->nbanks;
+
+    if (!mos6502_mapperselect(cpu, i, bank)) {
+      mos6502_mapperstop(cpu);
+      return 0;
+    }
+
+    if (window->switchable)
+      mos6502_mapcontrol(cpu, window->regfirst,
+                         window->reglast - window->regfirst + 1, mapperwrite);
+  }
+
+  mapper->switches = 0;
+  mos6502_reset(cpu);
+  return 1;
+}
+
+void mos6502_mapperstop(MOS6502 *cpu) {
+  MOS6502Mapper *mapper = cpu->mapper;
+  if (!mapper)
+    return;
+
+  // Back to plain RAM before the banks go away
+  const MOS6502MapperKind *kind = mapper->kind;
+  for (uint8_t i = 0; i < kind->nwindows; i++)
+    mos6502_mapram(cpu, kind->windows[i].addr, kind->banksize, NULL);
+
+  for (uint32_t i = 0; mapper->banks && i < mapper->nbanks; i++) {
+    if (!mapper->banks[i])
+      continue;
+
+    if (mapper->mapped[i])
+      munmap(mapper->banks[i], kind->banksize);
+    else
+      free(mapper->banks[i]);
+  }
+
+  free(mapper->banks);
+  free(mapper->mapped);
+  close(mapper->fd);
+  free(mapper);
+  cpu->mapper = NULL;
+}
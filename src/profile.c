@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "6502.h"
+#include "cfg.h"
+#include "debug.h"
+#include "profile.h"
+
+#define PROFILENODES 256 // Initial call tree size
+
+uint8_t mos6502_profilestart(MOS6502 *cpu) {
+  mos6502_profilestop(cpu);
+
+  MOS6502Profile *profile = calloc(1, sizeof(MOS6502Profile));
+  if (!profile)
+    return 0;
+
+  profile->nodes = calloc(PROFILENODES, sizeof(MOS6502ProfileNode));
+  if (!profile->nodes) {
+    free(profile);
+    return 0;
+  }
+
+  profile->nnodes = 1; // Root
+  profile->maxnodes = PROFILENODES;
+  cpu->profile = profile;
+
+  return 1;
+}
+
+void mos6502_profilestop(MOS6502 *cpu) {
+  if (!cpu->profile)
+    return;
+
+  free(cpu->profile->nodes);
+  free(cpu->profile);
+  cpu->profile = NULL;
+}
+
+// Call tree -----------------------------------------
+// Child of parent for a call to addr, 0 when it can't be allocated
+static uint32_t childnode(MOS6502Profile *profile, uint32_t parent,
+                          uint16_t addr) {
+  MOS6502ProfileNode *nodes = profile->nodes;
+
+  for (uint32_t i = nodes[parent].child; i; i = nodes[i].sibling)
+    if (nodes[i].addr == addr)
+      return i;
+
+  if (profile->nnodes == profile->maxnodes) {
+    nodes = realloc(nodes, 2 * profile->maxnodes * sizeof(MOS6502ProfileNode));
+    if (!nodes)
+      return 0;
+
+    profile->nodes = nodes;
+    profile->maxnodes *= 2;
+  }
+
+  uint32_t node = profile->nnodes++;
+  nodes[node].addr = addr;
+  nodes[node].parent = parent;
+  nodes[node].child = 0;
+  nodes[node].sibling = nodes[parent].child;
+  nodes[node].cycles = 0;
+  nodes[parent].child = node;
+
+  return node;
+}
+
+void mos6502_profilecall(MOS6502Profile *profile, uint8_t opcode,
+                         uint16_t target) {
+  if (opcode == PROFILEJSR) {
+    uint32_t node = 0;
+    if (profile->depth < PROFILEMAXDEPTH)
+      node = childnode(profile, profile->frames[profile->depth].node, target);
+
+    // Untracked, its RTS is skipped too
+    if (!node) {
+      profile->overflow++;
+      profile->lost++;
+      return;
+    }
+
+    MOS6502ProfileFrame *frame = &profile->frames[++profile->depth];
+    frame->node = node;
+    frame->entry = profile->cycles;
+
+    profile->subroutines[target].calls++;
+    profile->subroutines[target].active++;
+    return;
+  }
+
+  if (profile->overflow) {
+    profile->overflow--;
+    return;
+  }
+
+  // RTS without a JSR, stack games
+  if (!profile->depth) {
+    profile->lost++;
+    return;
+  }
+
+  MOS6502ProfileFrame *frame = &profile->frames[profile->depth--];
+  MOS6502ProfileSubroutine *subroutine =
+      &profile->subroutines[profile->nodes[frame->node].addr];
+
+  if (!--subroutine->active)
+    subroutine->inclusive += profile->cycles - frame->entry;
+}
+
+// Report -------------------------------------------
+typedef struct profilerow {
+  uint32_t key; // PC, opcode, subroutine address or block index
+  uint64_t count;
+  uint64_t cycles;
+  uint64_t exclusive;
+} MOS6502ProfileRow;
+
+static int bycycles(const void *a, const void *b) {
+  uint64_t x = ((const MOS6502ProfileRow *)a)->cycles;
+  uint64_t y = ((const MOS6502ProfileRow *)b)->cycles;
+
+  return (x < y) - (x > y);
+}
+
+static double percent(uint64_t part, uint64_t total) {
+  return total ? 100.0 * part / total : 0;
+}
+
+static void reportpcs(MOS6502 *cpu, MOS6502Profile *profile,
+                      MOS6502ProfileRow *rows) {
+  size_t n = 0;
+  for (uint32_t pc = 0; pc < RAM; pc++)
+    if (profile->pcs[pc].count)
+      rows[n++] = (MOS6502ProfileRow){pc, profile->pcs[pc].count,
+                                      profile->pcs[pc].cycles, 0};
+  qsort(rows, n, sizeof(MOS6502ProfileRow), bycycles);
+
+  printfc(WHITE, "\nHot instructions\n");
+  printfc(WHITE, "%12s %7s %12s\n", "cycles", "%", "count");
+  for (size_t i = 0; i < n && i < PROFILETOP; i++) {
+    printfc(YELLOW, "%12" PRIu64 " %6.2f%% %12" PRIu64 "  ", rows[i].cycles,
+            percent(rows[i].cycles, profile->cycles), rows[i].count);
+    mos6502_disassemble(cpu, mos6502_read(cpu, rows[i].key), rows[i].key);
+  }
+}
+
+// Counts of the instructions of each block of the attached CFG
+static void reportblocks(MOS6502Cfg *cfg, MOS6502Profile *profile,
+                         MOS6502ProfileRow *rows) {
+  size_t n = 0;
+  for (uint32_t i = 0; i < cfg->nblocks; i++) {
+    const MOS6502CfgBlock *block = &cfg->blocks[i];
+    uint64_t cycles = 0;
+
+    for (uint32_t at = 0; at < block->size; at++) {
+      uint16_t pc = block->start + at;
+      if (cfg->flags[pc] & CFGINSTRUCTION)
+        cycles += profile->pcs[pc].cycles;
+    }
+
+    if (cycles)
+      rows[n++] = (MOS6502ProfileRow){i, profile->pcs[block->start].count,
+                                      cycles, 0};
+  }
+  qsort(rows, n, sizeof(MOS6502ProfileRow), bycycles);
+
+  printfc(WHITE, "\nHot blocks\n");
+  printfc(WHITE, "%12s %7s %12s\n", "cycles", "%", "entries");
+  for (size_t i = 0; i < n && i < PROFILETOP; i++) {
+    const MOS6502CfgBlock *block = &cfg->blocks[rows[i].key];
+
+    printfc(YELLOW, "%12" PRIu64 " %6.2f%% %12" PRIu64 "  ", rows[i].cycles,
+            percent(rows[i].cycles, profile->cycles), rows[i].count);
+    printfc(WHITE, "%04x-%04x (%" PRIu32 " instructions)\n", block->start,
+            (uint16_t)(block->start + block->size - 1), block->instructions);
+  }
+}
+
+static void reportopcodes(MOS6502Profile *profile, MOS6502ProfileRow *rows) {
+  size_t n = 0;
+  for (uint32_t op = 0; op < MAXOPCODESTABLE; op++)
+    if (profile->opcodes[op].count)
+      rows[n++] = (MOS6502ProfileRow){op, profile->opcodes[op].count,
+                                      profile->opcodes[op].cycles, 0};
+  qsort(rows, n, sizeof(MOS6502ProfileRow), bycycles);
+
+  printfc(WHITE, "\nOpcodes\n");
+  printfc(WHITE, "%12s %7s %12s\n", "cycles", "%", "count");
+  for (size_t i = 0; i < n; i++) {
+    printfc(YELLOW, "%12" PRIu64 " %6.2f%% %12" PRIu64 "  ", rows[i].cycles,
+            percent(rows[i].cycles, profile->cycles), rows[i].count);
+    printfc(WHITE, "%s (0x%02x)\n", opcodes[rows[i].key].mnemonic,
+            rows[i].key);
+  }
+}
+
+static void reportsubroutines(MOS6502Profile *profile,
+                              MOS6502ProfileRow *rows) {
+  uint64_t *exclusive = calloc(RAM, sizeof(uint64_t));
+  if (!exclusive)
+    return;
+
+  for (uint32_t i = 1; i < profile->nnodes; i++)
+    exclusive[profile->nodes[i].addr] += profile->nodes[i].cycles;
+
+  // Calls still on the stack count up to now
+  uint64_t inclusive[PROFILEMAXDEPTH + 1];
+  for (uint32_t d = 1; d <= profile->depth; d++) {
+    uint16_t addr = profile->nodes[profile->frames[d].node].addr;
+    uint32_t outer = 1;
+    while (profile->nodes[profile->frames[outer].node].addr != addr)
+      outer++;
+    inclusive[d] = outer == d ? profile->cycles - profile->frames[d].entry : 0;
+  }
+
+  size_t n = 0;
+  for (uint32_t addr = 0; addr < RAM; addr++) {
+    MOS6502ProfileSubroutine *subroutine = &profile->subroutines[addr];
+    if (!subroutine->calls)
+      continue;
+
+    uint64_t cycles = subroutine->inclusive;
+    for (uint32_t d = 1; d <= profile->depth; d++)
+      if (profile->nodes[profile->frames[d].node].addr == addr)
+        cycles += inclusive[d];
+
+    rows[n++] = (MOS6502ProfileRow){addr, subroutine->calls, cycles,
+                                    exclusive[addr]};
+  }
+  qsort(rows, n, sizeof(MOS6502ProfileRow), bycycles);
+  free(exclusive);
+
+  printfc(WHITE, "\nSubroutines\n");
+  printfc(WHITE, "%12s %7s %12s %7s %12s\n", "inclusive", "%", "exclusive",
+          "%", "calls");
+  printfc(YELLOW, "%12" PRIu64 " %6.2f%% %12" PRIu64 " %6.2f%% %12s  ",
+          profile->cycles, percent(profile->cycles, profile->cycles),
+          profile->nodes[0].cycles,
+          percent(profile->nodes[0].cycles, profile->cycles), "-");
+  printfc(WHITE, "main\n");
+  for (size_t i = 0; i < n; i++) {
+    printfc(YELLOW, "%12" PRIu64 " %6.2f%% %12" PRIu64 " %6.2f%% %12" PRIu64
+            "  ", rows[i].cycles, percent(rows[i].cycles, profile->cycles),
+            rows[i].exclusive, percent(rows[i].exclusive, profile->cycles),
+            rows[i].count);
+    printfc(WHITE, "sub_%04x\n", rows[i].key);
+  }
+
+  if (profile->lost)
+    printfc(RED, "\n%" PRIu64 " JSR/RTS not matched\n", profile->lost);
+}
+
+static uint8_t writefolded(MOS6502Profile *profile, const char *path) {
+  FILE *file = fopen(path, "w");
+  if (!file)
+    return 0;
+
+  for (uint32_t i = 0; i < profile->nnodes; i++) {
+    if (!profile->nodes[i].cycles)
+      continue;
+
+    // Root first
+    uint16_t stack[PROFILEMAXDEPTH];
+    int depth = 0;
+    for (uint32_t node = i; node; node = profile->nodes[node].parent)
+      stack[depth++] = profile->nodes[node].addr;
+
+    fprintf(file, "main");
+    while (depth--)
+      fprintf(file, ";sub_%04x", stack[depth]);
+    fprintf(file, " %" PRIu64 "\n", profile->nodes[i].cycles);
+  }
+
+  return fclose(file) == 0;
+}
+
+uint8_t mos6502_profilereport(MOS6502 *cpu, const char *folded) {
+  MOS6502Profile *profile = cpu->profile;
+  if (!profile)
+    return 0;
+
+  MOS6502ProfileRow *rows = malloc(RAM * sizeof(MOS6502ProfileRow));
+  if (!rows)
+    return 0;
+
+  printfc(WHITE, "[-] Profile: %" PRIu64 " instructions, %" PRIu64
+          " interrupts, %" PRIu64 " cycles\n", profile->instructions,
+          profile->interrupts.count, profile->cycles);
+  reportpcs(cpu, profile, rows);
+  if (cpu->cfg)
+    reportblocks(cpu->cfg, profile, rows);
+  reportopcodes(profile, rows);
+  reportsubroutines(profile, rows);
+  printf("\n");
+  free(rows);
+
+  return folded ? writefolded(profile, folded) : 1;
+}
@@ -0,0 +1,266 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "6502.h"
+#include "replay.h"
+
+#define REPLAYMAXENTRY 14 // Tag, 10 byte delta, address and value
+
+static uint8_t isinterrupt(uint8_t tag) {
+  tag &= ~REPLAYSAMEADDR;
+  return tag == INTNMI || tag == INTRESET || tag == INTIRQ;
+}
+
+static void diverged(MOS6502 *cpu) {
+  if (!cpu->halt || cpu->halt == HALTPENDING)
+    cpu->halt = HALTREPLAY;
+}
+
+// Recording ----------------------------------------
+static void flush(MOS6502Replay *replay) {
+  size_t done = 0;
+
+  while (!replay->failed && done < replay->used) {
+    ssize_t written =
+        write(replay->fd, replay->buffer + done, replay->used - done);
+    if (written <= 0)
+      replay->failed = 1;
+    else
+      done += written;
+  }
+
+  replay->used = 0;
+}
+
+static void append(MOS6502 *cpu, uint8_t tag, uint16_t addr, uint8_t value) {
+  MOS6502Replay *replay = cpu->replay;
+
+  if (replay->used + REPLAYMAXENTRY > REPLAYBUFFER)
+    flush(replay);
+
+  uint8_t *out = replay->buffer + replay->used;
+  uint64_t delta = cpu->cycles - replay->last;
+
+  if (tag == REPLAYREAD && addr == replay->lastaddr)
+    tag |= REPLAYSAMEADDR;
+  *out++ = tag;
+
+  do {
+    *out++ = (delta & 0x7F) | (delta > 0x7F ? 0x80 : 0);
+    delta >>= 7;
+  } while (delta);
+
+  if (tag == REPLAYREAD) {
+    *out++ = addr & 0xFF;
+    *out++ = addr >> 8;
+  }
+  if (!isinterrupt(tag)) {
+    *out++ = value;
+    replay->lastaddr = addr;
+  }
+
+  replay->used = out - replay->buffer;
+  replay->last = cpu->cycles;
+  replay->entries++;
+}
+
+void mos6502_recordinterrupt(MOS6502 *cpu, uint8_t line) {
+  append(cpu, line, 0, 0);
+}
+
+// Replaying ----------------------------------------
+// Decodes the entry at replay->at into replay->next
+static void advance(MOS6502Replay *replay) {
+  const uint8_t *in = replay->map + replay->at;
+  const uint8_t *end = replay->map + replay->mapsize;
+  MOS6502ReplayEntry *next = &replay->next;
+  uint64_t delta = 0;
+
+  replay->hasnext = 0;
+  if (in >= end)
+    return;
+
+  next->tag = *in++;
+  if (next->tag != REPLAYREAD && next->tag != (REPLAYREAD | REPLAYSAMEADDR) &&
+      !isinterrupt(next->tag))
+    return;
+
+  for (uint8_t shift = 0;; shift += 7) {
+    if (in >= end || shift > 63)
+      return;
+
+    delta |= (uint64_t)(*in & 0x7F) << shift;
+    if (!(*in++ & 0x80))
+      break;
+  }
+
+  next->cycles = replay->last + delta;
+  next->addr = replay->lastaddr;
+
+  if (next->tag == REPLAYREAD) {
+    if (end - in < 2)
+      return;
+    next->addr = in[0] | in[1] << 8;
+    in += 2;
+  }
+  if (!isinterrupt(next->tag)) {
+    if (in >= end)
+      return;
+    next->value = *in++;
+  }
+
+  replay->at = in - replay->map;
+  replay->hasnext = 1;
+}
+
+// Moves past replay->next
+static void consume(MOS6502 *cpu, MOS6502Replay *replay) {
+  replay->last = replay->next.cycles;
+  if (!isinterrupt(replay->next.tag))
+    replay->lastaddr = replay->next.addr;
+  replay->entries++;
+
+  advance(replay);
+
+  // The engine was told to run past it
+  if (replay->hasnext && isinterrupt(replay->next.tag))
+    mos6502_attention(cpu);
+}
+
+uint8_t mos6502_replayinterrupt(MOS6502 *cpu) {
+  MOS6502Replay *replay = cpu->replay;
+
+  if (!replay->hasnext || !isinterrupt(replay->next.tag) ||
+      replay->next.cycles > cpu->cycles)
+    return 0;
+
+  if (replay->next.cycles < cpu->cycles) {
+    diverged(cpu);
+    return 0;
+  }
+
+  uint8_t line = replay->next.tag;
+  consume(cpu, replay);
+  return line;
+}
+
+uint64_t mos6502_replaynext(MOS6502 *cpu) {
+  MOS6502Replay *replay = cpu->replay;
+
+  return replay->hasnext && isinterrupt(replay->next.tag) ? replay->next.cycles
+                                                          : UINT64_MAX;
+}
+
+// Both ---------------------------------------------
+uint8_t mos6502_replayread(MOS6502 *cpu, uint16_t addr) {
+  MOS6502Replay *replay = cpu->replay;
+
+  if (replay->mode == REPLAYRECORD) {
+    uint8_t value = mos6502_ioread(cpu, addr);
+
+    append(cpu, REPLAYREAD, addr, value);
+    return value;
+  }
+
+  if (!replay->hasnext || isinterrupt(replay->next.tag) ||
+      replay->next.addr != addr) {
+    diverged(cpu);
+    return 0xFF;
+  }
+
+  uint8_t value = replay->next.value;
+  consume(cpu, replay);
+  return value;
+}
+
+uint8_t mos6502_recordstart(MOS6502 *cpu, const char *path) {
+  mos6502_replaystop(cpu);
+
+  MOS6502Replay *replay = calloc(1, sizeof(MOS6502Replay));
+  if (!replay)
+    return 0;
+
+  replay->mode = REPLAYRECORD;
+  replay->last = cpu->cycles;
+  replay->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+
+  MOS6502ReplayHeader header = {0};
+  memcpy(header.magic, REPLAYMAGIC, sizeof(REPLAYMAGIC));
+  header.version = REPLAYVERSION;
+  header.startcycles = cpu->cycles;
+
+  if (replay->fd < 0 ||
+      write(replay->fd, &header, sizeof(header)) != sizeof(header)) {
+    if (replay->fd >= 0)
+      close(replay->fd);
+    free(replay);
+    return 0;
+  }
+
+  cpu->replay = replay;
+  return 1;
+}
+
+uint8_t mos6502_replaystart(MOS6502 *cpu, const char *path) {
+  mos6502_replaystop(cpu);
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(MOS6502ReplayHeader)) {
+    close(fd);
+    return 0;
+  }
+
+  const uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return 0;
+
+  const MOS6502ReplayHeader *header = (const MOS6502ReplayHeader *)map;
+  MOS6502Replay *replay = NULL;
+
+  if (memcmp(header->magic, REPLAYMAGIC, sizeof(REPLAYMAGIC)) ||
+      header->version != REPLAYVERSION ||
+      !(replay = calloc(1, sizeof(MOS6502Replay)))) {
+    munmap((void *)map, st.st_size);
+    return 0;
+  }
+
+  // Cycles are relative to the start, the guest can start anywhere
+  replay->mode = REPLAYPLAY;
+  replay->fd = -1;
+  replay->last = cpu->cycles;
+  replay->map = map;
+  replay->mapsize = st.st_size;
+  replay->at = sizeof(MOS6502ReplayHeader);
+  advance(replay);
+
+  cpu->replay = replay;
+  return 1;
+}
+
+uint64_t mos6502_replaystop(MOS6502 *cpu) {
+  MOS6502Replay *replay = cpu->replay;
+  if (!replay)
+    return 0;
+
+  if (replay->mode == REPLAYRECORD) {
+    flush(replay);
+    close(replay->fd);
+  } else {
+    munmap((void *)replay->map, replay->mapsize);
+  }
+
+  uint64_t entries = replay->failed ? 0 : replay->entries;
+  free(replay);
+  cpu->replay = NULL;
+
+  return entries;
+}
@@ -0,0 +1,124 @@
+#include <stdlib.h>
+
+#include "6502.h"
+#include "scheduler.h"
+
+#define SCHEDULEREVENTS 16 // Initial heap size
+
+// Heap ---------------------------------------------
+static void swap(MOS6502Event *heap, uint32_t a, uint32_t b) {
+  MOS6502Event event = heap[a];
+  heap[a] = heap[b];
+  heap[b] = event;
+}
+
+static void siftup(MOS6502Event *heap, uint32_t i) {
+  while (i && heap[(i - 1) / 2].when > heap[i].when) {
+    swap(heap, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+static void siftdown(MOS6502Event *heap, uint32_t n, uint32_t i) {
+  for (;;) {
+    uint32_t smallest = i;
+    uint32_t left = 2 * i + 1, right = 2 * i + 2;
+
+    if (left < n && heap[left].when < heap[smallest].when)
+      smallest = left;
+    if (right < n && heap[right].when < heap[smallest].when)
+      smallest = right;
+    if (smallest == i)
+      return;
+
+    swap(heap, i, smallest);
+    i = smallest;
+  }
+}
+
+static void removeevent(MOS6502Scheduler *scheduler, uint32_t i) {
+  MOS6502Event *heap = scheduler->heap;
+
+  heap[i] = heap[--scheduler->nevents];
+  if (i == scheduler->nevents)
+    return;
+
+  siftup(heap, i);
+  siftdown(heap, scheduler->nevents, i);
+}
+
+// Scheduler ----------------------------------------
+uint32_t mos6502_schedule(MOS6502 *cpu, uint64_t when, eventfunc func,
+                          void *data) {
+  MOS6502Scheduler *scheduler = cpu->scheduler;
+
+  if (!scheduler) {
+    scheduler = calloc(1, sizeof(MOS6502Scheduler));
+    if (!scheduler)
+      return 0;
+
+    scheduler->until = UINT64_MAX;
+    cpu->scheduler = scheduler;
+  }
+
+  if (scheduler->nevents == scheduler->maxevents) {
+    uint32_t max = scheduler->maxevents ? 2 * scheduler->maxevents
+                                        : SCHEDULEREVENTS;
+    MOS6502Event *heap = realloc(scheduler->heap, max * sizeof(MOS6502Event));
+    if (!heap)
+      return 0;
+
+    scheduler->heap = heap;
+    scheduler->maxevents = max;
+  }
+
+  // 0 is never an id
+  if (!++scheduler->nextid)
+    scheduler->nextid = 1;
+
+  uint32_t i = scheduler->nevents++;
+  scheduler->heap[i] = (MOS6502Event){when, scheduler->nextid, func, data};
+  siftup(scheduler->heap, i);
+
+  // Earlier than the engine was told to stop, have it stop sooner
+  if (when < scheduler->until)
+    mos6502_attention(cpu);
+
+  return scheduler->nextid;
+}
+
+uint8_t mos6502_unschedule(MOS6502 *cpu, uint32_t id) {
+  MOS6502Scheduler *scheduler = cpu->scheduler;
+  if (!scheduler)
+    return 0;
+
+  for (uint32_t i = 0; i < scheduler->nevents; i++) {
+    if (scheduler->heap[i].id == id) {
+      removeevent(scheduler, i);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+void mos6502_runevents(MOS6502 *cpu) {
+  MOS6502Scheduler *scheduler = cpu->scheduler;
+
+  while (scheduler && scheduler->nevents &&
+         scheduler->heap[0].when <= cpu->cycles) {
+    MOS6502Event event = scheduler->heap[0];
+
+    removeevent(scheduler, 0);
+    event.func(cpu, event.data);
+  }
+}
+
+void mos6502_schedulerfree(MOS6502 *cpu) {
+  if (!cpu->scheduler)
+    return;
+
+  free(cpu->scheduler->heap);
+  free(cpu->scheduler);
+  cpu->scheduler = NULL;
+}
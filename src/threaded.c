@@ -0,0 +1,84 @@
+#include <string.h>
+
+#include "6502.h"
+#include "engines.h"
+#include "instructions.h"
+
+#ifndef __GNUC__
+#error "The threaded engine needs GCC labels as values (computed goto)"
+#endif
+
+#define READ(addr) mos6502_read(cpu, (addr))
+
+// Operand bytes after the opcode for every addressing mode, the rest is
+// done by the specialized handler, inlined into its label
+#define OPERAND_IMP 0
+#define OPERAND_ACC 0
+#define OPERAND_IMM READ(cpu->PC + 1)
+#define OPERAND_ZP0 READ(cpu->PC + 1)
+#define OPERAND_ZP0X READ(cpu->PC + 1)
+#define OPERAND_ZP0Y READ(cpu->PC + 1)
+#define OPERAND_RELT READ(cpu->PC + 1)
+#define OPERAND_ABS (READ(cpu->PC + 2) << 8 | READ(cpu->PC + 1))
+#define OPERAND_ABSX OPERAND_ABS
+#define OPERAND_ABSY OPERAND_ABS
+
+// Not implemented by the core yet, their handlers return 0
+#define OPERAND_IND 0
+#define OPERAND_IDEIND 0
+#define OPERAND_INDIDE 0
+#define OPERAND_ILL 0
+
+#define JMPABS 0x4C
+
+#define NEXT                                                                   \
+  if (cpu->cycles >= deadline || cpu->halt)                                    \
+    goto done;                                                                 \
+  if (cpu->PC == cpu->breakpoint) {                                            \
+    cpu->halt = HALTBREAK;                                                     \
+    goto done;                                                                 \
+  }                                                                            \
+  goto *dispatch[READ(cpu->PC)];
+
+uint64_t mos6502_runthreaded(MOS6502 *cpu, uint64_t deadline) {
+  static void *const labels[MAXOPCODESTABLE] = {
+#define OPCODE(opcode, mnemonic, exec, mode, ncycles, penalty) &&op_##opcode,
+#include "opcodes.def"
+#undef OPCODE
+  };
+
+  uint64_t start = cpu->cycles;
+  void *dispatch[MAXOPCODESTABLE];
+
+  // Per run copy, so halt opcodes cost nothing on the other labels
+  memcpy(dispatch, labels, sizeof(dispatch));
+  for (int i = 0; i < MAXOPCODESTABLE; i++) {
+    if (ishaltop(cpu, i))
+      dispatch[i] = &&haltop;
+  }
+
+  NEXT;
+
+#define OPCODE(opcode, mnemonic, exec, mode, ncycles, penalty)                 \
+  op_##opcode : {                                                              \
+    uint16_t pc = cpu->PC;                                                     \
+    if (!execute_##opcode(cpu, OPERAND_##mode))                                \
+      goto illegal;                                                            \
+    if ((opcode == JMPABS || isbranchop(opcode)) && cpu->PC <= pc)             \
+      mos6502_backjump(cpu, pc, deadline);                                     \
+    NEXT;                                                                      \
+  }
+#include "opcodes.def"
+#undef OPCODE
+
+illegal:
+  cpu->halt = HALTILLEGAL;
+  goto done;
+
+haltop:
+  cpu->halt = HALTOPCODE;
+  goto done;
+
+done:
+  return cpu->cycles - start;
+}
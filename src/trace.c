@@ -0,0 +1,155 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "6502.h"
+#include "debug.h"
+#include "trace.h"
+
+#define TRACEMAPMIN (1 << 20)
+
+// Grows the file and its mapping to hold at least size bytes
+static uint8_t reserve(MOS6502Trace *trace, size_t size) {
+  if (size <= trace->mapsize)
+    return 1;
+
+  size_t mapsize = trace->mapsize ? trace->mapsize : TRACEMAPMIN;
+  while (mapsize < size)
+    mapsize *= 2;
+
+  if (ftruncate(trace->fd, mapsize) < 0)
+    return 0;
+
+  uint8_t *map =
+      mmap(NULL, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, trace->fd, 0);
+  if (map == MAP_FAILED)
+    return 0;
+
+  if (trace->map)
+    munmap(trace->map, trace->mapsize);
+  trace->map = map;
+  trace->mapsize = mapsize;
+
+  return 1;
+}
+
+void mos6502_traceflush(MOS6502Trace *trace) {
+  size_t offset = sizeof(MOS6502TraceHeader) +
+                  trace->count * sizeof(MOS6502TraceRecord);
+  size_t bytes = trace->used * sizeof(MOS6502TraceRecord);
+
+  if (!trace->failed && reserve(trace, offset + bytes)) {
+    memcpy(trace->map + offset, trace->ring, bytes);
+    trace->count += trace->used;
+  } else {
+    trace->failed = 1;
+  }
+
+  trace->used = 0;
+}
+
+uint8_t mos6502_tracestart(MOS6502 *cpu, const char *path) {
+  mos6502_tracestop(cpu);
+
+  MOS6502Trace *trace = malloc(sizeof(MOS6502Trace));
+  if (!trace)
+    return 0;
+
+  trace->used = 0;
+  trace->map = NULL;
+  trace->mapsize = 0;
+  trace->count = 0;
+  trace->failed = 0;
+
+  trace->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (trace->fd < 0 || !reserve(trace, sizeof(MOS6502TraceHeader))) {
+    if (trace->fd >= 0)
+      close(trace->fd);
+    free(trace);
+    return 0;
+  }
+
+  MOS6502TraceHeader *header = (MOS6502TraceHeader *)trace->map;
+  memset(header, 0, sizeof(MOS6502TraceHeader));
+  memcpy(header->magic, TRACEMAGIC, sizeof(TRACEMAGIC));
+  header->version = TRACEVERSION;
+  header->recordsize = sizeof(MOS6502TraceRecord);
+  header->startcycles = cpu->cycles;
+  cpu->trace = trace;
+
+  return 1;
+}
+
+uint64_t mos6502_tracestop(MOS6502 *cpu) {
+  MOS6502Trace *trace = cpu->trace;
+  if (!trace)
+    return 0;
+
+  mos6502_traceflush(trace);
+
+  MOS6502TraceHeader *header = (MOS6502TraceHeader *)trace->map;
+  header->count = trace->count;
+  header->endpc = cpu->PC;
+
+  size_t size = sizeof(MOS6502TraceHeader) +
+                trace->count * sizeof(MOS6502TraceRecord);
+  munmap(trace->map, trace->mapsize);
+  if (ftruncate(trace->fd, size) < 0)
+    trace->failed = 1;
+  close(trace->fd);
+
+  uint64_t count = trace->failed ? 0 : trace->count;
+  free(trace);
+  cpu->trace = NULL;
+
+  return count;
+}
+
+int64_t mos6502_tracedump(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(MOS6502TraceHeader)) {
+    close(fd);
+    return -1;
+  }
+
+  const uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return -1;
+
+  const MOS6502TraceHeader *header = (const MOS6502TraceHeader *)map;
+  size_t available =
+      (st.st_size - sizeof(MOS6502TraceHeader)) / sizeof(MOS6502TraceRecord);
+
+  if (memcmp(header->magic, TRACEMAGIC, sizeof(TRACEMAGIC)) ||
+      header->version != TRACEVERSION ||
+      header->recordsize != sizeof(MOS6502TraceRecord) ||
+      header->count > available) {
+    munmap((void *)map, st.st_size);
+    return -1;
+  }
+
+  const MOS6502TraceRecord *records =
+      (const MOS6502TraceRecord *)(map + sizeof(MOS6502TraceHeader));
+  uint64_t cycles = header->startcycles;
+
+  for (uint64_t i = 0; i < header->count; i++) {
+    uint16_t nextpc =
+        i + 1 < header->count ? records[i + 1].pc : header->endpc;
+
+    cycles += records[i].cycles;
+    mos6502_printtracerecord(&records[i], nextpc, cycles);
+  }
+
+  int64_t count = header->count;
+  munmap((void *)map, st.st_size);
+
+  return count;
+}